@@ -31,8 +31,17 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include "cgsi_plugin_int.h"
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include "gssapi_openssl.h"
 #include "globus_gsi_credential.h"
 #include "globus_openssl.h"
@@ -44,23 +53,103 @@ extern "C" {
 #ifdef __cplusplus
 }
 #endif
+
+/* Lifetime and maximum number of uses of a VOMS context, after which it is
+   created again to pick up changes of the vomsdir and certificate directory */
+#define CGSI_VOMS_CONTEXT_TTL 300
+#define CGSI_VOMS_CONTEXT_USES 1000
+
+/* VOMS context of a thread, reused from one connection to the next,
+   the attributes of the previous peer being deleted first */
+struct cgsi_voms_context
+{
+    struct vomsdata *vd;
+    time_t created;
+    int uses;
+};
+
+static pthread_key_t voms_context_key;
+static pthread_once_t voms_context_once = PTHREAD_ONCE_INIT;
 #endif
 
 #define BUFSIZE 1024
 #define TBUFSIZE 256
+#define SSLHSIZE 5
 
 static const char *client_plugin_id = CLIENT_PLUGIN_ID;
 static const char *server_plugin_id = SERVER_PLUGIN_ID;
 
+/* Process-wide credential cache, most recently used first */
+#define CGSI_CRED_CACHE_SIZE 32
+static pthread_mutex_t cred_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_cred_entry *cred_cache = NULL;
+
+/* Process-wide cache of the TLS sessions of the client, most recently used first.
+   The session to resume is handed to the SSL info callback through
+   thread-specific data, as GSI creates the SSL object in gss_init_sec_context() */
+static pthread_mutex_t session_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_session_entry *session_cache = NULL;
+static pthread_key_t session_pending_key;
+static pthread_once_t session_pending_once = PTHREAD_ONCE_INIT;
+
+/* fsend of gSOAP, the only transport the records are written around with sendmsg() */
+static int (*default_fsend)(struct soap*, const char*, size_t) = NULL;
+static pthread_once_t default_fsend_once = PTHREAD_ONCE_INIT;
+
+/* Server session cache, only there once enabled */
+static struct cgsi_server_session_cache *server_sessions = NULL;
+
+/* Process-wide caches of the reverse lookups and target names of the servers */
+static pthread_mutex_t resolve_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_resolve_entry *resolve_cache = NULL;
+static int resolve_threads = 0;
+static pthread_mutex_t name_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_name_entry *name_cache = NULL;
+
+/* Serialization of the client handshakes, see cgsi_plugin_set_gss_lock() */
+static pthread_mutex_t globus_gss = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t gss_lock_mode_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gss_lock_mode = CGSI_GSS_LOCK_ALL;
+
+/* Process-wide counters. They have their own lock, only ever held to
+   update or copy them, as they are updated on the data path */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_plugin_stats plugin_stats;
+
+/* Index of the gridmap file, replaced when the file changes */
+static pthread_mutex_t gridmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_gridmap *gridmap_current = NULL;
+static int gridmap_loading = 0;
+
+/* Process-wide cache of the CA and VOMS attributes of the peers */
+static pthread_mutex_t voms_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgsi_voms_entry *voms_cache[CGSI_VOMS_CACHE_BUCKETS];
+static int voms_cache_count = 0;
+
 static int server_cgsi_plugin_init(struct soap *soap, struct cgsi_plugin_data *data);
 static int server_cgsi_plugin_send(struct soap *soap, const char *buf, size_t len);
 static size_t server_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len);
 static int server_cgsi_plugin_accept(struct soap *soap);
 static int server_cgsi_plugin_close(struct soap *soap);
 static int server_cgsi_map_dn(struct soap *soap);
+static int server_cgsi_acquire_cred(struct soap *soap, struct cgsi_plugin_data *data);
+static int server_cgsi_accept_start(struct soap *soap, struct cgsi_plugin_data *data);
+static int server_cgsi_accept_token(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_t recv_tok);
+static int server_cgsi_accept_finish(struct soap *soap, struct cgsi_plugin_data *data);
+static void server_cgsi_accept_abort(struct cgsi_plugin_data *data);
+static int cgsi_plugin_step_read(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_t token);
+static int cgsi_plugin_step_write(struct soap *soap, struct cgsi_plugin_data *data);
 
 static int client_cgsi_plugin_init(struct soap *soap, struct cgsi_plugin_data *data);
 static int client_cgsi_plugin_open(struct soap *soap, const char *endpoint, const char *hostname, int port);
+static int client_cgsi_connect_start(struct soap *soap, struct cgsi_plugin_data *data, const char *hostname, int port);
+static int client_cgsi_connect_target(struct soap *soap, struct cgsi_plugin_data *data);
+static int client_cgsi_connect_token(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_t recv_tok);
+static int client_cgsi_connect_finish(struct soap *soap, struct cgsi_plugin_data *data);
+static void client_cgsi_connect_abort(struct cgsi_plugin_data *data);
+static void client_cgsi_connect_free_addrs(struct cgsi_plugin_data *data);
+static int client_cgsi_connect_next(struct soap *soap, struct cgsi_plugin_data *data);
+static int client_cgsi_connect_check(struct soap *soap, struct cgsi_plugin_data *data);
 static int client_cgsi_plugin_send(struct soap *soap, const char *buf, size_t len);
 static size_t client_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len);
 static int client_cgsi_plugin_close(struct soap *soap);
@@ -68,28 +157,70 @@ static int client_cgsi_plugin_close(struct soap *soap);
 static int cgsi_plugin_copy(struct soap *soap, struct soap_plugin *dst, struct soap_plugin *src);
 static void cgsi_plugin_delete(struct soap *soap, struct soap_plugin *p);
 static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, const char *plugin_id);
-static size_t cgsi_plugin_recv(struct soap *soap, char *buf, size_t len, const char *plugin_id);
+static int cgsi_plugin_wrap_send(struct soap *soap, struct cgsi_plugin_data *data, const char *buf, size_t len);
+static int cgsi_plugin_flush_send(struct soap *soap, struct cgsi_plugin_data *data);
+static int cgsi_plugin_writev(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_desc *toks, int ntoks);
+static int cgsi_plugin_wrap_send_records(struct soap *soap, struct cgsi_plugin_data *data, const char *buf, size_t len);
+static size_t cgsi_plugin_recv(struct soap *soap, struct cgsi_plugin_data *data, char *buf, size_t len);
+static int cgsi_plugin_recv_record(struct soap *soap, struct cgsi_plugin_data *data, char *buf, size_t len);
+static int cgsi_plugin_record_ready(struct cgsi_plugin_data *data);
+static int cgsi_plugin_can_ssl_read(struct cgsi_plugin_data *data);
+static int cgsi_plugin_ssl_read(struct soap *soap, struct cgsi_plugin_data *data, const void *token, size_t token_length, char *buf, size_t len);
 static int cgsi_plugin_close(struct soap *soap, const char *plugin_id);
 
 int cgsi_plugin_send_token(void *arg, void *token, size_t token_length);
 int cgsi_plugin_recv_token(void *arg, void **token, size_t *token_length);
+static int cgsi_plugin_write_token(struct soap *soap, struct cgsi_plugin_data *data, void *token, size_t token_length);
+static int cgsi_plugin_read_token(struct soap *soap, struct cgsi_plugin_data *data, void **token, size_t *token_length);
+static size_t cgsi_plugin_read(struct soap *soap, struct cgsi_plugin_data *data, char *buf, size_t len);
+static int cgsi_plugin_read_failed(struct soap *soap, const char *what, int header);
+static int cgsi_record_length(const char *readbuf);
+static int cgsi_plugin_fill(struct soap *soap, struct cgsi_plugin_data *data, size_t need);
+static int cgsi_plugin_recv_token_in_place(struct soap *soap, struct cgsi_plugin_data *data, void **token, size_t *token_length, int *allocated);
 void cgsi_plugin_print_token(struct cgsi_plugin_data *data, char *token, int length);
 static void cgsi_gssapi_err(struct soap *soap, const char *msg, OM_uint32 maj_stat, OM_uint32 min_stat);
 static void cgsi_err(struct soap *soap, const char *msg);
 static int cgsi_display_status_1(const char *m, OM_uint32 code, int type, char *buf, int buflen);
 static int cgsi_parse_opts(struct cgsi_plugin_data *p, void *arg, int isclient);
 static struct cgsi_plugin_data* get_plugin(struct soap *soap);
+static struct cgsi_plugin_data *cgsi_find_plugin(struct soap *soap, const char *id);
 static int setup_trace(struct cgsi_plugin_data *data);
 static int trace(struct cgsi_plugin_data *data, const char *tracestr);
 static int trace_str(struct cgsi_plugin_data *data, const char *msg, int len);
 static void cgsi_plugin_init_globus_modules(void);
 static int is_loopback(struct sockaddr *);
+static int cgsi_reverse_lookup(const struct sockaddr *peer, socklen_t peer_length, char *host, size_t size, const char **error);
+static void cgsi_resolve_cache_put(const struct sockaddr *sa, const char *host);
+static int cgsi_resolve_cache_get(const struct sockaddr *sa, socklen_t sa_length, char *host, size_t size);
+static int cgsi_resolve_start(const struct sockaddr *sa, socklen_t sa_length, struct cgsi_resolve_job **wait);
+static int cgsi_resolve_finish(struct cgsi_resolve_job *job, char *host, size_t size, const char **error);
+static OM_uint32 cgsi_import_target_name(OM_uint32 *minor_status, const char *service, gss_name_t *name);
 static void free_conn_state(struct cgsi_plugin_data *data);
+static void cgsi_plugin_count_records(struct cgsi_plugin_data *data);
+
+static int cgsi_cred_files_default(struct cgsi_cred_file *files);
+static int cgsi_cred_entry_valid(struct cgsi_cred_entry *entry, struct cgsi_cred_file *files, int nfiles);
+static struct cgsi_cred_entry *cgsi_cred_entry_load(struct soap *soap, struct cgsi_plugin_data *data, gss_cred_usage_t usage, int imported, struct cgsi_cred_file *files, int nfiles);
+static struct cgsi_cred_entry *cgsi_cred_cache_get(struct soap *soap, struct cgsi_plugin_data *data, gss_cred_usage_t usage, int imported, struct cgsi_cred_file *files, int nfiles);
+static void cgsi_cred_files_stat(struct cgsi_cred_file *files, const char **paths, int nfiles);
+static int cgsi_cred_import(struct soap *soap, const char *x509_cert, const char *x509_key, gss_cred_id_t *credential_handle);
+static void cgsi_cred_entry_release(struct cgsi_cred_entry *entry);
+static void cgsi_release_cred(struct cgsi_plugin_data *data);
+
+static void cgsi_ssl_info_callback(const SSL *ssl, int where, int ret);
+static void cgsi_session_offer(struct cgsi_plugin_data *data);
+static void cgsi_session_withdraw(struct cgsi_plugin_data *data, int failed);
+static void cgsi_session_store(struct cgsi_plugin_data *data, int handshake);
+static void cgsi_server_session_setup(SSL_CTX *ctx, const char *name);
+static void cgsi_server_session_record(struct cgsi_plugin_data *data, time_t expires);
+static int cgsi_server_session_restore(struct cgsi_plugin_data *data);
+
+static int cgsi_gridmap_lookup(const char *dn, char *username, size_t usernamelen);
+
+static int cgsi_chain_digest(X509 *cert, STACK_OF(X509) *chain, unsigned char *digest);
+static int cgsi_voms_cache_get(struct cgsi_plugin_data *data, const unsigned char *digest, int voms_checked, time_t *expires);
+static void cgsi_voms_cache_put(struct cgsi_plugin_data *data, const unsigned char *digest, int voms_checked, time_t expires);
 
-static gss_buffer_t buffer_create(gss_buffer_t buf, size_t offset);
-static gss_buffer_t buffer_free(gss_buffer_t buf);
-static gss_buffer_t buffer_consume_upto(gss_buffer_t buf, size_t offset);
-static gss_buffer_t buffer_copy_from(gss_buffer_t dest, gss_buffer_t src, size_t offset);
 
 
 /******************************************************************************/
@@ -161,7 +292,7 @@ int cgsi_plugin_set_flags(struct soap *soap, int is_server, int flags)
 
     id = is_server ? server_plugin_id : client_plugin_id;
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, id);
+    data = cgsi_find_plugin(soap, id);
 
     if (data == NULL)
         {
@@ -194,6 +325,26 @@ int cgsi_plugin_set_flags(struct soap *soap, int is_server, int flags)
             data->disable_voms_check = 1;
         }
 
+    if (flags & CGSI_OPT_LAZY_VOMS_CHECK)
+        {
+            data->lazy_voms_check = 1;
+        }
+
+    if (flags & CGSI_OPT_DEFER_NAME_CHECK)
+        {
+            data->defer_name_check = 1;
+        }
+
+    if (flags & CGSI_OPT_COALESCE_SENDS)
+        {
+            data->coalesce_sends = 1;
+        }
+
+    if (flags & CGSI_OPT_DIRECT_DECRYPT)
+        {
+            data->direct_decrypt = 1;
+        }
+
     if (flags & CGSI_OPT_ALLOW_ONLY_SELF)
         {
             data->allow_only_self = 1;
@@ -217,7 +368,7 @@ int cgsi_plugin_clr_flags(struct soap *soap, int is_server, int flags)
 
     id = is_server ? server_plugin_id : client_plugin_id;
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, id);
+    data = cgsi_find_plugin(soap, id);
 
     if (data == NULL)
         {
@@ -250,6 +401,26 @@ int cgsi_plugin_clr_flags(struct soap *soap, int is_server, int flags)
             data->disable_voms_check = 0;
         }
 
+    if (flags & CGSI_OPT_LAZY_VOMS_CHECK)
+        {
+            data->lazy_voms_check = 0;
+        }
+
+    if (flags & CGSI_OPT_DEFER_NAME_CHECK)
+        {
+            data->defer_name_check = 0;
+        }
+
+    if (flags & CGSI_OPT_COALESCE_SENDS)
+        {
+            data->coalesce_sends = 0;
+        }
+
+    if (flags & CGSI_OPT_DIRECT_DECRYPT)
+        {
+            data->direct_decrypt = 0;
+        }
+
     if (flags & CGSI_OPT_ALLOW_ONLY_SELF)
         {
             data->allow_only_self = 0;
@@ -269,7 +440,7 @@ int cgsi_plugin_get_flags(struct soap *soap, int is_server)
 
     id = is_server ? server_plugin_id : client_plugin_id;
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, id);
+    data = cgsi_find_plugin(soap, id);
 
     if (data == NULL)
         {
@@ -302,6 +473,26 @@ int cgsi_plugin_get_flags(struct soap *soap, int is_server)
             flags |= CGSI_OPT_DISABLE_VOMS_CHECK;
         }
 
+    if(data->lazy_voms_check == 1)
+        {
+            flags |= CGSI_OPT_LAZY_VOMS_CHECK;
+        }
+
+    if(data->defer_name_check == 1)
+        {
+            flags |= CGSI_OPT_DEFER_NAME_CHECK;
+        }
+
+    if(data->coalesce_sends == 1)
+        {
+            flags |= CGSI_OPT_COALESCE_SENDS;
+        }
+
+    if(data->direct_decrypt == 1)
+        {
+            flags |= CGSI_OPT_DIRECT_DECRYPT;
+        }
+
     if(data->allow_only_self == 1)
         {
             flags |= CGSI_OPT_ALLOW_ONLY_SELF;
@@ -321,7 +512,7 @@ int cgsi_plugin_set_credentials(struct soap *soap, int is_server,
 
     id = is_server ? server_plugin_id : client_plugin_id;
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, id);
+    data = cgsi_find_plugin(soap, id);
     if (data == NULL)
         {
             cgsi_err(soap, "Cannot find cgsi-plugin data structure; is plugin registered?");
@@ -348,6 +539,52 @@ int cgsi_plugin_set_credentials(struct soap *soap, int is_server,
 }
 
 
+/**
+ * Set the cipher policy of the SSL contexts
+ */
+int cgsi_plugin_set_ciphers(struct soap *soap, int is_server,
+                            const char *cipher_list, const char *ciphersuites)
+{
+    const char *id;
+    struct cgsi_plugin_data *data;
+
+    id = is_server ? server_plugin_id : client_plugin_id;
+
+    data = cgsi_find_plugin(soap, id);
+    if (data == NULL)
+        {
+            cgsi_err(soap, "Cannot find cgsi-plugin data structure; is plugin registered?");
+            return -1;
+        }
+
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+    if (ciphersuites)
+        {
+            cgsi_err(soap, "TLSv1.3 ciphersuites are not supported by this OpenSSL version");
+            return -1;
+        }
+#endif
+
+    free(data->cipher_list);
+    data->cipher_list = NULL;
+    free(data->ciphersuites);
+    data->ciphersuites = NULL;
+
+    if (cipher_list && (data->cipher_list = strdup(cipher_list)) == NULL)
+        {
+            cgsi_err(soap, "Out of memory");
+            return -1;
+        }
+    if (ciphersuites && (data->ciphersuites = strdup(ciphersuites)) == NULL)
+        {
+            cgsi_err(soap, "Out of memory");
+            return -1;
+        }
+
+    return 0;
+}
+
+
 /**
  * Initializes the plugin data object
  */
@@ -388,7 +625,7 @@ static int server_cgsi_plugin_send(struct soap *soap, const char *buf, size_t le
 static size_t server_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len)
 {
 
-    struct cgsi_plugin_data *data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
+    struct cgsi_plugin_data *data = cgsi_find_plugin(soap, server_plugin_id);
 
     if (data == NULL)
         {
@@ -419,10 +656,10 @@ static size_t server_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len)
             trace(data, "### Context already established!\n");
         }
 
-    if (data->disable_mapping == 0)
+    if (data->disable_mapping == 0 && data->username[0] == '\0')
         {
             /* Now doing username uid gid lookup */
-            /* Performing the user mapping ! */
+            /* Performing the user mapping, once per security context ! */
             if (server_cgsi_map_dn(soap)!=0)
                 {
                     /* Soap fault already filled */
@@ -430,178 +667,182 @@ static size_t server_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len)
                 }
         }
 
-    return cgsi_plugin_recv(soap, buf, len, server_plugin_id);
+    return cgsi_plugin_recv(soap, data, buf, len);
 }
 
 /**
  * Function that accepts the security context in the server.
- * The server credentials are loaded every-time.
+ * The server credentials are shared by all connections, see
+ * server_cgsi_acquire_cred().
  */
 static int server_cgsi_plugin_accept(struct soap *soap)
 {
     struct cgsi_plugin_data *data;
-    OM_uint32         minor_status, major_status, tmp_status, ret_flags;
-    gss_buffer_desc send_tok=GSS_C_EMPTY_BUFFER, recv_tok=GSS_C_EMPTY_BUFFER;
-    gss_name_t server = GSS_C_NO_NAME, client = GSS_C_NO_NAME;
-    gss_buffer_desc name = GSS_C_EMPTY_BUFFER;
-    OM_uint32           time_req;
-    gss_cred_id_t       delegated_cred_handle = GSS_C_NO_CREDENTIAL;
-    gss_channel_bindings_t  input_chan_bindings = GSS_C_NO_CHANNEL_BINDINGS;
-    SSL_CTX *ctx = NULL;
-    gss_OID doid = GSS_C_NO_OID;
+    OM_uint32 tmp_status;
+    gss_buffer_desc recv_tok=GSS_C_EMPTY_BUFFER;
     int ret;
 
     /* Getting the plugin data object */
-    data = (struct cgsi_plugin_data *) soap_lookup_plugin (soap, server_plugin_id);
+    data = cgsi_find_plugin(soap, server_plugin_id);
     if (!data)
         {
             cgsi_err(soap, "Error looking up plugin data");
             return -1;
         }
 
-    free_conn_state(data);
+    if (server_cgsi_accept_start(soap, data) != 0)
+        return -1;
 
-    /* despite the name ret_flags are also used as an input */
-    ret_flags = data->context_flags;
-    {
-        char buf[TBUFSIZE];
-        snprintf(buf, TBUFSIZE, "Server accepting context with flags: %xd\n", ret_flags);
-        trace(data, buf);
-    }
+    /* Now doing GSI authentication, loop over gss_accept_sec_context */
+    do
+        {
+            data->nb_iter++;
 
-    /* Specifying GSS_C_NO_NAME for the name or the server will
-       force it to take the default host certificate */
-    major_status = gss_acquire_cred(&minor_status,
-                                    GSS_C_NO_NAME,
-                                    0,
-                                    GSS_C_NULL_OID_SET,
-                                    GSS_C_ACCEPT,
-                                    &data->credential_handle,
-                                    NULL,
-                                    NULL);
+            if (cgsi_plugin_read_token(soap, data, &recv_tok.value, &recv_tok.length) < 0)
+                {
+                    /* Soap fault already reported ! */
+                    trace(data, "Error receiving token !\n");
+                    server_cgsi_accept_abort(data);
+                    return -1;
+                }
 
+            ret = server_cgsi_accept_token(soap, data, &recv_tok);
+            (void) gss_release_buffer(&tmp_status, &recv_tok);
+            if (ret < 0)
+                {
+                    server_cgsi_accept_abort(data);
+                    return -1;
+                }
 
-    if (major_status != GSS_S_COMPLETE)
-        {
-            cgsi_gssapi_err(soap,
-                            "Could NOT load server credentials",
-                            major_status,
-                            minor_status);
-            trace(data, "Could not load server credentials !\n");
-            goto error;
-        }
+            if (data->step_out.length != 0)
+                {
+                    if (cgsi_plugin_write_token(soap, data, data->step_out.value, data->step_out.length) < 0)
+                        {
+                            trace(data, "Exiting due to a bad return code (2)\n");
+                            /* Soap fault already reported by underlying layer */
+                            server_cgsi_accept_abort(data);
+                            return -1;
+                        } /* If token has 0 length, then just try again (it is NOT an error condition)! */
+                }
 
-    /* remove the LOW cipher suites */
-    if (data->credential_handle != GSS_C_NO_CREDENTIAL)
-        ctx = ((gss_cred_id_desc*)data->credential_handle)->ssl_context;
+            (void) gss_release_buffer(&tmp_status, &data->step_out);
 
-    if (ctx == NULL || !SSL_CTX_set_cipher_list(ctx, SSL_DEFAULT_CIPHER_LIST ":!LOW" ))
-        {
-            cgsi_err(soap, "Error setting the SSL context cipher list");
-            goto error;
         }
+    while (ret > 0);
 
+    return server_cgsi_accept_finish(soap, data);
+}
 
-    /* Now keeping the credentials name in the data structure */
-    major_status = gss_inquire_cred(&minor_status,
-                                    data->credential_handle,
-                                    &server,
-                                    NULL,
-                                    NULL,
-                                    NULL);
-    if (major_status != GSS_S_COMPLETE)
-        {
-            cgsi_gssapi_err(soap,  "Error inquiring credentials", major_status, minor_status);
-            goto error;
-        }
+/**
+ * Starts a handshake of the server, getting its credentials.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int server_cgsi_accept_start(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    free_conn_state(data);
 
-    /* Keeping the name in the plugin */
-    major_status = gss_display_name(&minor_status, server, &name, (gss_OID *) NULL);
-    if (major_status != GSS_S_COMPLETE || strlen((const char *)name.value)>CGSI_MAXNAMELEN-1)
+    /* despite the name ret_flags are also used as an input */
+    data->accept_flags = data->context_flags;
+    {
+        char buf[TBUFSIZE];
+        snprintf(buf, TBUFSIZE, "Server accepting context with flags: %xd\n", data->accept_flags);
+        trace(data, buf);
+    }
+
+    /* Getting the (shared) server credentials */
+    if (server_cgsi_acquire_cred(soap, data) != 0)
         {
-            if (major_status != GSS_S_COMPLETE)
-                cgsi_gssapi_err(soap,  "Error displaying server name", major_status, minor_status);
-            else
-                cgsi_err(soap,"Server name too long");
-            (void) gss_release_buffer(&minor_status, &name);
-            goto error;
+            /* Soap fault already reported */
+            trace(data, "Could not load server credentials !\n");
+            server_cgsi_accept_abort(data);
+            return -1;
         }
 
-    strncpy(data->server_name, (const char*)name.value, CGSI_MAXNAMELEN);
-    data->server_name[CGSI_MAXNAMELEN - 1] = '\0';
-
     {
         char buf[TBUFSIZE];
         snprintf(buf, TBUFSIZE, "The server is:<%s>\n", data->server_name);
         trace(data, buf);
     }
+    return 0;
+}
 
-    (void) gss_release_buffer(&tmp_status, &name);
-
-    /* Now doing GSI authentication, loop over gss_accept_sec_context */
-    do
-        {
-            data->nb_iter++;
+/**
+ * Passes a token of the client to gss_accept_sec_context(), the token to
+ * send back being left in data->step_out.
+ * Returns 1 if more tokens are needed, 0 when the context is complete,
+ * -1 on error.
+ */
+static int server_cgsi_accept_token(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_t recv_tok)
+{
+    OM_uint32 minor_status, major_status;
+    OM_uint32 time_req;
+    gss_channel_bindings_t  input_chan_bindings = GSS_C_NO_CHANNEL_BINDINGS;
+    gss_OID doid = GSS_C_NO_OID;
 
-            if (cgsi_plugin_recv_token(soap, &recv_tok.value, &recv_tok.length) < 0)
-                {
-                    /* Soap fault already reported ! */
-                    trace(data, "Error receiving token !\n");
-                    goto error;
-                }
+    major_status = gss_accept_sec_context(&minor_status,
+                                          &data->context_handle,
+                                          data->credential_handle,
+                                          recv_tok,
+                                          input_chan_bindings,
+                                          &data->accept_client,
+                                          &doid,
+                                          &data->step_out,
+                                          &data->accept_flags,
+                                          &time_req,
+                                          &data->accept_deleg);
+
+    if (major_status!=GSS_S_COMPLETE && major_status!=GSS_S_CONTINUE_NEEDED)
+        {
+            cgsi_gssapi_err(soap, "Could not accept security context",
+                            major_status,
+                            minor_status);
+            trace(data, "Exiting due to a bad return code from gss_accept_sec_context (1)\n");
+            return -1;
+        }
 
-            major_status = gss_accept_sec_context(&minor_status,
-                                                  &data->context_handle,
-                                                  data->credential_handle,
-                                                  &recv_tok,
-                                                  input_chan_bindings,
-                                                  &client,
-                                                  &doid,
-                                                  &send_tok,
-                                                  &ret_flags,
-                                                  &time_req,
-                                                  &delegated_cred_handle);
+    return (major_status & GSS_S_CONTINUE_NEEDED) ? 1 : 0;
+}
 
-            (void) gss_release_buffer(&tmp_status, &recv_tok);
+/**
+ * Completes a handshake of the server once the context is established:
+ * records the client name, checks the VOMS attributes and keeps the
+ * delegated credentials.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int server_cgsi_accept_finish(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    OM_uint32 minor_status, major_status, tmp_status;
+    gss_buffer_desc name = GSS_C_EMPTY_BUFFER;
+    gss_cred_id_t delegated_cred_handle;
+    int resumed;
 
-            if (major_status!=GSS_S_COMPLETE && major_status!=GSS_S_CONTINUE_NEEDED)
+    /* A resumed session comes without the peer certificate chain,
+       the attributes of the peer are those recorded with the session */
+    resumed = SSL_session_reused(((gss_ctx_id_desc *) data->context_handle)->gss_ssl);
+    if (resumed)
+        {
+            if (cgsi_server_session_restore(data) != 0)
                 {
-                    cgsi_gssapi_err(soap, "Could not accept security context",
-                                    major_status,
-                                    minor_status);
-                    trace(data, "Exiting due to a bad return code from gss_accept_sec_context (1)\n");
+                    cgsi_err(soap, "Could not find the attributes of the resumed session");
                     goto error;
                 }
-
-
-            if (send_tok.length != 0)
+            trace(data, "TLS session resumed\n");
+        }
+    else
+        {
+            /* Keeping the name in the plugin */
+            major_status = gss_display_name(&minor_status, data->accept_client, &name, (gss_OID *) NULL);
+            if (major_status != GSS_S_COMPLETE)
                 {
-                    if (cgsi_plugin_send_token(soap, send_tok.value, send_tok.length) < 0)
-                        {
-                            (void) gss_release_buffer(&tmp_status, &send_tok);
-                            trace(data, "Exiting due to a bad return code (2)\n");
-                            /* Soap fault already reported by underlying layer */
-                            goto error;
-                        } /* If token has 0 length, then just try again (it is NOT an error condition)! */
+                    cgsi_gssapi_err(soap,  "Error displaying name", major_status, minor_status);
+                    goto error;
                 }
 
-            (void) gss_release_buffer(&tmp_status, &send_tok);
-
-        }
-    while (major_status & GSS_S_CONTINUE_NEEDED);
-
-    /* Keeping the name in the plugin */
-    major_status = gss_display_name(&minor_status, client, &name, (gss_OID *) NULL);
-    if (major_status != GSS_S_COMPLETE)
-        {
-            cgsi_gssapi_err(soap,  "Error displaying name", major_status, minor_status);
-            goto error;
+            strncpy(data->client_name, (const char*)name.value, CGSI_MAXNAMELEN);
+            data->client_name[CGSI_MAXNAMELEN - 1] = '\0';
+            (void) gss_release_buffer(&tmp_status, &name);
         }
 
-    strncpy(data->client_name, (const char*)name.value, CGSI_MAXNAMELEN);
-    data->client_name[CGSI_MAXNAMELEN - 1] = '\0';
-    (void) gss_release_buffer(&tmp_status, &name);
-
     {
         char buf[TBUFSIZE];
         snprintf(buf, TBUFSIZE,  "The client is:<%s>\n", data->client_name);
@@ -611,11 +852,18 @@ static int server_cgsi_plugin_accept(struct soap *soap)
     if (data->allow_only_self)
         {
             int rc;
-            major_status = gss_compare_name(&minor_status, client, server, &rc);
-            if (major_status != GSS_S_COMPLETE)
+            if (resumed)
                 {
-                    cgsi_gssapi_err (soap, "Error comparing client and server names",major_status, minor_status);
-                    goto error;
+                    rc = (strcmp(data->client_name, data->cred_entry->name) == 0);
+                }
+            else
+                {
+                    major_status = gss_compare_name(&minor_status, data->accept_client, data->cred_entry->name_handle, &rc);
+                    if (major_status != GSS_S_COMPLETE)
+                        {
+                            cgsi_gssapi_err (soap, "Error comparing client and server names",major_status, minor_status);
+                            goto error;
+                        }
                 }
             if (!rc)
                 {
@@ -624,11 +872,11 @@ static int server_cgsi_plugin_accept(struct soap *soap)
                 }
         }
 
-    (void)gss_release_name(&tmp_status, &client);
-    (void)gss_release_name(&tmp_status, &server);
+    (void)gss_release_name(&tmp_status, &data->accept_client);
 
-    /* by default check VOMS credentials, and fail if invalid */
-    if (! data->disable_voms_check)
+    /* by default check VOMS credentials, and fail if invalid,
+       unless they are to be retrieved on first access */
+    if (! data->disable_voms_check && ! data->lazy_voms_check)
         {
             if (retrieve_userca_and_voms_creds(soap))
                 {
@@ -636,31 +884,28 @@ static int server_cgsi_plugin_accept(struct soap *soap)
                     goto error;
                 }
         }
+    else if (data->disable_voms_check && server_sessions != NULL && !resumed)
+        {
+            /* Without VOMS parsing the user CA is all the session needs
+               to be recorded, and resumable. It is cheap to get, and a
+               failure is left for the application to see */
+            (void) retrieve_userca_and_voms_creds(soap);
+        }
 
-    if (!(ret_flags & GSS_C_DELEG_FLAG))
-        (void) gss_release_cred(&tmp_status, &delegated_cred_handle);
+    if (!(data->accept_flags & GSS_C_DELEG_FLAG))
+        (void) gss_release_cred(&tmp_status, &data->accept_deleg);
 
     /* Save the delegated credentials */
+    delegated_cred_handle = data->accept_deleg;
     if (delegated_cred_handle != GSS_C_NO_CREDENTIAL)
         {
             gss_name_t deleg_name = GSS_C_NO_NAME;
             gss_buffer_desc namebuf = GSS_C_EMPTY_BUFFER;
-            SSL_CTX *ctx = NULL;
             OM_uint32 lifetime;
             gss_cred_usage_t usage;
 
             trace(data, "deleg_cred 1\n");
 
-            /* remove the LOW cipher suites */
-            if (data->credential_handle != GSS_C_NO_CREDENTIAL)
-                ctx = ((gss_cred_id_desc*)data->credential_handle)->ssl_context;
-
-            if (ctx == NULL || !SSL_CTX_set_cipher_list(ctx, SSL_DEFAULT_CIPHER_LIST ":!LOW" ))
-                {
-                    cgsi_err(soap, "Error setting the SSL context cipher list");
-                    goto error;
-                }
-
             /* Now keeping the credentials name in the data structure */
             major_status = gss_inquire_cred(&minor_status,
                                             delegated_cred_handle,
@@ -692,7 +937,7 @@ static int server_cgsi_plugin_accept(struct soap *soap)
 
             data->deleg_credential_handle = delegated_cred_handle;
             data->deleg_cred_set = 1;
-            delegated_cred_handle = GSS_C_NO_CREDENTIAL;
+            data->accept_deleg = GSS_C_NO_CREDENTIAL;
 
             (void) gss_release_name (&tmp_status, &deleg_name);
             (void) gss_release_buffer (&tmp_status, &namebuf);
@@ -705,54 +950,556 @@ static int server_cgsi_plugin_accept(struct soap *soap)
 
     /* Setting the flag as even the mapping went ok */
     data->context_established = 1;
-    ret = 0;
-    goto exit;
+    data->step_state = CGSI_STEP_IDLE;
+    return 0;
 
 error:
-    (void) gss_delete_sec_context(&tmp_status,&data->context_handle,GSS_C_NO_BUFFER);
-    (void) gss_release_cred (&tmp_status, &data->credential_handle);
-    ret = -1;
-
-exit:
-    (void) gss_release_buffer(&tmp_status, &send_tok);
-    (void) gss_release_buffer(&tmp_status, &recv_tok);
     (void) gss_release_buffer(&tmp_status, &name);
-    (void) gss_release_cred(&tmp_status, &delegated_cred_handle);
-    (void) gss_release_name (&tmp_status, &server);
-    (void) gss_release_name (&tmp_status, &client);
-    return (ret);
+    server_cgsi_accept_abort(data);
+    return -1;
 }
 
 /**
- * Looks up the client name and maps the username/uid/gid accordingly
+ * Drops the state of a handshake of the server which failed or was
+ * interrupted, the fault having been reported.
  */
-static int server_cgsi_map_dn(struct soap *soap)
+static void server_cgsi_accept_abort(struct cgsi_plugin_data *data)
 {
+    OM_uint32 tmp_status;
 
-    char *p;
-    struct cgsi_plugin_data *data;
+    (void) gss_delete_sec_context(&tmp_status,&data->context_handle,GSS_C_NO_BUFFER);
+    cgsi_release_cred(data);
+    (void) gss_release_buffer(&tmp_status, &data->step_out);
+    (void) gss_release_cred(&tmp_status, &data->accept_deleg);
+    (void) gss_release_name (&tmp_status, &data->accept_client);
+    data->step_out_offset = 0;
+    data->step_state = CGSI_STEP_IDLE;
+}
 
-    /* Getting the plugin data object */
-    data = (struct cgsi_plugin_data *) soap_lookup_plugin (soap, server_plugin_id);
-    if (!data)
+/**
+ * Reads a token of the peer without blocking, into the read ahead buffer.
+ * Returns 1 with the token where it lies in the buffer, 0 if the rest of
+ * the token has not been received yet, -1 on error.
+ */
+static int cgsi_plugin_step_read(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_t token)
+{
+    ssize_t ret;
+    size_t need = SSLHSIZE;
+    int len;
+
+    if (data->read_buf == NULL)
         {
-            cgsi_err(soap, "Error looking up plugin data");
-            return -1;
+            data->read_buf = (char *) malloc(CGSI_READ_AHEAD_SIZE);
+            if (data->read_buf == NULL)
+                {
+                    cgsi_err(soap, "Error reading token data: out of memory");
+                    return -1;
+                }
+            data->read_start = data->read_end = 0;
         }
 
-    if (!globus_gss_assist_gridmap(data->client_name, &p))
+    for (;;)
         {
-            /* We have a mapping */
-            strncpy(data->username, p, CGSI_MAXNAMELEN);
-            data->username[CGSI_MAXNAMELEN - 1] = '\0';
+            if (data->read_end - data->read_start >= SSLHSIZE)
+                {
+                    len = cgsi_record_length(data->read_buf + data->read_start);
+                    if (len < 0 || len + SSLHSIZE > CGSI_READ_AHEAD_SIZE)
+                        {
+                            cgsi_err(soap, "Error reading token data: token too large");
+                            return -1;
+                        }
+                    need = len + SSLHSIZE;
+                    if (data->read_end - data->read_start >= need)
+                        break;
+                }
 
-            {
-                char buf[TBUFSIZE];
-                snprintf(buf, TBUFSIZE, "The client is mapped to user:<%s>\n", data->username);
-                trace(data, buf);
+            /* Making room for the rest of a token split between reads */
+            if (data->read_start + need > CGSI_READ_AHEAD_SIZE)
+                {
+                    memmove(data->read_buf, data->read_buf + data->read_start,
+                            data->read_end - data->read_start);
+                    data->read_end -= data->read_start;
+                    data->read_start = 0;
+                }
+
+            ret = recv(soap->socket, data->read_buf + data->read_end,
+                       CGSI_READ_AHEAD_SIZE - data->read_end, MSG_DONTWAIT);
+            if (ret > 0)
+                {
+                    data->read_end += ret;
+                    continue;
+                }
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (ret == 0)
+                errno = 0;
+            soap->errnum = errno;
+            if (data->read_end - data->read_start < SSLHSIZE)
+                return cgsi_plugin_read_failed(soap, "Error reading token data header", 1);
+            return cgsi_plugin_read_failed(soap, "Error reading token data", 0);
+        }
+
+    token->value = data->read_buf + data->read_start;
+    token->length = need;
+    data->read_start += need;
+
+    {
+        char buf[TBUFSIZE];
+        snprintf(buf, TBUFSIZE,  "================= RECVING: %d\n", (int) need);
+        trace(data, buf);
+    }
+    cgsi_plugin_print_token(data, (char *) token->value, need);
+    return 1;
+}
+
+/**
+ * Sends what is left of the token in data->step_out without blocking.
+ * Returns 1 once it is sent, 0 if the socket is full, -1 on error.
+ */
+static int cgsi_plugin_step_write(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    ssize_t ret;
+    int flags = MSG_DONTWAIT;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+    if (data->step_out_offset == 0 && data->step_out.length != 0)
+        {
+            char buf[TBUFSIZE];
+            snprintf(buf, TBUFSIZE,  "================= SENDING: %d\n",
+                     (unsigned int)data->step_out.length);
+            trace(data, buf);
+            cgsi_plugin_print_token(data, (char *)data->step_out.value, data->step_out.length);
+        }
+
+    while (data->step_out_offset < data->step_out.length)
+        {
+            ret = send(soap->socket, (char *) data->step_out.value + data->step_out_offset,
+                       data->step_out.length - data->step_out_offset, flags);
+            if (ret >= 0)
+                {
+                    data->step_out_offset += ret;
+                    continue;
+                }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            {
+                char buf[BUFSIZE];
+                snprintf(buf, BUFSIZE,"Error sending token data: %s", strerror(errno));
+                cgsi_err(soap, buf);
             }
+            return -1;
+        }
+    return 1;
+}
 
-            free(p);
+int cgsi_accept_step(struct soap *soap, int fd_ready)
+{
+    struct cgsi_plugin_data *data;
+    gss_buffer_desc recv_tok;
+    OM_uint32 tmp_status;
+    int ret;
+
+    data = cgsi_find_plugin(soap, server_plugin_id);
+    if (!data)
+        {
+            cgsi_err(soap, "Error looking up plugin data");
+            return CGSI_ACCEPT_ERROR;
+        }
+
+    if (data->context_established)
+        return CGSI_ACCEPT_DONE;
+
+    if (data->step_state == CGSI_STEP_IDLE)
+        {
+            trace(data, "### Establishing new context step by step !\n");
+            if (server_cgsi_accept_start(soap, data) != 0)
+                return CGSI_ACCEPT_ERROR;
+            data->step_state = CGSI_STEP_READING;
+        }
+
+    if (!fd_ready)
+        return data->step_state == CGSI_STEP_READING ? CGSI_ACCEPT_WANT_READ : CGSI_ACCEPT_WANT_WRITE;
+
+    for (;;)
+        {
+            if (data->step_state == CGSI_STEP_READING)
+                {
+                    ret = cgsi_plugin_step_read(soap, data, &recv_tok);
+                    if (ret == 0)
+                        return CGSI_ACCEPT_WANT_READ;
+                    if (ret < 0)
+                        break;
+
+                    data->nb_iter++;
+                    ret = server_cgsi_accept_token(soap, data, &recv_tok);
+                    if (ret < 0)
+                        break;
+                    data->step_state = ret ? CGSI_STEP_WRITING : CGSI_STEP_FLUSHING;
+                    data->step_out_offset = 0;
+                }
+
+            ret = cgsi_plugin_step_write(soap, data);
+            if (ret == 0)
+                return CGSI_ACCEPT_WANT_WRITE;
+            if (ret < 0)
+                break;
+            (void) gss_release_buffer(&tmp_status, &data->step_out);
+            data->step_out_offset = 0;
+
+            if (data->step_state == CGSI_STEP_FLUSHING)
+                return server_cgsi_accept_finish(soap, data) == 0 ? CGSI_ACCEPT_DONE : CGSI_ACCEPT_ERROR;
+            data->step_state = CGSI_STEP_READING;
+        }
+
+    server_cgsi_accept_abort(data);
+    return CGSI_ACCEPT_ERROR;
+}
+
+/**
+ * Seconds elapsed from since to now, both read from the monotonic clock
+ */
+static double cgsi_elapsed(const struct timespec *since, const struct timespec *now)
+{
+    return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/**
+ * Closes and frees a connection the handshake pool owns
+ */
+static void cgsi_handshake_pool_drop(struct soap *soap)
+{
+    soap_closesock(soap);
+    soap_end(soap);
+    soap_done(soap);
+    free(soap);
+}
+
+/**
+ * Runs the blocking handshake of a connection, followed by the user mapping
+ * the first frecv would otherwise do.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_handshake_pool_accept(struct soap *soap)
+{
+    struct cgsi_plugin_data *data;
+
+    data = cgsi_find_plugin(soap, server_plugin_id);
+    if (!data)
+        {
+            cgsi_err(soap, "Error looking up plugin data");
+            return -1;
+        }
+
+    if (data->context_established == 0)
+        {
+            trace(data, "### Establishing new context in the handshake pool !\n");
+            if (server_cgsi_plugin_accept(soap) != 0)
+                {
+                    trace(data, "Context establishment FAILED !\n");
+                    return -1;
+                }
+        }
+
+    if (data->disable_mapping == 0 && data->username[0] == '\0')
+        return server_cgsi_map_dn(soap);
+    return 0;
+}
+
+static void *cgsi_handshake_worker(void *arg)
+{
+    struct cgsi_handshake_pool *pool = (struct cgsi_handshake_pool *) arg;
+    struct cgsi_handshake_item *item;
+    struct timespec start, end;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+        {
+            while (pool->pending_head == NULL && !pool->stopping)
+                pthread_cond_wait(&pool->pending_cond, &pool->lock);
+            if (pool->stopping)
+                break;
+
+            item = pool->pending_head;
+            pool->pending_head = item->next;
+            if (pool->pending_head == NULL)
+                pool->pending_tail = NULL;
+            pool->stats.pending--;
+            pool->stats.running++;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pool->stats.pending_wait += cgsi_elapsed(&item->queued, &start);
+            pthread_mutex_unlock(&pool->lock);
+
+            ret = cgsi_handshake_pool_accept(item->soap);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (ret != 0)
+                {
+                    cgsi_handshake_pool_drop(item->soap);
+                    free(item);
+                }
+
+            pthread_mutex_lock(&pool->lock);
+            pool->stats.running--;
+            pool->stats.handshake_time += cgsi_elapsed(&start, &end);
+            if (ret != 0)
+                {
+                    pool->stats.failed++;
+                    continue;
+                }
+            pool->stats.established++;
+            item->queued = end;
+            item->next = NULL;
+            if (pool->ready_tail != NULL)
+                pool->ready_tail->next = item;
+            else
+                pool->ready_head = item;
+            pool->ready_tail = item;
+            if (++pool->stats.ready > pool->stats.ready_max)
+                pool->stats.ready_max = pool->stats.ready;
+            pthread_cond_signal(&pool->ready_cond);
+        }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct cgsi_handshake_pool *cgsi_handshake_pool_create(int nworkers, int max_pending)
+{
+    struct cgsi_handshake_pool *pool;
+    int i;
+
+    if (nworkers <= 0 || max_pending <= 0)
+        return NULL;
+
+    pool = (struct cgsi_handshake_pool *) calloc(1, sizeof(struct cgsi_handshake_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = (pthread_t *) calloc(nworkers, sizeof(pthread_t));
+    if (pool->workers == NULL)
+        {
+            free(pool);
+            return NULL;
+        }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->pending_cond, NULL);
+    pthread_cond_init(&pool->ready_cond, NULL);
+    pool->max_pending = max_pending;
+
+    for (i = 0; i < nworkers; i++)
+        {
+            if (pthread_create(&pool->workers[i], NULL, cgsi_handshake_worker, pool) != 0)
+                {
+                    /* Stops the workers already started */
+                    cgsi_handshake_pool_destroy(pool);
+                    return NULL;
+                }
+            pool->nworkers++;
+        }
+    return pool;
+}
+
+int cgsi_handshake_pool_submit(struct cgsi_handshake_pool *pool, struct soap *soap)
+{
+    struct cgsi_handshake_item *item;
+
+    if (pool == NULL || soap == NULL)
+        return -1;
+
+    if (cgsi_find_plugin(soap, server_plugin_id) == NULL)
+        {
+            cgsi_err(soap, "Handshake pool: the connection has no server plugin");
+            return -1;
+        }
+
+    item = (struct cgsi_handshake_item *) malloc(sizeof(struct cgsi_handshake_item));
+    if (item == NULL)
+        {
+            cgsi_err(soap, "Handshake pool: out of memory");
+            return -1;
+        }
+    item->soap = soap;
+    item->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &item->queued);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping || pool->stats.pending >= pool->max_pending)
+        {
+            pool->stats.rejected++;
+            pthread_mutex_unlock(&pool->lock);
+            free(item);
+            cgsi_err(soap, "Handshake pool: too many connections waiting for a handshake");
+            return -1;
+        }
+    if (pool->pending_tail != NULL)
+        pool->pending_tail->next = item;
+    else
+        pool->pending_head = item;
+    pool->pending_tail = item;
+    pool->stats.submitted++;
+    if (++pool->stats.pending > pool->stats.pending_max)
+        pool->stats.pending_max = pool->stats.pending;
+    pthread_cond_signal(&pool->pending_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+struct soap *cgsi_handshake_pool_next(struct cgsi_handshake_pool *pool, int timeout_ms)
+{
+    struct cgsi_handshake_item *item;
+    struct timespec deadline, now;
+    struct soap *soap;
+
+    if (pool == NULL)
+        return NULL;
+
+    if (timeout_ms > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout_ms / 1000;
+            deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+        }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->ready_head == NULL && !pool->stopping && timeout_ms != 0)
+        {
+            if (timeout_ms < 0)
+                pthread_cond_wait(&pool->ready_cond, &pool->lock);
+            else if (pthread_cond_timedwait(&pool->ready_cond, &pool->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+    item = pool->ready_head;
+    if (item == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+    pool->ready_head = item->next;
+    if (pool->ready_head == NULL)
+        pool->ready_tail = NULL;
+    pool->stats.ready--;
+    pool->stats.served++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pool->stats.ready_wait += cgsi_elapsed(&item->queued, &now);
+    pthread_mutex_unlock(&pool->lock);
+
+    soap = item->soap;
+    free(item);
+    return soap;
+}
+
+int cgsi_handshake_pool_get_stats(struct cgsi_handshake_pool *pool, struct cgsi_handshake_pool_stats *stats)
+{
+    if (pool == NULL || stats == NULL)
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void cgsi_handshake_pool_destroy(struct cgsi_handshake_pool *pool)
+{
+    struct cgsi_handshake_item *item;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->pending_cond);
+    pthread_cond_broadcast(&pool->ready_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    /* The workers are gone, the queues can be emptied without the lock */
+    while ((item = pool->pending_head) != NULL)
+        {
+            pool->pending_head = item->next;
+            cgsi_handshake_pool_drop(item->soap);
+            free(item);
+        }
+    while ((item = pool->ready_head) != NULL)
+        {
+            pool->ready_head = item->next;
+            cgsi_handshake_pool_drop(item->soap);
+            free(item);
+        }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->pending_cond);
+    pthread_cond_destroy(&pool->ready_cond);
+    free(pool->workers);
+    free(pool);
+}
+
+/**
+ * Gets a reference on the process-wide server credentials, (re)loading them
+ * only if they were never loaded, have expired, or if one of the files they
+ * may come from has changed on disk (see cgsi_cred_cache_get()).
+ */
+static int server_cgsi_acquire_cred(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    struct cgsi_cred_file files[CGSI_CRED_MAXFILES];
+    struct cgsi_cred_entry *entry;
+    int nfiles;
+
+    /* Using the default credentials will force it to take
+       the host certificate */
+    nfiles = cgsi_cred_files_default(files);
+    entry = cgsi_cred_cache_get(soap, data, GSS_C_ACCEPT, 0, files, nfiles);
+    if (entry == NULL)
+        {
+            /* Soap fault already reported */
+            return -1;
+        }
+
+    data->cred_entry = entry;
+    data->credential_handle = entry->credential_handle;
+    strncpy(data->server_name, entry->name, CGSI_MAXNAMELEN);
+    data->server_name[CGSI_MAXNAMELEN - 1] = '\0';
+    return 0;
+}
+
+/**
+ * Looks up the client name and maps the username/uid/gid accordingly
+ */
+static int server_cgsi_map_dn(struct soap *soap)
+{
+
+    struct cgsi_plugin_data *data;
+
+    /* Getting the plugin data object */
+    data = cgsi_find_plugin(soap, server_plugin_id);
+    if (!data)
+        {
+            cgsi_err(soap, "Error looking up plugin data");
+            return -1;
+        }
+
+    if (!cgsi_gridmap_lookup(data->client_name, data->username, CGSI_MAXNAMELEN))
+        {
+            /* We have a mapping */
+            {
+                char buf[TBUFSIZE];
+                snprintf(buf, TBUFSIZE, "The client is mapped to user:<%s>\n", data->username);
+                trace(data, buf);
+            }
         }
     else
         {
@@ -839,8 +1586,14 @@ static int client_cgsi_plugin_init(struct soap *soap, struct cgsi_plugin_data *d
     return SOAP_OK;
 }
 
-static int client_cgsi_plugin_import_cred(struct soap *soap,
-        struct cgsi_plugin_data *data)
+/**
+ * Reads the certificate and key from the files given, and imports them
+ * as GSS credentials
+ */
+static int cgsi_cred_import(struct soap *soap,
+                            const char *x509_cert,
+                            const char *x509_key,
+                            gss_cred_id_t *credential_handle)
 {
     char err_buffer[1024];
     OM_uint32 major_status, minor_status;
@@ -856,7 +1609,7 @@ static int client_cgsi_plugin_import_cred(struct soap *soap,
     buffer.length = 0;
 
     /* Stat cert and key to find out how much memory we need to hold the credentials */
-    if (stat(data->x509_cert, &st) != 0)
+    if (stat(x509_cert, &st) != 0)
         {
             strerror_r(errno, err_buffer, sizeof(err_buffer));
             cgsi_err(soap, err_buffer);
@@ -864,12 +1617,12 @@ static int client_cgsi_plugin_import_cred(struct soap *soap,
         }
     cert_size = st.st_size;
 
-    if (data->x509_key)
-        key_is_cert = strcmp(data->x509_cert, data->x509_key) == 0;
+    if (x509_key)
+        key_is_cert = strcmp(x509_cert, x509_key) == 0;
 
-    if (data->x509_key && !key_is_cert)
+    if (x509_key && !key_is_cert)
         {
-            if (stat(data->x509_key, &st) != 0)
+            if (stat(x509_key, &st) != 0)
                 {
                     strerror_r(errno, err_buffer, sizeof(err_buffer));
                     cgsi_err(soap, err_buffer);
@@ -887,7 +1640,7 @@ static int client_cgsi_plugin_import_cred(struct soap *soap,
             goto import_end;
         }
 
-    fd = fopen(data->x509_cert, "r");
+    fd = fopen(x509_cert, "r");
     if (!fd)
         {
             strerror_r(errno, err_buffer, sizeof(err_buffer));
@@ -897,9 +1650,9 @@ static int client_cgsi_plugin_import_cred(struct soap *soap,
     fread(buffer.value, cert_size, 1, fd);
     fclose(fd);
 
-    if (data->x509_key && !key_is_cert)
+    if (x509_key && !key_is_cert)
         {
-            fd = fopen(data->x509_key, "r");
+            fd = fopen(x509_key, "r");
             if (!fd)
                 {
                     strerror_r(errno, err_buffer, sizeof(err_buffer));
@@ -912,7 +1665,7 @@ static int client_cgsi_plugin_import_cred(struct soap *soap,
 
     /* Import into gss */
     major_status = gss_import_cred(&minor_status,
-                                   &data->credential_handle,
+                                   credential_handle,
                                    GSS_C_NO_OID,
                                    0, // 0 = Pass credentials; 1 = Pass path as X509_USER_PROXY=...
                                    &buffer,
@@ -935,121 +1688,180 @@ import_end:
     return ret;
 }
 
+/**
+ * Gets a reference on the client credentials from the process-wide cache.
+ * The credentials are either the ones set by cgsi_plugin_set_credentials(),
+ * or the default ones GSI finds from the environment, and they are only
+ * loaded again when the files they come from change on disk.
+ */
+static int client_cgsi_acquire_cred(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    struct cgsi_cred_file files[CGSI_CRED_MAXFILES];
+    struct cgsi_cred_entry *entry;
+    const char *paths[2];
+    int nfiles;
+
+    if (data->x509_cert)
+        {
+            paths[0] = data->x509_cert;
+            nfiles = 1;
+            if (data->x509_key && strcmp(data->x509_cert, data->x509_key) != 0)
+                paths[nfiles++] = data->x509_key;
+            cgsi_cred_files_stat(files, paths, nfiles);
+            entry = cgsi_cred_cache_get(soap, data, GSS_C_INITIATE, 1, files, nfiles);
+            if (entry == NULL)
+                {
+                    char buf[TBUFSIZE];
+                    snprintf(buf, TBUFSIZE, "Could NOT import client credentials from %s/%s\n", data->x509_cert, data->x509_key);
+                    trace(data, buf);
+                    return -1;
+                }
+        }
+    else
+        {
+            nfiles = cgsi_cred_files_default(files);
+            entry = cgsi_cred_cache_get(soap, data, GSS_C_INITIATE, 0, files, nfiles);
+            if (entry == NULL)
+                {
+                    trace(data, "Could NOT load client credentials\n");
+                    return -1;
+                }
+        }
+
+    data->cred_entry = entry;
+    data->credential_handle = entry->credential_handle;
+    strncpy(data->client_name, entry->name, CGSI_MAXNAMELEN);
+    data->client_name[CGSI_MAXNAMELEN - 1] = '\0';
+    return 0;
+}
+
 static int client_cgsi_plugin_open(struct soap *soap,
                                    const char *endpoint,
                                    const char *hostname,
                                    int port)
 {
 
-    OM_uint32 major_status, minor_status, tmp_status, ret_flags;
+    OM_uint32 tmp_status;
     struct cgsi_plugin_data *data;
-    gss_name_t client=GSS_C_NO_NAME, target_name=GSS_C_NO_NAME;
-    gss_buffer_desc send_tok=GSS_C_EMPTY_BUFFER, recv_tok=GSS_C_EMPTY_BUFFER;
-    gss_buffer_desc namebuf=GSS_C_EMPTY_BUFFER;
-    gss_OID oid = GSS_C_NO_OID;
+    gss_buffer_desc recv_tok=GSS_C_EMPTY_BUFFER;
     int ret;
 
     /* Looking up plugin data */
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, client_plugin_id);
+    data = cgsi_find_plugin(soap, client_plugin_id);
     if (!data)
         {
             cgsi_err(soap, "Error looking up plugin data");
             return -1;
         }
 
-    free_conn_state(data);
-
-    int do_reverse_lookup = data->disable_hostname_check;
+    if (client_cgsi_connect_start(soap, data, hostname, port) != 0)
+        return -1;
 
-    /* Getting the credenttials */
-    if (data->x509_cert)
+    /* Opening the connection to the server */
+    if (data->fopen == NULL)
         {
-            trace(data, "Using gss_import_cred to load credentials\n");
-            // client_cgsi_plugin_import_cred should set the error itself
-            if (client_cgsi_plugin_import_cred(soap, data) != 0) {
-                char buf[TBUFSIZE];
-                snprintf(buf, TBUFSIZE, "Could NOT import client credentials from %s/%s\n", data->x509_cert, data->x509_key);
-                trace(data, buf);
-                goto error;
-            }
+            cgsi_err(soap, "data->fopen is NULL !");
+            client_cgsi_connect_abort(data);
+            return -1;
         }
-    else
-        {
-            trace(data, "Using gss_acquire_cred to load credentials\n");
-            major_status = gss_acquire_cred(&minor_status,
-                                            GSS_C_NO_NAME,
-                                            0,
-                                            GSS_C_NULL_OID_SET,
-                                            GSS_C_INITIATE,
-                                            &data->credential_handle,
-                                            NULL,
-                                            NULL);
 
-            if (major_status != GSS_S_COMPLETE)
-                {
-                    trace(data, "Could NOT load client credentials\n");
-                    cgsi_gssapi_err(soap,
-                                    "Could NOT load client credentials",
-                                    major_status,
-                                    minor_status);
-                    goto error;
-                }
+    /* gSOAP 2.7.x will try to open a https endpoint with SSL,
+     * if it was built WITH_SLL. Since endpoint is only used
+     * to compare the first six bytes, we pass one, which does
+     * not start with 'https://'. */
+    data->socket_fd = data->fopen(soap, endpoint+1, hostname, port);
+    if (data->socket_fd < 0)
+        {
+            char buf[BUFSIZE];
+            snprintf(buf, BUFSIZE, "could not open connection to %s:%d\n", hostname, port);
+            trace(data, buf);
+            cgsi_err(soap, buf);
+            client_cgsi_connect_abort(data);
+            return -1;
         }
 
-    /* Now keeping the credentials name in the data structure */
-    major_status = gss_inquire_cred(&minor_status,
-                                    data->credential_handle,
-                                    &client,
-                                    NULL,
-                                    NULL,
-                                    NULL);
-    if (major_status != GSS_S_COMPLETE)
+    if (client_cgsi_connect_target(soap, data) != 0)
+        return -1;
+
+    do
         {
-            cgsi_gssapi_err(soap,  "Error inquiring credentials", major_status, minor_status);
-            goto error;
+            ret = client_cgsi_connect_token(soap, data, &recv_tok);
+            (void)gss_release_buffer(&tmp_status, &recv_tok);
+            if (ret < 0)
+                {
+                    client_cgsi_connect_abort(data);
+                    return -1;
+                }
+
+            if (data->step_out.length > 0)
+                {
+                    if (cgsi_plugin_write_token(soap, data, data->step_out.value, data->step_out.length) < 0)
+                        {
+                            /* Soap fault already reported */
+                            trace(data, "Error sending token !\n");
+                            client_cgsi_connect_abort(data);
+                            return -1;
+                        }
+                }
+            (void) gss_release_buffer (&tmp_status, &data->step_out);
+
+            if (ret > 0)
+                {
+                    if (cgsi_plugin_read_token(soap, data, &(recv_tok.value), &(recv_tok.length)) < 0)
+                        {
+                            /* fault already reported */
+                            client_cgsi_connect_abort(data);
+                            return -1;
+                        }
+                }
         }
+    while (ret > 0);
 
-    /* Keeping the name in the plugin */
-    major_status = gss_display_name(&minor_status, client, &namebuf, (gss_OID *) NULL);
-    if (major_status != GSS_S_COMPLETE || strlen((const char*)namebuf.value)>CGSI_MAXNAMELEN-1)
+    if (client_cgsi_connect_finish(soap, data) != 0)
+        return -1;
+
+    return data->socket_fd;
+}
+
+/**
+ * Starts a handshake of the client with hostname:port, getting its credentials.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int client_cgsi_connect_start(struct soap *soap, struct cgsi_plugin_data *data,
+                                     const char *hostname, int port)
+{
+    free_conn_state(data);
+
+    strncpy(data->endpoint_host, hostname, CGSI_MAXNAMELEN);
+    data->endpoint_host[CGSI_MAXNAMELEN - 1] = '\0';
+    data->endpoint_port = port;
+
+    /* Getting the (shared) credentials */
+    if (client_cgsi_acquire_cred(soap, data) != 0)
         {
-            if (major_status != GSS_S_COMPLETE)
-                cgsi_gssapi_err(soap,  "Error displaying client name", major_status, minor_status);
-            else
-                cgsi_err(soap,"Client name too long");
-            goto error;
+            /* Soap fault already reported */
+            client_cgsi_connect_abort(data);
+            return -1;
         }
 
-    strncpy(data->client_name, (const char*)namebuf.value, CGSI_MAXNAMELEN);
-    data->client_name[CGSI_MAXNAMELEN - 1] = '\0';
-    (void)gss_release_buffer(&tmp_status, &namebuf);
-
     {
         char buf[TBUFSIZE];
         snprintf(buf, TBUFSIZE, "The client is:<%s>\n", data->client_name);
         trace(data, buf);
     }
+    return 0;
+}
 
-    /* Opening the connection to the server */
-    if (data->fopen == NULL)
-        {
-            cgsi_err(soap, "data->fopen is NULL !");
-            goto error;
-        }
-
-    /* gSOAP 2.7.x will try to open a https endpoint with SSL,
-     * if it was built WITH_SLL. Since endpoint is only used
-     * to compare the first six bytes, we pass one, which does
-     * not start with 'https://'. */
-    data->socket_fd = data->fopen(soap, endpoint+1, hostname, port);
-    if (data->socket_fd < 0)
-        {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "could not open connection to %s:%d\n", hostname, port);
-            trace(data, buf);
-            cgsi_err(soap, buf);
-            goto error;
-        }
+/**
+ * Sets the name the server is expected to have, once connected to it,
+ * and offers to resume the TLS session of the previous connection.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int client_cgsi_connect_target(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    OM_uint32 major_status, minor_status;
+    const char *hostname = data->endpoint_host;
+    int do_reverse_lookup = data->disable_hostname_check;
 
     /*
      * Figure out what sort of validation we need to do.
@@ -1078,7 +1890,7 @@ static int client_cgsi_plugin_open(struct soap *soap,
         {
             /* make target name our own identity */
 
-            major_status = gss_duplicate_name (&minor_status, client, &target_name);
+            major_status = gss_duplicate_name (&minor_status, data->cred_entry->name_handle, &data->connect_target);
             if (major_status != GSS_S_COMPLETE)
                 {
                     cgsi_gssapi_err (soap, "Could not duplicate name", major_status, minor_status);
@@ -1089,135 +1901,67 @@ static int client_cgsi_plugin_open(struct soap *soap,
         {
             /* take target name from reverse lookup */
 
-            struct sockaddr *sa;
-            socklen_t sa_length;
-            char host[NI_MAXHOST+5];
-            unsigned int i;
-            int rc;
-
-            sa_length = (sizeof (struct sockaddr_in6) > sizeof (struct sockaddr_in)) ?
-                        sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
-            sa = (struct sockaddr *) malloc (sa_length);
-
-            if (sa == NULL)
-                {
-                    cgsi_err (soap,"Could not allocate memory for sockaddr");
-                    goto error;
-                }
+            struct sockaddr_storage ss;
+            struct sockaddr *sa = (struct sockaddr *) &ss;
+            socklen_t sa_length = sizeof (ss);
+            char host[CGSI_MAXHOSTLEN];
+            const char *error = NULL;
 
-            rc = getpeername (data->socket_fd, sa, &sa_length);
-            if (rc<0)
+            if (getpeername (data->socket_fd, sa, &sa_length) < 0)
                 {
                     cgsi_err (soap,"Could not find peername");
-                    free (sa);
                     goto error;
                 }
 
             if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
                 {
                     cgsi_err (soap,"Peer has an unknown address family");
-                    free (sa);
                     goto error;
                 }
 
-            snprintf (host,sizeof (host),"host@");
-
-            if (is_loopback (sa))
+            if (cgsi_resolve_cache_get (sa, sa_length, host, sizeof (host)) != 0)
                 {
-                    struct addrinfo *res,*resp;
-                    struct sockaddr *sa2;
-                    free (sa);
-                    sa = NULL;
-                    if (gethostname (&host[5], sizeof (host) - 5))
-                        {
-                            cgsi_err (soap,"Could not get the local host name");
-                            goto error;
-                        }
-                    rc = getaddrinfo (&host[5], NULL, NULL, &res);
-                    if (rc)
-                        {
-                            cgsi_err (soap,"Could not lookup the local host name");
-                            goto error;
-                        }
-                    resp = res;
-                    while( resp )
+                    /* If asked to, the name is only checked once the handshake
+                       completes and the lookup runs meanwhile, unless credentials
+                       are delegated. It is done first otherwise, or if too many
+                       lookups are running already */
+                    if (data->defer_name_check && !(data->context_flags & GSS_C_DELEG_FLAG))
+                        (void) cgsi_resolve_start (sa, sa_length, &data->connect_resolve);
+                    if (data->connect_resolve == NULL)
                         {
-                            if (resp->ai_family == AF_INET6 && !is_loopback (resp->ai_addr))
+                            if (cgsi_reverse_lookup (sa, sa_length, host, sizeof (host), &error) != 0)
                                 {
-                                    sa = resp->ai_addr;
-                                    sa_length = resp->ai_addrlen;
-                                }
-                            else if (resp->ai_family == AF_INET && !is_loopback (resp->ai_addr))
-                                {
-                                    sa = resp->ai_addr;
-                                    sa_length = resp->ai_addrlen;
-                                    break;
-                                }
-                            resp=resp->ai_next;
-                        }
-                    if (sa)
-                        {
-                            sa2 = (struct sockaddr*)malloc (sa_length);
-                            if (sa2 == NULL)
-                                {
-                                    cgsi_err (soap,"Could not allocate memory to copy a sockaddr");
-                                    freeaddrinfo (res);
+                                    cgsi_err (soap, error);
                                     goto error;
                                 }
-                            memcpy (sa2,sa,sa_length);
-                            sa = sa2;
+                            cgsi_resolve_cache_put (sa, host);
                         }
-                    if (res != NULL)
-                        freeaddrinfo (res);
                 }
 
-            if (sa)
+            if (data->connect_resolve == NULL)
                 {
-                    rc = getnameinfo (sa, sa_length, &host[5], sizeof (host) - 5, NULL, 0, 0);
-                    free (sa);
-                    sa = NULL;
-                    if (rc)
+                    major_status = cgsi_import_target_name (&minor_status, host, &data->connect_target);
+                    if (major_status != GSS_S_COMPLETE)
                         {
-                            cgsi_err (soap,"Could not convert the address information to a name or address");
+                            cgsi_gssapi_err (soap, "Could not import name", major_status, minor_status);
                             goto error;
                         }
                 }
-
-            for (i=5; (i < sizeof (host)) && host[i]; i++)
-                host[i] = tolower (host[i]);
-
-            namebuf.value = (void *)strdup (host);
-            if (namebuf.value == NULL)
-                {
-                    cgsi_err (soap, "Could not allocate memory for host name");
-                    goto error;
-                }
-            namebuf.length = strlen (host) + 1;
-
-            major_status = gss_import_name (&minor_status, &namebuf, GSS_C_NT_HOSTBASED_SERVICE, &target_name);
-            if (major_status != GSS_S_COMPLETE)
-                {
-                    cgsi_gssapi_err (soap, "Could not import name", major_status, minor_status);
-                    goto error;
-                }
-            (void)gss_release_buffer (&tmp_status, &namebuf);
         }
     else
         {
             /* take the target name from the hostname parameter passed to this function */
 
-            namebuf.value = malloc (strlen ("host@") + strlen (hostname) + 1);
-            if (namebuf.value == NULL)
+            char service[CGSI_MAXHOSTLEN];
+
+            if (strlen (hostname) + 5 >= sizeof (service))
                 {
-                    cgsi_err (soap,"Could not allocate memory for target name");
+                    cgsi_err (soap,"Host name too long");
                     goto error;
                 }
-            strcpy ((char*)namebuf.value,"host@");
-            strcat ((char*)namebuf.value,hostname);
-            namebuf.length = strlen ((char*)namebuf.value) + 1;
+            snprintf (service, sizeof (service), "host@%s", hostname);
 
-            major_status = gss_import_name (&minor_status, &namebuf, GSS_C_NT_HOSTBASED_SERVICE, &target_name);
-            (void) gss_release_buffer (&tmp_status, &namebuf);
+            major_status = cgsi_import_target_name (&minor_status, service, &data->connect_target);
             if (major_status != GSS_S_COMPLETE)
                 {
                     cgsi_gssapi_err (soap,  "Error importing target name", major_status, minor_status);
@@ -1225,65 +1969,89 @@ static int client_cgsi_plugin_open(struct soap *soap,
                 }
         }
 
-    do
-        {
-
-            data->nb_iter++;
+    /* Resuming the TLS session of the previous connection, if any */
+    cgsi_session_offer(data);
+    return 0;
 
-            {
-                char buf[TBUFSIZE];
-                snprintf(buf, TBUFSIZE, "Iteration:<%d>\n", data->nb_iter);
-                trace(data, buf);
-            }
+error:
+    client_cgsi_connect_abort(data);
+    return -1;
+}
 
-            static pthread_mutex_t globus_gss = PTHREAD_MUTEX_INITIALIZER;
-            pthread_mutex_lock(&globus_gss);
-            major_status = gss_init_sec_context(&minor_status,
-                                                data->credential_handle,
-                                                &data->context_handle,
-                                                target_name,
-                                                oid,
-                                                data->context_flags,
-                                                0,
-                                                NULL,   /* no channel bindings */
-                                                &recv_tok,
-                                                NULL,   /* ignore mech type */
-                                                &send_tok,
-                                                &ret_flags,
-                                                NULL);  /* ignore time_rec */
-            pthread_mutex_unlock(&globus_gss);
+/**
+ * Passes a token of the server, if any yet, to gss_init_sec_context(),
+ * the token to send being left in data->step_out.
+ * Returns 1 if more tokens are needed, 0 when the context is complete,
+ * -1 on error.
+ */
+static int client_cgsi_connect_token(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_t recv_tok)
+{
+    OM_uint32 major_status, minor_status, ret_flags;
+    gss_OID oid = GSS_C_NO_OID;
+    int mode, locked, contended = 0;
 
-            (void)gss_release_buffer(&tmp_status, &recv_tok);
+    data->nb_iter++;
 
-            if (major_status!=GSS_S_COMPLETE && major_status!=GSS_S_CONTINUE_NEEDED)
-                {
-                    cgsi_gssapi_err(soap, "Error initializing context",  major_status, minor_status);
-                    goto error;
-                }
+    {
+        char buf[TBUFSIZE];
+        snprintf(buf, TBUFSIZE, "Iteration:<%d>\n", data->nb_iter);
+        trace(data, buf);
+    }
 
-            if (send_tok.length > 0)
-                {
-                    ret = cgsi_plugin_send_token(soap,  send_tok.value, send_tok.length);
-                    if (ret < 0)
-                        {
-                            /* Soap fault already reported */
-                            trace(data, "Error sending token !\n");
-                            goto error;
-                        }
-                }
-            (void) gss_release_buffer (&tmp_status, &send_tok);
+    pthread_mutex_lock(&gss_lock_mode_lock);
+    mode = gss_lock_mode;
+    pthread_mutex_unlock(&gss_lock_mode_lock);
+
+    /* Creating the context reads the credential shared between threads */
+    locked = (mode == CGSI_GSS_LOCK_ALL ||
+              (mode == CGSI_GSS_LOCK_FIRST && data->context_handle == GSS_C_NO_CONTEXT));
+    if (locked)
+        {
+            contended = (pthread_mutex_trylock(&globus_gss) != 0);
+            if (contended)
+                pthread_mutex_lock(&globus_gss);
+        }
+    major_status = gss_init_sec_context(&minor_status,
+                                        data->credential_handle,
+                                        &data->context_handle,
+                                        data->connect_target,
+                                        oid,
+                                        data->context_flags,
+                                        0,
+                                        NULL,   /* no channel bindings */
+                                        recv_tok,
+                                        NULL,   /* ignore mech type */
+                                        &data->step_out,
+                                        &ret_flags,
+                                        NULL);  /* ignore time_rec */
+    if (locked)
+        {
+            pthread_mutex_unlock(&globus_gss);
+            pthread_mutex_lock(&stats_lock);
+            plugin_stats.gss_lock_acquired++;
+            if (contended)
+                plugin_stats.gss_lock_contended++;
+            pthread_mutex_unlock(&stats_lock);
+        }
 
-            if (major_status & GSS_S_CONTINUE_NEEDED)
-                {
-                    if (cgsi_plugin_recv_token(soap, &(recv_tok.value), &(recv_tok.length)) < 0)
-                        {
-                            /* fault already reported */
-                            goto error;
-                        }
-                }
+    if (major_status!=GSS_S_COMPLETE && major_status!=GSS_S_CONTINUE_NEEDED)
+        {
+            cgsi_gssapi_err(soap, "Error initializing context",  major_status, minor_status);
+            return -1;
         }
-    while (major_status == GSS_S_CONTINUE_NEEDED);
 
+    return (major_status & GSS_S_CONTINUE_NEEDED) ? 1 : 0;
+}
+
+/**
+ * Completes a handshake of the client once the context is established,
+ * checking and recording the name of the server.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int client_cgsi_connect_finish(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    OM_uint32 major_status, minor_status, tmp_status;
+    int ret;
 
     /* Record the server name (as GSS reports it) */
     {
@@ -1312,6 +2080,37 @@ static int client_cgsi_plugin_open(struct soap *soap,
                 goto error;
             }
 
+        /* Checking the server name found meanwhile by reverse lookup */
+        if (data->connect_resolve != NULL)
+            {
+                char host[CGSI_MAXHOSTLEN];
+                const char *error = NULL;
+                int equal = 0;
+
+                ret = cgsi_resolve_finish(data->connect_resolve, host, sizeof(host), &error);
+                data->connect_resolve = NULL;
+                if (ret != 0)
+                    {
+                        cgsi_err(soap, error);
+                        (void)gss_release_name(&tmp_status, &tgt_name);
+                        (void)gss_release_name(&tmp_status, &src_name);
+                        goto error;
+                    }
+                major_status = cgsi_import_target_name(&minor_status, host, &data->connect_target);
+                if (major_status == GSS_S_COMPLETE)
+                    major_status = gss_compare_name(&minor_status, data->connect_target, tgt_name, &equal);
+                if (major_status != GSS_S_COMPLETE || !equal)
+                    {
+                        if (major_status != GSS_S_COMPLETE)
+                            cgsi_gssapi_err(soap, "Could not check the server name", major_status, minor_status);
+                        else
+                            cgsi_err(soap, "The server name does not match the name of its host");
+                        (void)gss_release_name(&tmp_status, &tgt_name);
+                        (void)gss_release_name(&tmp_status, &src_name);
+                        goto error;
+                    }
+            }
+
         major_status = gss_display_name(&minor_status, tgt_name, &server_name, (gss_OID *) NULL);
         if (major_status != GSS_S_COMPLETE || strlen((const char*)server_name.value)>CGSI_MAXNAMELEN-1)
             {
@@ -1341,83 +2140,400 @@ static int client_cgsi_plugin_open(struct soap *soap,
         (void)gss_release_name(&tmp_status, &src_name);
     }
 
-    (void)gss_release_name (&tmp_status, &client);
+    cgsi_session_withdraw(data, 0);
+    cgsi_session_store(data, 1);
 
+    (void) gss_release_name (&tmp_status, &data->connect_target);
+    client_cgsi_connect_free_addrs(data);
+    data->step_state = CGSI_STEP_IDLE;
     data->context_established = 1;
-    ret = data->socket_fd;
-    goto exit;
+    return 0;
 
 error:
+    client_cgsi_connect_abort(data);
+    return -1;
+}
+
+/**
+ * Drops the state of a handshake of the client which failed,
+ * closing the connection. The fault has been reported.
+ */
+static void client_cgsi_connect_abort(struct cgsi_plugin_data *data)
+{
+    OM_uint32 tmp_status;
+
+    cgsi_session_withdraw(data, 1);
     (void) gss_delete_sec_context (&tmp_status, &data->context_handle, GSS_C_NO_BUFFER);
-    (void) gss_release_cred (&tmp_status, &data->credential_handle);
+    cgsi_release_cred(data);
     if (data->socket_fd >= 0)
         {
             (void) close(data->socket_fd);
             data->socket_fd = -1;
         }
-    ret = -1;
-
-exit:
-    (void) gss_release_buffer (&tmp_status, &send_tok);
-    (void) gss_release_buffer (&tmp_status, &recv_tok);
-    (void) gss_release_buffer (&tmp_status, &namebuf);
-    (void) gss_release_name (&tmp_status, &client);
-    (void) gss_release_name (&tmp_status, &target_name);
-    return (ret);
+    if (data->connect_resolve != NULL)
+        {
+            (void) cgsi_resolve_finish (data->connect_resolve, NULL, 0, NULL);
+            data->connect_resolve = NULL;
+        }
+    (void) gss_release_buffer (&tmp_status, &data->step_out);
+    (void) gss_release_name (&tmp_status, &data->connect_target);
+    client_cgsi_connect_free_addrs(data);
+    data->step_out_offset = 0;
+    data->step_state = CGSI_STEP_IDLE;
 }
 
-
-static int client_cgsi_plugin_send(struct soap *soap, const char *buf, size_t len)
+/**
+ * Frees the addresses of the server resolved by cgsi_connect_start()
+ */
+static void client_cgsi_connect_free_addrs(struct cgsi_plugin_data *data)
 {
-    return cgsi_plugin_send(soap, buf, len, client_plugin_id);
+    if (data->connect_addrs != NULL)
+        {
+            freeaddrinfo(data->connect_addrs);
+            data->connect_addrs = NULL;
+        }
+    data->connect_next = NULL;
 }
 
-static size_t client_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len)
+/**
+ * Connects without blocking to the next address of the server.
+ * Returns 0 once the connection is under way, -1 if no address is left.
+ */
+static int client_cgsi_connect_next(struct soap *soap, struct cgsi_plugin_data *data)
 {
-    return cgsi_plugin_recv(soap, buf, len, client_plugin_id);
-}
+    struct addrinfo *ai;
+    int fd, flags, on = 1;
 
-static int client_cgsi_plugin_close(struct soap *soap)
-{
-    return cgsi_plugin_close(soap, client_plugin_id);
+    while ((ai = data->connect_next) != NULL)
+        {
+            data->connect_next = ai->ai_next;
+
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            flags = fcntl(fd, F_GETFL);
+            if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+                {
+                    (void) close(fd);
+                    continue;
+                }
+            (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+                {
+                    data->socket_fd = fd;
+                    soap->socket = fd;
+                    return 0;
+                }
+            (void) close(fd);
+        }
+
+    {
+        char buf[BUFSIZE];
+        snprintf(buf, BUFSIZE, "could not open connection to %s:%d", data->endpoint_host, data->endpoint_port);
+        cgsi_err(soap, buf);
+    }
+    return -1;
 }
 
+/**
+ * Checks the connection under way to the server, trying its next address
+ * if it failed. The socket goes back to blocking mode once connected.
+ * Returns 1 if connected, 0 if still connecting, -1 on error.
+ */
+static int client_cgsi_connect_check(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    int error = 0, flags;
+    socklen_t len = sizeof(error);
 
+    if (getsockopt(data->socket_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+    if (error == EINPROGRESS || error == EALREADY)
+        return 0;
+    if (error != 0)
+        {
+            (void) close(data->socket_fd);
+            data->socket_fd = -1;
+            soap->socket = SOAP_INVALID_SOCKET;
+            return client_cgsi_connect_next(soap, data) == 0 ? 0 : -1;
+        }
 
-/******************************************************************************/
-/* COMMON Plugin functions */
-/******************************************************************************/
+    flags = fcntl(data->socket_fd, F_GETFL);
+    if (flags >= 0)
+        (void) fcntl(data->socket_fd, F_SETFL, flags & ~O_NONBLOCK);
+    client_cgsi_connect_free_addrs(data);
+    return 1;
+}
 
-static int cgsi_plugin_copy(struct soap *soap, struct soap_plugin *dst, struct soap_plugin *src)
+/**
+ * Starts connecting to the endpoint without blocking, at the address given
+ * or, without one, at the addresses its host name resolves to
+ */
+static int cgsi_connect_begin(struct soap *soap, const char *endpoint,
+                              const struct sockaddr *addr, socklen_t addrlen)
 {
-    struct cgsi_plugin_data *dst_data, *src_data;
+    struct cgsi_plugin_data *data;
+    struct addrinfo hints;
+    char port[16];
+    int ret;
 
-    *dst = *src;
-    dst->data =  (struct cgsi_plugin_data *)malloc(sizeof(struct cgsi_plugin_data));
-    if (dst->data == NULL) return SOAP_FATAL_ERROR;
+    data = cgsi_find_plugin(soap, client_plugin_id);
+    if (!data)
+        {
+            cgsi_err(soap, "Error looking up plugin data");
+            return CGSI_CONNECT_ERROR;
+        }
 
-    memcpy(dst->data, src->data, sizeof(struct cgsi_plugin_data));
+    if (soap_valid_socket(soap->socket))
+        {
+            cgsi_err(soap, "A connection is already open");
+            return CGSI_CONNECT_ERROR;
+        }
 
-    /* We do not support deep copy of plugin data's connection related parameters.
-       Expect soap structure should only be copied just after soap_accept(), before
-       the connection parameters are filled.
-    */
+    if (addr != NULL && (addrlen == 0 || addrlen > sizeof(data->connect_sa)))
+        {
+            cgsi_err(soap, "Invalid address");
+            return CGSI_CONNECT_ERROR;
+        }
 
-    dst_data = (struct cgsi_plugin_data *)dst->data;
-    src_data = (struct cgsi_plugin_data *)src->data;
+    soap_set_endpoint(soap, endpoint);
+    if (soap->host[0] == '\0')
+        {
+            cgsi_err(soap, "Invalid endpoint");
+            return CGSI_CONNECT_ERROR;
+        }
 
-    /* don't want to share these with the source */
-    dst_data->deleg_credential_handle = GSS_C_NO_CREDENTIAL;
-    dst_data->credential_handle = GSS_C_NO_CREDENTIAL;
-    dst_data->context_handle = GSS_C_NO_CONTEXT;
-    dst_data->voname = NULL;
+    if (client_cgsi_connect_start(soap, data, soap->host, soap->port) != 0)
+        return CGSI_CONNECT_ERROR;
+
+    if (addr != NULL)
+        {
+            /* The only address, kept in the plugin data as nothing is to be freed */
+            memcpy(&data->connect_sa, addr, addrlen);
+            memset(&data->connect_ai, 0, sizeof(data->connect_ai));
+            data->connect_ai.ai_family = addr->sa_family;
+            data->connect_ai.ai_socktype = SOCK_STREAM;
+            data->connect_ai.ai_addr = (struct sockaddr *) &data->connect_sa;
+            data->connect_ai.ai_addrlen = addrlen;
+            data->connect_next = &data->connect_ai;
+        }
+    else
+        {
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            snprintf(port, sizeof(port), "%d", soap->port);
+            ret = getaddrinfo(soap->host, port, &hints, &data->connect_addrs);
+            if (ret != 0)
+                {
+                    char buf[BUFSIZE];
+                    snprintf(buf, BUFSIZE, "could not resolve %s: %s", soap->host, gai_strerror(ret));
+                    cgsi_err(soap, buf);
+                    data->connect_addrs = NULL;
+                    client_cgsi_connect_abort(data);
+                    return CGSI_CONNECT_ERROR;
+                }
+            data->connect_next = data->connect_addrs;
+        }
+
+    if (client_cgsi_connect_next(soap, data) != 0)
+        {
+            client_cgsi_connect_abort(data);
+            return CGSI_CONNECT_ERROR;
+        }
+
+    trace(data, "### Connecting step by step !\n");
+    data->step_state = CGSI_STEP_CONNECTING;
+    return CGSI_CONNECT_WANT_WRITE;
+}
+
+int cgsi_connect_start(struct soap *soap, const char *endpoint)
+{
+    return cgsi_connect_begin(soap, endpoint, NULL, 0);
+}
+
+int cgsi_connect_start_addr(struct soap *soap, const char *endpoint,
+                            const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (addr == NULL)
+        {
+            cgsi_err(soap, "Invalid address");
+            return CGSI_CONNECT_ERROR;
+        }
+    return cgsi_connect_begin(soap, endpoint, addr, addrlen);
+}
+
+int cgsi_connect_step(struct soap *soap, int fd_ready)
+{
+    struct cgsi_plugin_data *data;
+    gss_buffer_desc recv_tok;
+    OM_uint32 tmp_status;
+    int ret;
+
+    data = cgsi_find_plugin(soap, client_plugin_id);
+    if (!data)
+        {
+            cgsi_err(soap, "Error looking up plugin data");
+            return CGSI_CONNECT_ERROR;
+        }
+
+    if (data->context_established)
+        return CGSI_CONNECT_DONE;
+
+    if (data->step_state == CGSI_STEP_IDLE)
+        {
+            cgsi_err(soap, "No connection started with cgsi_connect_start()");
+            return CGSI_CONNECT_ERROR;
+        }
+
+    if (!fd_ready)
+        return data->step_state == CGSI_STEP_READING ? CGSI_CONNECT_WANT_READ : CGSI_CONNECT_WANT_WRITE;
+
+    for (;;)
+        {
+            recv_tok.value = NULL;
+            recv_tok.length = 0;
+
+            if (data->step_state == CGSI_STEP_CONNECTING)
+                {
+                    ret = client_cgsi_connect_check(soap, data);
+                    if (ret == 0)
+                        return CGSI_CONNECT_WANT_WRITE;
+                    if (ret < 0)
+                        break;
+                    if (client_cgsi_connect_target(soap, data) != 0)
+                        {
+                            soap->socket = SOAP_INVALID_SOCKET;
+                            return CGSI_CONNECT_ERROR;
+                        }
+                }
+            else if (data->step_state == CGSI_STEP_READING)
+                {
+                    ret = cgsi_plugin_step_read(soap, data, &recv_tok);
+                    if (ret == 0)
+                        return CGSI_CONNECT_WANT_READ;
+                    if (ret < 0)
+                        break;
+                }
+
+            if (data->step_state == CGSI_STEP_CONNECTING || data->step_state == CGSI_STEP_READING)
+                {
+                    ret = client_cgsi_connect_token(soap, data, &recv_tok);
+                    if (ret < 0)
+                        break;
+                    data->step_state = ret ? CGSI_STEP_WRITING : CGSI_STEP_FLUSHING;
+                    data->step_out_offset = 0;
+                }
+
+            ret = cgsi_plugin_step_write(soap, data);
+            if (ret == 0)
+                return CGSI_CONNECT_WANT_WRITE;
+            if (ret < 0)
+                break;
+            (void) gss_release_buffer(&tmp_status, &data->step_out);
+            data->step_out_offset = 0;
+
+            if (data->step_state == CGSI_STEP_FLUSHING)
+                {
+                    if (client_cgsi_connect_finish(soap, data) != 0)
+                        {
+                            soap->socket = SOAP_INVALID_SOCKET;
+                            return CGSI_CONNECT_ERROR;
+                        }
+                    /* The next call to the endpoint goes over this connection */
+                    soap->keep_alive = 1;
+                    return CGSI_CONNECT_DONE;
+                }
+            data->step_state = CGSI_STEP_READING;
+        }
+
+    client_cgsi_connect_abort(data);
+    soap->socket = SOAP_INVALID_SOCKET;
+    return CGSI_CONNECT_ERROR;
+}
+
+static int client_cgsi_plugin_send(struct soap *soap, const char *buf, size_t len)
+{
+    return cgsi_plugin_send(soap, buf, len, client_plugin_id);
+}
+
+static size_t client_cgsi_plugin_recv(struct soap *soap, char *buf, size_t len)
+{
+    struct cgsi_plugin_data *data = cgsi_find_plugin(soap, client_plugin_id);
+
+    if (data == NULL)
+        {
+            cgsi_err(soap, "Client recv: could not get data structure");
+            return 0;
+        }
+
+    return cgsi_plugin_recv(soap, data, buf, len);
+}
+
+static int client_cgsi_plugin_close(struct soap *soap)
+{
+    struct cgsi_plugin_data *data;
+
+    /* TLSv1.3 session tickets only come after the handshake */
+    data = cgsi_find_plugin(soap, client_plugin_id);
+    if (data != NULL && data->context_established)
+        cgsi_session_store(data, 0);
+
+    return cgsi_plugin_close(soap, client_plugin_id);
+}
+
+
+
+/******************************************************************************/
+/* COMMON Plugin functions */
+/******************************************************************************/
+
+static int cgsi_plugin_copy(struct soap *soap, struct soap_plugin *dst, struct soap_plugin *src)
+{
+    struct cgsi_plugin_data *dst_data, *src_data;
+
+    *dst = *src;
+    dst->data =  (struct cgsi_plugin_data *)malloc(sizeof(struct cgsi_plugin_data));
+    if (dst->data == NULL) return SOAP_FATAL_ERROR;
+
+    memcpy(dst->data, src->data, sizeof(struct cgsi_plugin_data));
+
+    /* We do not support deep copy of plugin data's connection related parameters.
+       Expect soap structure should only be copied just after soap_accept(), before
+       the connection parameters are filled.
+    */
+
+    dst_data = (struct cgsi_plugin_data *)dst->data;
+    src_data = (struct cgsi_plugin_data *)src->data;
+
+    /* don't want to share these with the source */
+    dst_data->deleg_credential_handle = GSS_C_NO_CREDENTIAL;
+    dst_data->credential_handle = GSS_C_NO_CREDENTIAL;
+    dst_data->cred_entry = NULL;
+    dst_data->context_handle = GSS_C_NO_CONTEXT;
+    dst_data->voname = NULL;
     dst_data->deleg_credential_token = NULL;
     dst_data->fqan = NULL;
+    dst_data->buffered_in.value = NULL;
+    dst_data->buffered_in.length = 0;
+    dst_data->send_buf = NULL;
+    dst_data->read_buf = NULL;
+    dst_data->accept_client = GSS_C_NO_NAME;
+    dst_data->connect_target = GSS_C_NO_NAME;
+    dst_data->connect_resolve = NULL;
+    dst_data->connect_addrs = NULL;
+    dst_data->connect_next = NULL;
+    dst_data->accept_deleg = GSS_C_NO_CREDENTIAL;
+    dst_data->step_out.value = NULL;
+    dst_data->step_out.length = 0;
 
     if (src_data->x509_cert)
         dst_data->x509_cert = strdup(src_data->x509_cert);
     if (src_data->x509_key)
         dst_data->x509_key = strdup(src_data->x509_key);
+    if (src_data->cipher_list)
+        dst_data->cipher_list = strdup(src_data->cipher_list);
+    if (src_data->ciphersuites)
+        dst_data->ciphersuites = strdup(src_data->ciphersuites);
 
     /* reset everything else connection related */
     free_conn_state(dst_data);
@@ -1443,6 +2559,10 @@ static void cgsi_plugin_delete(struct soap *soap, struct soap_plugin *p)
     free_conn_state(data);
     free(data->x509_cert);
     free(data->x509_key);
+    free(data->cipher_list);
+    free(data->ciphersuites);
+    free(data->send_buf);
+    free(data->read_buf);
     free(p->data);
     p->data = NULL;
 }
@@ -1455,7 +2575,7 @@ static int cgsi_plugin_close(struct soap *soap, const char *plugin_id)
     OM_uint32 minor_status;
     gss_buffer_desc output_buffer_desc;
     gss_buffer_t output_buffer;
-    struct cgsi_plugin_data *data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, plugin_id);
+    struct cgsi_plugin_data *data = cgsi_find_plugin(soap, plugin_id);
 
     if (data == NULL)
         {
@@ -1465,8 +2585,22 @@ static int cgsi_plugin_close(struct soap *soap, const char *plugin_id)
 
     output_buffer = &output_buffer_desc;
 
+    /* Handshake driven by cgsi_accept_step() or cgsi_connect_step() given up by the caller */
+    if (data->step_state != CGSI_STEP_IDLE)
+        {
+            if (plugin_id == client_plugin_id)
+                {
+                    /* The socket is closed below */
+                    data->socket_fd = -1;
+                    client_cgsi_connect_abort(data);
+                }
+            else
+                server_cgsi_accept_abort(data);
+        }
+
     if (data->context_established == 1)
         {
+            (void) cgsi_plugin_flush_send(soap, data);
 
             major_status = gss_delete_sec_context(&minor_status, &(data->context_handle), output_buffer);
             if (major_status != GSS_S_COMPLETE)
@@ -1483,6 +2617,7 @@ static int cgsi_plugin_close(struct soap *soap, const char *plugin_id)
                     data->context_established = 0;
                 }
         }
+    cgsi_plugin_count_records(data);
     if (data->fclose != NULL)
         {
             return data->fclose(soap);
@@ -1497,7 +2632,10 @@ static int cgsi_plugin_close(struct soap *soap, const char *plugin_id)
 }
 
 
-static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, const char *plugin_id)
+/**
+ * Wraps the data into TLS records and sends them
+ */
+static int cgsi_plugin_wrap_send(struct soap *soap, struct cgsi_plugin_data *data, const char *buf, size_t len)
 {
 
     OM_uint32 major_status;
@@ -1506,23 +2644,9 @@ static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, cons
     gss_buffer_desc output_tok;
     int conf_state;
 
-    struct cgsi_plugin_data *data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, plugin_id);
-
-    trace(data, "<Sending SOAP Packet>-------------\n");
-    trace_str(data, (char *)buf, len);
-    trace(data, "\n----------------------------------\n");
-
     input_tok.value = (char *)buf;
     input_tok.length = len;
 
-    if (data->had_send_error)
-        {
-            /* Not much to do, we don't know if the previous send sent any
-             * data, nor if we're being presented with the same data again */
-            trace(data, "Request to send data after previous send failed\n");
-            return (-1);
-        }
-
     if (data->context_handle != GSS_C_NO_CONTEXT)
         {
             major_status = gss_wrap(&minor_status,
@@ -1532,6 +2656,7 @@ static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, cons
                                     &input_tok,
                                     &conf_state,
                                     &output_tok);
+            data->send_allocated++;
         }
     else
         {
@@ -1552,9 +2677,9 @@ static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, cons
             return -1;
         }
 
-    if (cgsi_plugin_send_token((void *)soap,
-                               output_tok.value,
-                               output_tok.length) != 0)
+    if (cgsi_plugin_write_token(soap, data,
+                                output_tok.value,
+                                output_tok.length) != 0)
         {
             /* Soap fault already reported */
             gss_release_buffer(&minor_status, &output_tok);
@@ -1567,163 +2692,650 @@ static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, cons
     return SOAP_OK;
 }
 
-static size_t cgsi_plugin_recv(struct soap *soap, char *buf, size_t len, const char *plugin_id)
+/**
+ * Finds the fsend gSOAP installs in a soap structure it initializes. The
+ * structure is allocated, as it is too large for the stack of any thread
+ * sending first.
+ */
+static void cgsi_default_fsend_init(void)
 {
+    struct soap *tmp;
+
+    tmp = soap_new();
+    if (tmp == NULL)
+        return;
+    default_fsend = tmp->fsend;
+    soap_done(tmp);
+    free(tmp);
+}
 
-    OM_uint32 major_status;
-    OM_uint32 minor_status, minor_status1;
-    int token_status;
-    size_t tmplen;
-    gss_buffer_desc                       input_token_desc  = GSS_C_EMPTY_BUFFER;
-    gss_buffer_t                          input_token       = &input_token_desc;
-    gss_buffer_desc                       output_token_desc = GSS_C_EMPTY_BUFFER;
-    gss_buffer_t                          output_token      = &output_token_desc;
-
+/**
+ * Tells whether the tokens can be written to the socket directly, which is
+ * only the case when the plugin sends through gSOAP's own fsend.
+ * Returns 1 if they can, 0 if they are to be sent with data->fsend.
+ */
+static int cgsi_plugin_can_writev(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    if (!soap_valid_socket(soap->socket))
+        return 0;
+    pthread_once(&default_fsend_once, cgsi_default_fsend_init);
+    return default_fsend != NULL && data->fsend == default_fsend;
+}
 
-    struct cgsi_plugin_data *data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, plugin_id);
+/**
+ * Writes the tokens to the socket with as few system calls as possible.
+ * As in gSOAP's fsend, the socket is waited for to be writable for at
+ * most the send timeout before each write.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_plugin_writev(struct soap *soap, struct cgsi_plugin_data *data, gss_buffer_desc *toks, int ntoks)
+{
+    struct iovec iov[CGSI_SEND_IOV];
+    struct msghdr msg;
+    struct pollfd pfd;
+    ssize_t ret;
+    int i, first = 0, timeout, flags = 0, blocked = 0;
+    char buf[BUFSIZE];
 
-    if(data->buffered_in != NULL)
+    for (i = 0; i < ntoks; i++)
         {
-            tmplen = len < data->buffered_in->length ? len : data->buffered_in->length;
+            snprintf(buf, BUFSIZE,  "================= SENDING: %d\n",
+                     (unsigned int)toks[i].length);
+            trace(data, buf);
+            cgsi_plugin_print_token(data, (char *)toks[i].value, toks[i].length);
+            iov[i].iov_base = toks[i].value;
+            iov[i].iov_len = toks[i].length;
+        }
 
-            memcpy(buf, data->buffered_in->value, tmplen);
+    /* gSOAP timeouts are in seconds, or in microseconds when negative */
+    if (soap->send_timeout > 0)
+        timeout = soap->send_timeout * 1000;
+    else if (soap->send_timeout < 0)
+        timeout = -soap->send_timeout / 1000;
+    else
+        timeout = -1;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    /* Not blocking past the timeout once the socket is writable */
+    if (timeout >= 0)
+        flags |= MSG_DONTWAIT;
 
-            if(tmplen == data->buffered_in->length)
+    while (first < ntoks)
+        {
+            if (timeout >= 0 || blocked)
                 {
-                    data->buffered_in = buffer_free(data->buffered_in);
+                    pfd.fd = soap->socket;
+                    pfd.events = POLLOUT;
+                    pfd.revents = 0;
+                    ret = poll(&pfd, 1, timeout);
+                    if (ret == 0)
+                        {
+                            cgsi_err(soap, "Error sending token data: Timeout");
+                            return -1;
+                        }
+                    if (ret < 0)
+                        {
+                            if (errno == EINTR)
+                                continue;
+                            snprintf(buf, BUFSIZE,"Error sending token data: %s", strerror(errno));
+                            cgsi_err(soap, buf);
+                            return -1;
+                        }
+                    blocked = 0;
                 }
-            else
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov[first];
+            msg.msg_iovlen = ntoks - first;
+            ret = sendmsg(soap->socket, &msg, flags);
+            if (ret < 0)
                 {
-                    data->buffered_in = buffer_consume_upto(data->buffered_in, tmplen);
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        {
+                            blocked = 1;
+                            continue;
+                        }
+                    snprintf(buf, BUFSIZE,"Error sending token data: %s", strerror(errno));
+                    cgsi_err(soap, buf);
+                    return -1;
                 }
 
-            trace(data, "<Buffered input>------------------\n");
-            trace_str(data, buf, tmplen);
-            trace(data, "\n----------------------------------\n");
-
-            return (size_t) tmplen;
+            /* Skipping what was written, the last token possibly in part */
+            while (first < ntoks && (size_t) ret >= iov[first].iov_len)
+                {
+                    ret -= iov[first].iov_len;
+                    first++;
+                }
+            if (first < ntoks)
+                {
+                    iov[first].iov_base = (char *) iov[first].iov_base + ret;
+                    iov[first].iov_len -= ret;
+                }
         }
 
+    return 0;
+}
 
-    token_status = cgsi_plugin_recv_token((void *)soap,
-                                          &input_token->value,
-                                          &input_token->length);
+/**
+ * Wraps the data into records of CGSI_SEND_BUFSIZE bytes, written to the
+ * socket by batches of CGSI_SEND_IOV, or one by one with data->fsend when
+ * the transport is not gSOAP's
+ */
+static int cgsi_plugin_wrap_send_records(struct soap *soap, struct cgsi_plugin_data *data, const char *buf, size_t len)
+{
+    OM_uint32 major_status;
+    OM_uint32 minor_status;
+    gss_buffer_desc input_tok;
+    gss_buffer_desc toks[CGSI_SEND_IOV];
+    int conf_state, i, ntoks, direct, ret = SOAP_OK;
 
-    if (token_status != 0)
-        {
-            trace(data, "Token status <> 0\n");
-            /* Soap fault already reported */
-            return 0;
-        }
+    if (data->context_handle == GSS_C_NO_CONTEXT)
+        return cgsi_plugin_wrap_send(soap, data, buf, len);
+    direct = cgsi_plugin_can_writev(soap, data);
 
-    if (data->context_handle != GSS_C_NO_CONTEXT)
+    while (len > 0 && ret == SOAP_OK)
         {
-            ERR_clear_error();
-            major_status = gss_unwrap(&minor_status,
-                                      data->context_handle,
-                                      input_token,
-                                      output_token,
-                                      NULL,
-                                      NULL);
+            for (ntoks = 0; ntoks < CGSI_SEND_IOV && len > 0; ntoks++)
+                {
+                    input_tok.value = (char *)buf;
+                    input_tok.length = len < CGSI_SEND_BUFSIZE ? len : CGSI_SEND_BUFSIZE;
+                    major_status = gss_wrap(&minor_status,
+                                            data->context_handle,
+                                            0,
+                                            GSS_C_QOP_DEFAULT,
+                                            &input_tok,
+                                            &conf_state,
+                                            &toks[ntoks]);
+                    if (major_status != GSS_S_COMPLETE)
+                        {
+                            cgsi_gssapi_err(soap,
+                                            "Error wrapping the data",
+                                            major_status,
+                                            minor_status);
+                            gss_release_buffer(&minor_status, &toks[ntoks]);
+                            /* The records wrapped before are lost */
+                            data->had_send_error = 1;
+                            ret = -1;
+                            break;
+                        }
+                    data->send_allocated++;
+                    buf += input_tok.length;
+                    len -= input_tok.length;
+                }
 
-            gss_release_buffer(&minor_status1,
-                               input_token);
-        }
-    else
-        {
-            /* we don't expect to asked to read without a security context.
-             * Best not to read anything which may or may not be wrapped,
-             * so we just fail. Assume a useful fault message has already seen set */
-            trace(data, "Request to read data, without having a security context, failed\n");
-            return (0);
+            if (ret == SOAP_OK && direct && cgsi_plugin_writev(soap, data, toks, ntoks) != 0)
+                {
+                    data->had_send_error = 1;
+                    ret = -1;
+                }
+            for (i = 0; ret == SOAP_OK && !direct && i < ntoks; i++)
+                {
+                    if (cgsi_plugin_write_token(soap, data, toks[i].value, toks[i].length) != 0)
+                        {
+                            data->had_send_error = 1;
+                            ret = -1;
+                        }
+                }
+            for (i = 0; i < ntoks; i++)
+                gss_release_buffer(&minor_status, &toks[i]);
         }
 
-    if (major_status != GSS_S_COMPLETE)
-        {
-            cgsi_gssapi_err(soap,
-                            "Error unwrapping the data",
-                            major_status,
-                            minor_status);
-            gss_release_buffer(&minor_status1,
-                               output_token);
-            return 0;
-        }
+    return ret;
+}
 
-    tmplen = len < output_token->length ? len : output_token->length;
+/**
+ * Sends the buffered data, if any
+ */
+static int cgsi_plugin_flush_send(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    size_t len = data->send_len;
 
-    memcpy(buf, output_token->value, tmplen);
+    if (len == 0)
+        return SOAP_OK;
 
-    if( tmplen < output_token->length)
+    data->send_len = 0;
+    if (data->had_send_error)
         {
-            data->buffered_in = buffer_create(output_token, tmplen);
+            trace(data, "Request to send data after previous send failed\n");
+            return (-1);
         }
+    return cgsi_plugin_wrap_send(soap, data, data->send_buf, len);
+}
 
-    gss_release_buffer(&minor_status1,
-                       output_token);
-
-    trace(data, "<Receiving SOAP Packet>-------------\n");
-    trace_str(data, buf, tmplen);
-    trace(data, "\n----------------------------------\n");
+int cgsi_plugin_flush(struct soap *soap)
+{
+    struct cgsi_plugin_data *data = get_plugin(soap);
 
-    return (size_t) tmplen;
+    if (data == NULL)
+        {
+            cgsi_err(soap, "Flush: could not get data structure");
+            return -1;
+        }
+    return cgsi_plugin_flush_send(soap, data) == SOAP_OK ? 0 : -1;
 }
 
+static int cgsi_plugin_send(struct soap *soap, const char *buf, size_t len, const char *plugin_id)
+{
 
-#define SSLHSIZE 5
+    struct cgsi_plugin_data *data = cgsi_find_plugin(soap, plugin_id);
+    size_t n;
 
-int cgsi_plugin_recv_token(void *arg, void **token, size_t *token_length)
+    trace(data, "<Sending SOAP Packet>-------------\n");
+    trace_str(data, (char *)buf, len);
+    trace(data, "\n----------------------------------\n");
+
+    if (data->had_send_error)
+        {
+            /* Not much to do, we don't know if the previous send sent any
+             * data, nor if we're being presented with the same data again */
+            trace(data, "Request to send data after previous send failed\n");
+            return (-1);
+        }
+
+    /* Each send is a record of its own unless asked to coalesce them,
+       the data buffered before the option was cleared going first */
+    if (!data->coalesce_sends)
+        {
+            if (cgsi_plugin_flush_send(soap, data) != SOAP_OK)
+                return -1;
+            return cgsi_plugin_wrap_send_records(soap, data, buf, len);
+        }
+
+    if (data->send_buf == NULL)
+        {
+            data->send_buf = (char *) malloc(CGSI_SEND_BUFSIZE);
+            if (data->send_buf == NULL)
+                return cgsi_plugin_wrap_send(soap, data, buf, len);
+        }
+
+    while (len > 0)
+        {
+            /* Full records are wrapped straight from the caller's data */
+            if (data->send_len == 0 && len >= CGSI_SEND_BUFSIZE)
+                {
+                    n = len - len % CGSI_SEND_BUFSIZE;
+                    if (cgsi_plugin_wrap_send_records(soap, data, buf, n) != SOAP_OK)
+                        return -1;
+                    buf += n;
+                    len -= n;
+                    continue;
+                }
+
+            n = CGSI_SEND_BUFSIZE - data->send_len;
+            if (n > len)
+                n = len;
+            memcpy(data->send_buf + data->send_len, buf, n);
+            data->send_len += n;
+            buf += n;
+            len -= n;
+
+            if (data->send_len == CGSI_SEND_BUFSIZE &&
+                    cgsi_plugin_flush_send(soap, data) != SOAP_OK)
+                return -1;
+        }
+
+    return SOAP_OK;
+}
+
+
+/**
+ * Reads and unwraps a record, copying up to len bytes of it into buf
+ * and keeping the rest for the next calls.
+ * Returns the number of bytes copied, -1 on error.
+ */
+static int cgsi_plugin_recv_record(struct soap *soap, struct cgsi_plugin_data *data, char *buf, size_t len)
 {
-    int ret, rem;
-    char *tok, *p;
-    int len;
-    char readbuf[SSLHSIZE];
-    struct soap *soap = (struct soap *)arg;
-    struct cgsi_plugin_data *data;
 
-    if (soap == NULL)
+    OM_uint32 major_status;
+    OM_uint32 minor_status, minor_status1;
+    int token_status, allocated, ret;
+    size_t tmplen;
+    gss_buffer_desc                       input_token_desc  = GSS_C_EMPTY_BUFFER;
+    gss_buffer_t                          input_token       = &input_token_desc;
+    gss_buffer_desc                       output_token_desc = GSS_C_EMPTY_BUFFER;
+    gss_buffer_t                          output_token      = &output_token_desc;
+
+    token_status = cgsi_plugin_recv_token_in_place(soap, data,
+                                                   &input_token->value,
+                                                   &input_token->length,
+                                                   &allocated);
+
+    if (token_status != 0)
         {
-            cgsi_err(soap, "Error: SOAP object is NULL");
+            trace(data, "Token status <> 0\n");
+            /* Soap fault already reported */
             return -1;
         }
 
-    data = get_plugin(soap);
+    if (data->context_handle != GSS_C_NO_CONTEXT &&
+        ((unsigned char *) input_token->value)[0] == SSL3_RT_APPLICATION_DATA &&
+        cgsi_plugin_can_ssl_read(data))
+        {
+            /* Plain TLS record: decrypted by the SSL object straight into buf */
+            ret = cgsi_plugin_ssl_read(soap, data, input_token->value, input_token->length, buf, len);
+            if (allocated)
+                gss_release_buffer(&minor_status1,
+                                   input_token);
+            return ret;
+        }
+    else if (data->context_handle != GSS_C_NO_CONTEXT)
+        {
+            ERR_clear_error();
+            major_status = gss_unwrap(&minor_status,
+                                      data->context_handle,
+                                      input_token,
+                                      output_token,
+                                      NULL,
+                                      NULL);
 
-    /* Reads SSL Record layer header ! */
-    p = readbuf;
-    rem = SSLHSIZE;
-    while (rem>0)
+            if (allocated)
+                gss_release_buffer(&minor_status1,
+                                   input_token);
+        }
+    else
         {
-            /* trace(data, "%d Remaining %d\n", getpid(), rem); */
-            errno = 0;
-            soap->error = 0;
-            soap->errnum = 0; 
-            ret = data->frecv(soap, p, rem);
-            if (ret <= 0)   /* BEWARE soap_recv returns 0 when an error occurs ! */
-                {
-                    char buf[BUFSIZE];
+            /* we don't expect to asked to read without a security context.
+             * Best not to read anything which may or may not be wrapped,
+             * so we just fail. Assume a useful fault message has already seen set */
+            trace(data, "Request to read data, without having a security context, failed\n");
+            if (allocated)
+                gss_release_buffer(&minor_status1,
+                                   input_token);
+            return -1;
+        }
 
-                    if (soap->errnum)
-                        snprintf(buf, BUFSIZE, "Error reading token data header: %s", strerror(soap->errnum));
-                    else if (errno)
-                        snprintf(buf, BUFSIZE, "Error reading token data header: %s", strerror(errno));
-                    else if (soap->error)
-                        snprintf(buf, BUFSIZE, "Error reading token data header: SOAP error %d", soap->error);
-                    else {
-                        snprintf(buf, BUFSIZE, "Error reading token data header: Connection closed");
-                        if (soap_lookup_plugin(soap, client_plugin_id) == NULL ) {
-                          /* We are a server - avoid the error being retransmitted 
-                            to the client upon reconnection */
-                          return -1;
-                        }
-                    }
-                    
-                    cgsi_err(soap, buf);
+    if (major_status != GSS_S_COMPLETE)
+        {
+            cgsi_gssapi_err(soap,
+                            "Error unwrapping the data",
+                            major_status,
+                            minor_status);
+            gss_release_buffer(&minor_status1,
+                               output_token);
+            return -1;
+        }
+
+    tmplen = len < output_token->length ? len : output_token->length;
+
+    memcpy(buf, output_token->value, tmplen);
+
+    if( tmplen < output_token->length)
+        {
+            /* Keeping the record, the rest is returned by the next calls */
+            data->buffered_in = *output_token;
+            data->buffered_offset = tmplen;
+        }
+    else
+        {
+            gss_release_buffer(&minor_status1,
+                               output_token);
+        }
+
+    return (int) tmplen;
+}
+
+/**
+ * Tells whether the records can be decrypted by cgsi_plugin_ssl_read(): only
+ * with CGSI_OPT_DIRECT_DECRYPT, and once the context is found to have the
+ * layout of gss_ctx_id_desc, its flags matching those gss_inquire_context()
+ * reports and its read BIO being that of its SSL object.
+ * Returns 1 if they can, 0 if they are to be passed to gss_unwrap().
+ */
+static int cgsi_plugin_can_ssl_read(struct cgsi_plugin_data *data)
+{
+    gss_ctx_id_desc *context = (gss_ctx_id_desc *) data->context_handle;
+    OM_uint32 major_status, minor_status, ctx_flags;
+    int local;
+
+    if (!data->direct_decrypt)
+        return 0;
+
+    if (data->direct_layout == 0)
+        {
+            data->direct_layout = -1;
+            major_status = gss_inquire_context(&minor_status, data->context_handle,
+                                               NULL, NULL, NULL, NULL,
+                                               &ctx_flags, &local, NULL);
+            if (major_status == GSS_S_COMPLETE &&
+                context->ret_flags == ctx_flags &&
+                context->locally_initiated == local &&
+                context->gss_ssl != NULL && context->gss_rbio != NULL &&
+                SSL_get_rbio(context->gss_ssl) == context->gss_rbio)
+                data->direct_layout = 1;
+            else
+                trace(data, "GSS context layout not recognized, decrypting with gss_unwrap\n");
+        }
+
+    return data->direct_layout == 1;
+}
+
+/**
+ * Decrypts a TLS record of application data into buf by feeding it to the
+ * SSL object of the context, as gss_unwrap() does, but without going through
+ * an output token. As gss_unwrap(), it fails once the context has expired
+ * when the context was asked to. The plaintext which does not fit in buf is left in the SSL
+ * object and returned by the next calls, made with a NULL token.
+ * Returns the number of bytes decrypted, -1 on error.
+ */
+static int cgsi_plugin_ssl_read(struct soap *soap, struct cgsi_plugin_data *data,
+                                const void *token, size_t token_length, char *buf, size_t len)
+{
+    gss_ctx_id_desc *context = (gss_ctx_id_desc *) data->context_handle;
+    int ret, ssl_error;
+
+    if (len > INT_MAX)
+        len = INT_MAX;
+
+    if (token != NULL && (context->ctx_flags & GSS_I_PROTECTION_FAIL_ON_CONTEXT_EXPIRATION))
+        {
+            OM_uint32 major_status, minor_status, time_rec;
+
+            major_status = gss_context_time(&minor_status, data->context_handle, &time_rec);
+            if (major_status != GSS_S_COMPLETE || time_rec == 0)
+                {
+                    cgsi_gssapi_err(soap,
+                                    "Error unwrapping the data",
+                                    major_status != GSS_S_COMPLETE ? major_status : GSS_S_CONTEXT_EXPIRED,
+                                    minor_status);
                     return -1;
                 }
-            p = p + ret;
-            rem = rem - ret;
         }
 
+    globus_mutex_lock(&context->mutex);
+    ERR_clear_error();
+    if (token != NULL &&
+        BIO_write(context->gss_rbio, token, (int) token_length) != (int) token_length)
+        {
+            globus_mutex_unlock(&context->mutex);
+            cgsi_err(soap, "Error unwrapping the data: could not pass the record to SSL");
+            return -1;
+        }
+    ret = SSL_read(context->gss_ssl, buf, (int) len);
+    ssl_error = ret > 0 ? SSL_ERROR_NONE : SSL_get_error(context->gss_ssl, ret);
+    data->unwrap_pending = ret > 0 && SSL_pending(context->gss_ssl) > 0;
+    globus_mutex_unlock(&context->mutex);
+
+    if (ret > 0)
+        {
+            if (token != NULL)
+                data->recv_direct++;
+            return ret;
+        }
+
+    /* Records without application data, like TLS 1.3 session tickets */
+    if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_ZERO_RETURN)
+        return 0;
+
+    {
+        char errbuf[BUFSIZE];
+        snprintf(errbuf, BUFSIZE, "Error unwrapping the data: %s",
+                 ERR_reason_error_string(ERR_peek_last_error()) ?
+                 ERR_reason_error_string(ERR_peek_last_error()) : "SSL error");
+        cgsi_err(soap, errbuf);
+    }
+    return -1;
+}
+
+/**
+ * Tells whether a whole record has been read ahead, so that it can be
+ * unwrapped without waiting for the rest of it
+ */
+static int cgsi_plugin_record_ready(struct cgsi_plugin_data *data)
+{
+    size_t avail = data->read_end - data->read_start;
+    int len;
+
+    if (avail < SSLHSIZE)
+        return 0;
+    len = cgsi_record_length(data->read_buf + data->read_start);
+    return len >= 0 && (size_t) len + SSLHSIZE <= avail;
+}
+
+static size_t cgsi_plugin_recv(struct soap *soap, struct cgsi_plugin_data *data, char *buf, size_t len)
+{
+
+    OM_uint32 minor_status1;
+    size_t tmplen = 0;
+    int ret;
+
+    /* The message sent so far is complete when the peer's answer is read */
+    if (cgsi_plugin_flush_send(soap, data) != SOAP_OK)
+        return 0;
+
+    if (data->had_recv_error)
+        {
+            /* The data read before the error has been returned */
+            cgsi_err(soap, "Error reading token data");
+            return 0;
+        }
+
+    if (data->unwrap_pending)
+        {
+            ret = cgsi_plugin_ssl_read(soap, data, NULL, 0, buf, len);
+            if (ret < 0)
+                return 0;
+            tmplen = ret;
+        }
+    else if(data->buffered_in.value != NULL)
+        {
+            tmplen = data->buffered_in.length - data->buffered_offset;
+            if (len < tmplen)
+                tmplen = len;
+
+            memcpy(buf, (char *)data->buffered_in.value + data->buffered_offset, tmplen);
+
+            data->buffered_offset += tmplen;
+            if(data->buffered_offset == data->buffered_in.length)
+                {
+                    gss_release_buffer(&minor_status1, &data->buffered_in);
+                    data->buffered_offset = 0;
+                }
+        }
+
+    /* Unwrapping the records already read whole while the caller's buffer has
+       room, and waiting for one if there is nothing to return yet. The
+       plaintext is returned rather than waiting for the rest of a record */
+    while (tmplen < len && data->buffered_in.value == NULL && !data->unwrap_pending)
+        {
+            if (tmplen > 0 && !cgsi_plugin_record_ready(data))
+                break;
+
+            ret = cgsi_plugin_recv_record(soap, data, buf + tmplen, len - tmplen);
+            if (ret < 0)
+                {
+                    if (tmplen == 0)
+                        return 0;
+                    /* Reported on the next call */
+                    data->had_recv_error = 1;
+                    break;
+                }
+            tmplen += ret;
+        }
+
+    trace(data, "<Receiving SOAP Packet>-------------\n");
+    trace_str(data, buf, tmplen);
+    trace(data, "\n----------------------------------\n");
+
+    return (size_t) tmplen;
+}
+
+
+/**
+ * Reads up to len bytes of the connection, from what was read ahead if
+ * anything, else reading as much as the socket has ready at once.
+ * Returns what data->frecv returns.
+ */
+static size_t cgsi_plugin_read(struct soap *soap, struct cgsi_plugin_data *data, char *buf, size_t len)
+{
+    size_t ret;
+
+    if (data->read_start == data->read_end)
+        {
+            data->read_start = data->read_end = 0;
+
+            /* Nothing to gain from the copy for large reads */
+            if (len >= CGSI_READ_AHEAD_SIZE)
+                return data->frecv(soap, buf, len);
+
+            if (data->read_buf == NULL)
+                {
+                    data->read_buf = (char *) malloc(CGSI_READ_AHEAD_SIZE);
+                    if (data->read_buf == NULL)
+                        return data->frecv(soap, buf, len);
+                }
+
+            ret = data->frecv(soap, data->read_buf, CGSI_READ_AHEAD_SIZE);
+            if (ret == 0)
+                return 0;
+            data->read_end = ret;
+        }
+
+    ret = data->read_end - data->read_start;
+    if (ret > len)
+        ret = len;
+    memcpy(buf, data->read_buf + data->read_start, ret);
+    data->read_start += ret;
+    return ret;
+}
+
+/**
+ * Reports the failure of a read of the connection, unless the peer of a
+ * server closed it while reading a header.
+ * Returns -1.
+ */
+static int cgsi_plugin_read_failed(struct soap *soap, const char *what, int header)
+{
+    char buf[BUFSIZE];
+
+    if (soap->errnum)
+        snprintf(buf, BUFSIZE, "%s: %s", what, strerror(soap->errnum));
+    else if (errno)
+        snprintf(buf, BUFSIZE, "%s: %s", what, strerror(errno));
+    else if (soap->error)
+        snprintf(buf, BUFSIZE, "%s: SOAP error %d", what, soap->error);
+    else {
+        snprintf(buf, BUFSIZE, "%s: Connection closed", what);
+        if (header && cgsi_find_plugin(soap, client_plugin_id) == NULL ) {
+          /* We are a server - avoid the error being retransmitted 
+            to the client upon reconnection */
+          return -1;
+        }
+    }
+
+    cgsi_err(soap, buf);
+    return -1;
+}
+
+/**
+ * Returns the length of the record following the SSL record header
+ */
+static int cgsi_record_length(const char *readbuf)
+{
+    int len;
+    char *p;
 
     /* Initialization, len will contain the length of the message */
     len = 0;
@@ -1757,6 +3369,55 @@ int cgsi_plugin_recv_token(void *arg, void **token, size_t *token_length)
 
         }
 
+    return len;
+}
+
+int cgsi_plugin_recv_token(void *arg, void **token, size_t *token_length)
+{
+    struct soap *soap = (struct soap *)arg;
+
+    if (soap == NULL)
+        {
+            cgsi_err(soap, "Error: SOAP object is NULL");
+            return -1;
+        }
+
+    return cgsi_plugin_read_token(soap, get_plugin(soap), token, token_length);
+}
+
+/**
+ * Reads a token of the connection of the plugin data passed into an
+ * allocated buffer.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_plugin_read_token(struct soap *soap, struct cgsi_plugin_data *data,
+                                  void **token, size_t *token_length)
+{
+    int ret, rem;
+    char *tok, *p;
+    int len;
+    char readbuf[SSLHSIZE];
+
+    /* Reads SSL Record layer header ! */
+    p = readbuf;
+    rem = SSLHSIZE;
+    while (rem>0)
+        {
+            /* trace(data, "%d Remaining %d\n", getpid(), rem); */
+            errno = 0;
+            soap->error = 0;
+            soap->errnum = 0; 
+            ret = cgsi_plugin_read(soap, data, p, rem);
+            if (ret <= 0)   /* BEWARE soap_recv returns 0 when an error occurs ! */
+                {
+                    return cgsi_plugin_read_failed(soap, "Error reading token data header", 1);
+                }
+            p = p + ret;
+            rem = rem - ret;
+        }
+
+    len = cgsi_record_length(readbuf);
+
     /* AT this point, the token length is len + the number of bytes already read,
        i.e. SSLHSIZE */
 
@@ -1777,23 +3438,11 @@ int cgsi_plugin_recv_token(void *arg, void **token, size_t *token_length)
             errno = 0;
             soap->error = 0;
             soap->errnum = 0;
-            ret =  data->frecv(soap, p, rem);
+            ret = cgsi_plugin_read(soap, data, p, rem);
             if (ret <= 0)
                 {
-                    char buf[BUFSIZE];
-
-                    if (soap->errnum)
-                        snprintf(buf, BUFSIZE, "Error reading token data: %s", strerror(soap->errnum));
-                    else if (errno)
-                        snprintf(buf, BUFSIZE, "Error reading token data: %s", strerror(errno));
-                    else if (soap->error)
-                        snprintf(buf, BUFSIZE, "Error reading token data: SOAP error %d", soap->error);
-                    else
-                        snprintf(buf, BUFSIZE, "Error reading token data: Connection closed");
-
-                    cgsi_err(soap, buf);
                     free(tok);
-                    return -1;
+                    return cgsi_plugin_read_failed(soap, "Error reading token data", 0);
                 }
             p = p + ret;
             rem = rem - ret;
@@ -1811,11 +3460,91 @@ int cgsi_plugin_recv_token(void *arg, void **token, size_t *token_length)
     return 0;
 }
 
+/**
+ * Reads the connection until the read ahead buffer holds at least need bytes
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_plugin_fill(struct soap *soap, struct cgsi_plugin_data *data, size_t need)
+{
+    size_t ret;
+
+    errno = 0;
+    soap->error = 0;
+    soap->errnum = 0;
+
+    if (data->read_buf == NULL)
+        {
+            data->read_buf = (char *) malloc(CGSI_READ_AHEAD_SIZE);
+            if (data->read_buf == NULL)
+                return -1;
+            data->read_start = data->read_end = 0;
+        }
+
+    /* Making room for the rest of a record split between reads */
+    if (data->read_start + need > CGSI_READ_AHEAD_SIZE)
+        {
+            memmove(data->read_buf, data->read_buf + data->read_start,
+                    data->read_end - data->read_start);
+            data->read_end -= data->read_start;
+            data->read_start = 0;
+        }
+
+    while (data->read_end - data->read_start < need)
+        {
+            ret = data->frecv(soap, data->read_buf + data->read_end,
+                              CGSI_READ_AHEAD_SIZE - data->read_end);
+            if (ret == 0)
+                return -1;
+            data->read_end += ret;
+        }
+    return 0;
+}
+
+/**
+ * Reads a token like cgsi_plugin_recv_token(), but returning it where it
+ * lies in the read ahead buffer, valid until the next read. Tokens which do
+ * not fit in the buffer are allocated, which is told by allocated.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_plugin_recv_token_in_place(struct soap *soap, struct cgsi_plugin_data *data,
+                                           void **token, size_t *token_length, int *allocated)
+{
+    size_t total;
+    int len;
+
+    *allocated = 0;
+    if (cgsi_plugin_fill(soap, data, SSLHSIZE) != 0)
+        return cgsi_plugin_read_failed(soap, "Error reading token data header", 1);
+
+    len = cgsi_record_length(data->read_buf + data->read_start);
+    total = len + SSLHSIZE;
+    if (len < 0 || total > CGSI_READ_AHEAD_SIZE)
+        {
+            *allocated = 1;
+            data->recv_allocated++;
+            return cgsi_plugin_read_token(soap, data, token, token_length);
+        }
+
+    if (cgsi_plugin_fill(soap, data, total) != 0)
+        return cgsi_plugin_read_failed(soap, "Error reading token data", 0);
+
+    *token = data->read_buf + data->read_start;
+    *token_length = total;
+    data->read_start += total;
+    data->recv_in_place++;
+
+    {
+        char buf[TBUFSIZE];
+        snprintf(buf, TBUFSIZE,  "================= RECVING: %d\n", (int) total);
+        trace(data, buf);
+    }
+    cgsi_plugin_print_token(data, (char *) *token, total);
+    return 0;
+}
+
 
 int cgsi_plugin_send_token(void *arg, void *token, size_t token_length)
 {
-    int ret;
-    struct cgsi_plugin_data *data;
     struct soap *soap = (struct soap *)arg;
 
     if (soap == NULL)
@@ -1824,7 +3553,17 @@ int cgsi_plugin_send_token(void *arg, void *token, size_t token_length)
             return -1;
         }
 
-    data = get_plugin(soap);
+    return cgsi_plugin_write_token(soap, get_plugin(soap), token, token_length);
+}
+
+/**
+ * Sends a token on the connection of the plugin data passed.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_plugin_write_token(struct soap *soap, struct cgsi_plugin_data *data,
+                                   void *token, size_t token_length)
+{
+    int ret;
 
     {
         char buf[TBUFSIZE];
@@ -1853,636 +3592,3057 @@ int cgsi_plugin_send_token(void *arg, void *token, size_t token_length)
             return -1;
         }
 
-    return 0;
+    return 0;
+}
+
+void cgsi_plugin_print_token(struct cgsi_plugin_data *data, char *token, int length)
+{
+    int i;
+    unsigned char *p;
+    char buf[TBUFSIZE];
+
+    /* can avoid printing all the token if the trace routine
+     * is disabled */
+    if (data->trace_mode < 2)
+        {
+            return;
+        }
+
+    /* printing the characters as unsigned hex digits */
+    p = (unsigned char *)token;
+
+    for (i=0; i < length; i++, p++)
+        {
+            snprintf(buf, TBUFSIZE,"%02x ", *p);
+            trace(data, buf);
+            if ((i % 16) == 15)
+                {
+                    trace(data, "\n");
+                }
+        }
+    trace(data, "\n");
+}
+
+
+/**
+ * Function to display the GSS-API errors
+ */
+static void cgsi_gssapi_err(struct soap *soap, const char *msg, OM_uint32 maj_stat, OM_uint32 min_stat)
+{
+
+    int ret;
+    char buffer[BUFSIZE],hostname[NI_MAXHOST];
+    int bufsize;
+    char *buf;
+    struct cgsi_plugin_data *data;
+    int isclient = 1;
+
+    /* Check if we are a client */
+    data = cgsi_find_plugin(soap, client_plugin_id);
+    if (data == NULL)
+        {
+            isclient = 0;
+        }
+
+    if (gethostname(hostname, sizeof(hostname))<0)
+        {
+            strncpy(hostname, "unknown", sizeof(hostname));
+        }
+    hostname[sizeof(hostname)-1] = '\0';
+
+    bufsize = BUFSIZE;
+    snprintf(buffer, bufsize, CGSI_PLUGIN " running on %s reports %s\n", hostname, msg);
+    buf = buffer +strlen(buffer);
+    bufsize -= strlen(buffer);
+
+    ret =  cgsi_display_status_1(msg, maj_stat, GSS_C_GSS_CODE, buf, bufsize);
+    if (bufsize-ret > 1)
+        {
+            strcat(buf, "\n");
+            ret++;
+        }
+    buf += ret;
+    bufsize -= ret;
+    cgsi_display_status_1(msg, min_stat, GSS_C_MECH_CODE, buf, bufsize);
+
+    if (isclient)
+        {
+            soap_sender_fault(soap, buffer, NULL);
+        }
+    else
+        {
+            soap_receiver_fault(soap, buffer, NULL);
+        }
+}
+
+/**
+  * Displays the GSS-API error messages in the error buffer
+ */
+static int cgsi_display_status_1(const char *m, OM_uint32 code, int type, char *buf, int buflen)
+{
+    OM_uint32 maj_stat, min_stat;
+    gss_buffer_desc msg;
+    OM_uint32 msg_ctx;
+    int count,ret;
+    char *buf0 = buf;
+
+    if (buflen<=1)
+        return(0);
+
+    msg_ctx = 0;
+    count = 0;
+    while (1)
+        {
+            maj_stat = gss_display_status(&min_stat, code,
+                                          type, GSS_C_NULL_OID,
+                                          &msg_ctx, &msg);
+
+            ret = snprintf(buf, buflen, "%s\n", (char *)msg.value);
+            (void) gss_release_buffer(&min_stat, &msg);
+
+            if (ret < 0)
+                {
+                    *buf = '\0';
+                    break;
+                }
+
+            if (ret >= buflen)
+                ret = buflen - 1;
+
+            count += ret;
+            buf += ret;
+            buflen -= ret;
+
+            if (!msg_ctx || buflen<=1)
+                break;
+        }
+
+    if (count>0 && buf0[count-1] == '\n')
+        {
+            buf0[count-1] = '\0';
+            count--;
+        }
+
+    return count;
+}
+
+static void cgsi_err(struct soap *soap, const char *msg)
+{
+
+    struct cgsi_plugin_data *data;
+    int isclient = 1;
+    char buffer[BUFSIZE],hostname[NI_MAXHOST];
+
+    /* Check if we are a client */
+    data = cgsi_find_plugin(soap, client_plugin_id);
+    if (data == NULL)
+        {
+            isclient = 0;
+        }
+
+    if (gethostname(hostname, sizeof(hostname))<0)
+        {
+            strncpy(hostname, "unknown", sizeof(hostname));
+        }
+    hostname[sizeof(hostname)-1] = '\0';
+
+    snprintf(buffer, sizeof(buffer), CGSI_PLUGIN " running on %s reports %s", hostname, msg);
+
+    if (isclient)
+        {
+            soap_sender_fault(soap, buffer, NULL);
+        }
+    else
+        {
+            soap_receiver_fault(soap, buffer, NULL);
+        }
+}
+
+/**
+ * Parses the argument passed to the plugin constructor
+ * and initializes the plugin_data object accordingly
+ */
+static int cgsi_parse_opts(struct cgsi_plugin_data *p, void *arg, int isclient)
+{
+    int opts;
+
+    /* Default values */
+    p->disable_hostname_check = 0;
+    p->allow_only_self = 0;
+    p->disable_mapping = 0;
+    p->disable_voms_check = 0;
+    p->lazy_voms_check = 0;
+    p->defer_name_check = 0;
+    p->coalesce_sends = 0;
+    p->direct_decrypt = 0;
+    p->context_flags = GSS_C_CONF_FLAG | GSS_C_MUTUAL_FLAG | GSS_C_INTEG_FLAG;
+
+    if (arg == NULL)
+        {
+            /* Default is just confidentiality and mutual authentication */
+            return 0;
+        }
+
+    opts = (*((int *)arg));
+
+    if (opts & CGSI_OPT_DELEG_FLAG)
+        {
+            p->context_flags |= GSS_C_DELEG_FLAG;
+        }
+
+    if (opts & CGSI_OPT_SSL_COMPATIBLE)
+        {
+            p->context_flags |= GSS_C_GLOBUS_SSL_COMPATIBLE;
+        }
+
+    if (opts & CGSI_OPT_DISABLE_NAME_CHECK)
+        {
+            p->disable_hostname_check = 1;
+        }
+
+    if (opts & CGSI_OPT_DISABLE_MAPPING)
+        {
+            p->disable_mapping = 1;
+        }
+
+    if (opts & CGSI_OPT_DISABLE_VOMS_CHECK)
+        {
+            p->disable_voms_check = 1;
+        }
+
+    if (opts & CGSI_OPT_LAZY_VOMS_CHECK)
+        {
+            p->lazy_voms_check = 1;
+        }
+
+    if (opts & CGSI_OPT_DEFER_NAME_CHECK)
+        {
+            p->defer_name_check = 1;
+        }
+
+    if (opts & CGSI_OPT_COALESCE_SENDS)
+        {
+            p->coalesce_sends = 1;
+        }
+
+    if (opts & CGSI_OPT_DIRECT_DECRYPT)
+        {
+            p->direct_decrypt = 1;
+        }
+
+    if (opts & CGSI_OPT_ALLOW_ONLY_SELF)
+        {
+            p->allow_only_self = 1;
+        }
+
+    return 0;
+}
+
+/**
+ * Looks up the plugin data by name, counting it in the data found as it
+ * is only expected when the plugin was registered by another copy of
+ * the library
+ */
+static struct cgsi_plugin_data *cgsi_lookup_plugin_by_name(struct soap *soap, const char *id)
+{
+    struct cgsi_plugin_data *data;
+
+    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, id);
+    if (data != NULL)
+        data->lookups_by_name++;
+    return data;
+}
+
+/**
+ * Looks up the plugin data registered with the id passed. The plugins
+ * registered by this library hold the address of its id strings, so they
+ * are found by comparing pointers, without the string comparisons of
+ * soap_lookup_plugin() on every read and write.
+ */
+static struct cgsi_plugin_data *cgsi_find_plugin(struct soap *soap, const char *id)
+{
+    struct soap_plugin *p;
+    int registered = 0;
+
+    for (p = soap->plugins; p != NULL; p = p->next)
+        {
+            if (p->id == id)
+                return (struct cgsi_plugin_data*)p->data;
+            if (p->id == client_plugin_id || p->id == server_plugin_id)
+                registered = 1;
+        }
+
+    /* The other plugin of this library is there, as when a server looks for the client one */
+    if (registered)
+        return NULL;
+
+    return cgsi_lookup_plugin_by_name(soap, id);
+}
+
+/**
+ * Look's up the plugin, be it client or server
+ */
+static struct cgsi_plugin_data* get_plugin(struct soap *soap)
+{
+
+    struct cgsi_plugin_data *data = NULL;
+    struct soap_plugin *p;
+
+    /* Both ids are looked for at once, a server has no client plugin */
+    for (p = soap->plugins; p != NULL; p = p->next)
+        if (p->id == client_plugin_id || p->id == server_plugin_id)
+            return (struct cgsi_plugin_data*)p->data;
+
+    /* Check if we are a client */
+    data = cgsi_lookup_plugin_by_name(soap, client_plugin_id);
+    if (data == NULL)
+        {
+            data = cgsi_lookup_plugin_by_name(soap, server_plugin_id);
+        }
+
+    return data;
+}
+
+
+/**
+ * Returns 1 if the context has been extablished, 0 if not,
+ * or -1 if an error happened during plugin lookup.
+ *
+ */
+int is_context_established(struct soap *soap)
+{
+
+    struct cgsi_plugin_data *data = NULL;
+
+    data = get_plugin(soap);
+    if (data == NULL) return -1;
+
+    return data->context_established;
+}
+
+/**
+ * Copies the client DN in the buffer passed.
+ * Returns 0 if everything ok, -1 otherwise.
+ *
+ */
+int get_client_dn(struct soap *soap, char *dn, size_t dnlen)
+{
+    struct cgsi_plugin_data *data = NULL;
+    data = get_plugin(soap);
+    if (data == NULL) return -1;
+
+    memset(dn, '\0', dnlen);
+    strncpy(dn, data->client_name, dnlen);
+    return 0;
+}
+
+/**
+ * Copies the client username in the buffer passed.
+ * Returns 0 if everything ok, -1 otherwise.
+ *
+ */
+int get_client_username(struct soap *soap, char *username, size_t usernamelen)
+{
+    struct cgsi_plugin_data *data = NULL;
+    data = get_plugin(soap);
+    if (data == NULL) return -1;
+
+    memset(username, '\0', usernamelen);
+    strncpy(username, data->username, usernamelen);
+    return 0;
+}
+
+
+
+/**
+ * Checks the environment to setup the trace mode,
+ * if CGSI_TRACE is set
+ * If CGSI_TRACEFILE is set, the output is written to that file,
+ * otherwise, it is sent to stderr.
+ */
+static int setup_trace(struct cgsi_plugin_data *data)
+{
+    char *envar;
+
+    data->trace_mode = 0;
+    data->trace_file[0] = data->trace_file[CGSI_MAXNAMELEN-1]= '\0';
+
+    envar = getenv(CGSI_TRACE);
+    if (envar != NULL)
+        {
+            errno = 0;
+            data->trace_mode = strtol(envar, NULL, 10);
+            if (errno)
+                data->trace_mode = 1;
+            envar = getenv(CGSI_TRACEFILE);
+            if (envar != NULL)
+                {
+                    strncpy(data->trace_file, envar, CGSI_MAXNAMELEN-1);
+                }
+        }
+    return 0;
+}
+
+
+static int trace(struct cgsi_plugin_data *data, const char *tracestr)
+{
+    if (!data->trace_mode)
+        {
+            return 0;
+        }
+
+    return trace_str(data, tracestr, strlen(tracestr));
+}
+
+static int trace_str(struct cgsi_plugin_data *data, const char *msg, int len)
+{
+    if (!data->trace_mode)
+        {
+            return 0;
+        }
+
+    /* If no trace file defined, write to stderr */
+    if (data->trace_file[0]=='\0')
+        {
+            int i;
+            for (i = 0; i < len; ++i) {
+                if (data->start_new_line) {
+                    fputs("[CGSI-GSOAP] ", stderr);
+                    data->start_new_line = 0;
+                }
+
+                fputc(msg[i], stderr);
+                if (msg[i] == '\n')
+                    data->start_new_line = 1;
+            }
+        }
+    else
+        {
+            int fd;
+            fd = open(data->trace_file, O_CREAT|O_WRONLY|O_APPEND, 0644);
+            if (fd <0) return -1;
+            write(fd, msg, len);
+            close(fd);
+        }
+    return 0;
+}
+
+int get_delegated_credentials(struct soap *soap, void **buffer, size_t *length)
+{
+    OM_uint32 maj_stat, min_stat;
+    gss_buffer_desc buffer_desc = GSS_C_EMPTY_BUFFER;
+    struct cgsi_plugin_data *data;
+
+    if (soap == NULL || buffer == NULL || length == NULL)
+        {
+            cgsi_err(soap, "invalid argument passed to get_delegated_credentials");
+            return -1;
+        }
+
+    data = cgsi_find_plugin(soap,
+            server_plugin_id);
+
+    if (data == NULL)
+        {
+            cgsi_err(soap, "get delegated credentials: could not get data structure");
+            return -1;
+        }
+
+    if (data->deleg_credential_token)
+        {
+            *buffer = data->deleg_credential_token;
+            *length = data->deleg_credential_token_len;
+            return 0;
+        }
+
+    if (data->deleg_cred_set == 0)
+        {
+            cgsi_err(soap, "get delegated credentials: no delegated credentials available");
+            return -1;
+        }
+
+    maj_stat = gss_export_cred(&min_stat,
+                               data->deleg_credential_handle,
+                               GSS_C_NO_OID,
+                               0,
+                               &buffer_desc);
+
+    if (maj_stat != GSS_S_COMPLETE)
+        {
+            cgsi_gssapi_err(soap,  "Error exporting credentials", maj_stat, min_stat);
+            return -1;
+        }
+
+    data->deleg_credential_token = malloc(buffer_desc.length);
+    if (data->deleg_credential_token == NULL)
+        {
+            (void) gss_release_buffer(&min_stat, &buffer_desc);
+            cgsi_err(soap, "get_delegated_credentials: could not allocate memory");
+            return -1;
+        }
+
+    memcpy(data->deleg_credential_token, buffer_desc.value, buffer_desc.length);
+    data->deleg_credential_token_len = buffer_desc.length;
+
+    (void) gss_release_buffer(&min_stat, &buffer_desc);
+
+    *buffer = data->deleg_credential_token;
+    *length = data->deleg_credential_token_len;
+    return 0;
+}
+
+int export_delegated_credentials(struct soap *soap, char *filename)
+{
+    const char *token;
+    size_t token_length;
+    int fd;
+
+    if (soap == NULL)
+        {
+            cgsi_err(soap, "invalid argument passed to export_delegated_credentials");
+            return -1;
+        }
+
+    if (get_delegated_credentials(soap, (void **)&token, &token_length)<0)
+        {
+            cgsi_err(soap, "export delegated credentials: could not get credential token");
+            return -1;
+        }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        {
+            cgsi_err(soap, "export delegated credentials: could not open temp file");
+            return -1;
+        }
+
+    if (write(fd, token, token_length) != (ssize_t)token_length)
+        {
+            char buf[BUFSIZE];
+            snprintf(buf, BUFSIZE, "export delegated credentials: could not write to file (%s)",
+                     strerror(errno));
+            cgsi_err(soap, buf);
+            if(fd >= 0)
+                close(fd);
+            return -1;
+        }
+
+    if (close(fd)<0)
+        {
+            char buf[BUFSIZE];
+            snprintf(buf, BUFSIZE, "export delegated credentials: could not close file (%s)",
+                     strerror(errno));
+            cgsi_err(soap, buf);
+            return -1;
+        }
+
+    return 0;
+}
+
+
+#define PROXY_ENV_VAR "X509_USER_PROXY"
+
+int set_default_proxy_file(struct soap *soap, char *filename)
+{
+    int rc;
+
+    rc = setenv(PROXY_ENV_VAR, filename, 1);
+    if (rc < 0)
+        {
+            char buf[BUFSIZE];
+            snprintf(buf, BUFSIZE, "set default proxy file: could not setenv (%s)",
+                     strerror(errno));
+            cgsi_err(soap, buf);
+            return -1;
+        }
+    return 0;
+}
+
+
+void clear_default_proxy_file(int unlink_file)
+{
+    char *proxy_file;
+
+    /* Removing the credentials file if flagged so */
+    if (unlink_file)
+        {
+            proxy_file = getenv(PROXY_ENV_VAR);
+            if (proxy_file != NULL)
+                {
+                    unlink(proxy_file);
+                }
+        }
+
+    /* Clearing the environment variable */
+    unsetenv(PROXY_ENV_VAR);
+}
+
+
+int has_delegated_credentials(struct soap *soap)
+{
+    struct cgsi_plugin_data *data;
+
+    if (soap == NULL)
+        {
+            return -1;
+        }
+
+    data = cgsi_find_plugin(soap, server_plugin_id);
+
+    if (data == NULL)
+        {
+            cgsi_err(soap, "export delegated credentials: could not get data structure");
+            return -1;
+        }
+
+    if (data->deleg_cred_set != 0)
+        {
+            return 1;
+        }
+
+    return 0;
+}
+
+
+int soap_cgsi_init(struct soap *soap, int cgsi_options)
+{
+    int params, rc;
+
+    params = cgsi_options;
+    if( cgsi_options & CGSI_OPT_KEEP_ALIVE )
+        soap_init2( soap, SOAP_IO_KEEPALIVE, SOAP_IO_KEEPALIVE );
+    else
+        soap_init(soap);
+    rc = soap_register_plugin_arg(soap, cgsi_plugin, &params);
+    if (rc < 0) return -1;
+
+    return 0;
+}
+
+static void activate_globus_modules(void)
+{
+    (void) globus_module_activate(GLOBUS_GSI_GSS_ASSIST_MODULE);
+    (void) globus_module_activate(GLOBUS_GSI_GSSAPI_MODULE);
+    (void) globus_module_activate(GLOBUS_OPENSSL_MODULE);
+    (void) globus_module_activate(GLOBUS_GSI_CREDENTIAL_MODULE);
+}
+
+/**
+ * Activate or deactivate required globus modules
+ */
+static void cgsi_plugin_init_globus_modules(void)
+{
+    static pthread_once_t globus_initialized = PTHREAD_ONCE_INIT;
+    pthread_once(&globus_initialized, activate_globus_modules);
+}
+
+static int _get_user_ca (X509 *px509_cred, STACK_OF(X509) *px509_chain, char *user_ca)
+{
+    X509 *cert;
+    globus_gsi_cert_utils_cert_type_t cert_type;
+    int i;
+
+    if (! px509_cred || ! px509_chain)
+        return (-1);
+    cert = px509_cred;
+    if (globus_gsi_cert_utils_get_cert_type(cert, &cert_type) != GLOBUS_SUCCESS)
+        return (-1);
+    if (cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_EEC ||
+            cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_CA)
+        {
+            X509_NAME_oneline(X509_get_issuer_name(cert), user_ca, 255);
+            return (0);
+        }
+    for (i = 0; i < sk_X509_num(px509_chain); i++)
+        {
+            cert = sk_X509_value (px509_chain, i);
+            if (globus_gsi_cert_utils_get_cert_type(cert, &cert_type) != GLOBUS_SUCCESS)
+                return (-1);
+            if (cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_EEC ||
+                    cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_CA)
+                {
+                    X509_NAME_oneline(X509_get_issuer_name(cert), user_ca, 255);
+                    return (0);
+                }
+        }
+    return (-1);
+}
+
+/**
+ * Retrieves the user CA and VOMS attributes on first access, when they
+ * were not retrieved at connect time because of CGSI_OPT_LAZY_VOMS_CHECK
+ */
+static int cgsi_lazy_retrieve_attrs(struct soap *soap, struct cgsi_plugin_data *data)
+{
+    if (!data->lazy_voms_check || data->disable_voms_check || data->attrs_retrieved ||
+            data->context_handle == GSS_C_NO_CONTEXT)
+        {
+            return 0;
+        }
+
+    if (retrieve_userca_and_voms_creds(soap))
+        {
+            /* Keep the VOMS error if there was one */
+            if (soap->error == SOAP_OK)
+                cgsi_err(soap, "Error retrieving the userca/VOMS credentials");
+            return -1;
+        }
+    return 0;
+}
+
+/* Returns the CA */
+char *get_client_ca(struct soap *soap)
+{
+    struct cgsi_plugin_data *data;
+
+    if (soap == NULL) return NULL;
+    data = cgsi_find_plugin(soap, server_plugin_id);
+    if (data == NULL)
+        {
+            cgsi_err(soap, "get_client_ca: could not get data structure");
+            return NULL;
+        }
+
+    if (cgsi_lazy_retrieve_attrs(soap, data) != 0)
+        {
+            return NULL;
+        }
+
+    if (*data->user_ca == '\0')
+        {
+            return NULL;
+        }
+
+    return data->user_ca;
+}
+
+/******************************************************************************/
+/* CREDENTIAL CACHE */
+/******************************************************************************/
+
+/**
+ * Fills in the identity of the files given
+ */
+static void cgsi_cred_files_stat(struct cgsi_cred_file *files, const char **paths, int nfiles)
+{
+    struct stat st;
+    int i;
+
+    for (i = 0; i < nfiles; i++)
+        {
+            memset(&files[i], 0, sizeof(struct cgsi_cred_file));
+            strncpy(files[i].path, paths[i], CGSI_MAXNAMELEN - 1);
+            if (stat(paths[i], &st) == 0)
+                {
+                    files[i].present = 1;
+                    files[i].dev = st.st_dev;
+                    files[i].ino = st.st_ino;
+                    files[i].mtime = st.st_mtime;
+                    files[i].size = st.st_size;
+                }
+        }
+}
+
+/**
+ * Fills in the list of files GSI may load the default credentials from,
+ * in the same places gss_acquire_cred() looks at, and stats them.
+ * Returns the number of entries filled.
+ */
+static int cgsi_cred_files_default(struct cgsi_cred_file *files)
+{
+    const char *paths[CGSI_CRED_MAXFILES];
+    char proxy[CGSI_MAXNAMELEN];
+    char usercert[CGSI_MAXNAMELEN], userkey[CGSI_MAXNAMELEN];
+    const char *env, *home;
+    int n = 0;
+
+    env = getenv("X509_USER_PROXY");
+    if (env == NULL)
+        {
+            snprintf(proxy, sizeof(proxy), "/tmp/x509up_u%d", (int)geteuid());
+            env = proxy;
+        }
+    paths[n++] = env;
+
+    if ((env = getenv("X509_USER_CERT")) != NULL)
+        paths[n++] = env;
+    if ((env = getenv("X509_USER_KEY")) != NULL)
+        paths[n++] = env;
+
+    home = getenv("HOME");
+    if (home != NULL)
+        {
+            snprintf(usercert, sizeof(usercert), "%s/.globus/usercert.pem", home);
+            snprintf(userkey, sizeof(userkey), "%s/.globus/userkey.pem", home);
+            paths[n++] = usercert;
+            paths[n++] = userkey;
+        }
+
+    paths[n++] = "/etc/grid-security/hostcert.pem";
+    paths[n++] = "/etc/grid-security/hostkey.pem";
+
+    cgsi_cred_files_stat(files, paths, n);
+    return n;
+}
+
+/**
+ * Returns 1 if both lists name the same files, whatever their content
+ */
+static int cgsi_cred_files_same_paths(struct cgsi_cred_file *a, int na,
+                                      struct cgsi_cred_file *b, int nb)
+{
+    int i;
+
+    if (na != nb)
+        return 0;
+
+    for (i = 0; i < na; i++)
+        {
+            if (strcmp(a[i].path, b[i].path) != 0)
+                return 0;
+        }
+
+    return 1;
+}
+
+/**
+ * Compares two strings which may be NULL
+ */
+static int cgsi_strings_equal(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Returns 1 if the cached credential has not expired and has been loaded
+ * from exactly the same set of files, 0 otherwise.
+ * Must be called with cred_cache_lock held.
+ */
+static int cgsi_cred_entry_valid(struct cgsi_cred_entry *entry,
+                                 struct cgsi_cred_file *files, int nfiles)
+{
+    int i;
+
+    if (entry->expires && entry->expires <= time(NULL))
+        return 0;
+
+    if (!cgsi_cred_files_same_paths(entry->files, entry->nfiles, files, nfiles))
+        return 0;
+
+    for (i = 0; i < nfiles; i++)
+        {
+            if (entry->files[i].present != files[i].present ||
+                    entry->files[i].dev != files[i].dev ||
+                    entry->files[i].ino != files[i].ino ||
+                    entry->files[i].mtime != files[i].mtime ||
+                    entry->files[i].size != files[i].size)
+                return 0;
+        }
+
+    return 1;
+}
+
+/**
+ * Loads the default credentials and prepares them to be shared.
+ * The entry returned holds one reference.
+ */
+static struct cgsi_cred_entry *cgsi_cred_entry_load(struct soap *soap,
+        struct cgsi_plugin_data *data,
+        gss_cred_usage_t usage,
+        int imported,
+        struct cgsi_cred_file *files,
+        int nfiles)
+{
+    OM_uint32 major_status, minor_status, tmp_status, lifetime;
+    gss_buffer_desc name = GSS_C_EMPTY_BUFFER;
+    struct cgsi_cred_entry *entry;
+    SSL_CTX *ctx = NULL;
+
+    entry = (struct cgsi_cred_entry *)calloc(1, sizeof(struct cgsi_cred_entry));
+    if (entry == NULL)
+        {
+            cgsi_err(soap, "Out of memory allocating credentials");
+            return NULL;
+        }
+    entry->usage = usage;
+    entry->imported = imported;
+    entry->credential_handle = GSS_C_NO_CREDENTIAL;
+    entry->name_handle = GSS_C_NO_NAME;
+    entry->nfiles = nfiles;
+    memcpy(entry->files, files, nfiles * sizeof(struct cgsi_cred_file));
+    entry->refcount = 1;
+
+    if ((data->cipher_list && (entry->cipher_list = strdup(data->cipher_list)) == NULL) ||
+            (data->ciphersuites && (entry->ciphersuites = strdup(data->ciphersuites)) == NULL))
+        {
+            cgsi_err(soap, "Out of memory allocating credentials");
+            goto error;
+        }
+
+    if (imported)
+        {
+            /* cgsi_cred_import() sets the error itself */
+            if (cgsi_cred_import(soap, files[0].path, nfiles > 1 ? files[1].path : NULL,
+                                 &entry->credential_handle) != 0)
+                goto error;
+        }
+    else
+        {
+            major_status = gss_acquire_cred(&minor_status,
+                                            GSS_C_NO_NAME,
+                                            0,
+                                            GSS_C_NULL_OID_SET,
+                                            usage,
+                                            &entry->credential_handle,
+                                            NULL,
+                                            NULL);
+            if (major_status != GSS_S_COMPLETE)
+                {
+                    cgsi_gssapi_err(soap,
+                                    usage == GSS_C_ACCEPT ? "Could NOT load server credentials" :
+                                    "Could NOT load client credentials",
+                                    major_status,
+                                    minor_status);
+                    goto error;
+                }
+        }
+
+    /* Configure the SSL context once for all the connections sharing it:
+       servers remove the LOW cipher suites unless told otherwise */
+    ctx = ((gss_cred_id_desc*)entry->credential_handle)->ssl_context;
+    if (ctx == NULL)
+        {
+            cgsi_err(soap, "Error getting the SSL context of the credentials");
+            goto error;
+        }
+
+    if (entry->cipher_list || usage == GSS_C_ACCEPT)
+        {
+            if (!SSL_CTX_set_cipher_list(ctx, entry->cipher_list ? entry->cipher_list :
+                                         SSL_DEFAULT_CIPHER_LIST ":!LOW" ))
+                {
+                    cgsi_err(soap, "Error setting the SSL context cipher list");
+                    goto error;
+                }
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (entry->ciphersuites && !SSL_CTX_set_ciphersuites(ctx, entry->ciphersuites))
+        {
+            cgsi_err(soap, "Error setting the SSL context TLSv1.3 ciphersuites");
+            goto error;
+        }
+#endif
+
+    /* An explicit policy is an order of preference the server enforces */
+    if (usage == GSS_C_ACCEPT && (entry->cipher_list || entry->ciphersuites))
+        SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    /* Clients resume the TLS session of the previous connection to the endpoint */
+    if (usage == GSS_C_INITIATE && SSL_CTX_get_info_callback(ctx) == NULL)
+        SSL_CTX_set_info_callback(ctx, cgsi_ssl_info_callback);
+
+    /* Now keeping the credentials name in the cache */
+    major_status = gss_inquire_cred(&minor_status,
+                                    entry->credential_handle,
+                                    &entry->name_handle,
+                                    &lifetime,
+                                    NULL,
+                                    NULL);
+    if (major_status != GSS_S_COMPLETE)
+        {
+            cgsi_gssapi_err(soap,  "Error inquiring credentials", major_status, minor_status);
+            goto error;
+        }
+
+    if (lifetime != GSS_C_INDEFINITE)
+        entry->expires = time(NULL) + lifetime;
+
+    major_status = gss_display_name(&minor_status, entry->name_handle, &name, (gss_OID *) NULL);
+    if (major_status != GSS_S_COMPLETE || strlen((const char *)name.value)>CGSI_MAXNAMELEN-1)
+        {
+            if (major_status != GSS_S_COMPLETE)
+                cgsi_gssapi_err(soap,  "Error displaying credentials name", major_status, minor_status);
+            else
+                cgsi_err(soap,"Credentials name too long");
+            (void) gss_release_buffer(&tmp_status, &name);
+            goto error;
+        }
+
+    strncpy(entry->name, (const char*)name.value, CGSI_MAXNAMELEN);
+    entry->name[CGSI_MAXNAMELEN - 1] = '\0';
+    (void) gss_release_buffer(&tmp_status, &name);
+
+    if (usage == GSS_C_ACCEPT)
+        cgsi_server_session_setup(ctx, entry->name);
+
+    return entry;
+
+error:
+    cgsi_cred_entry_release(entry);
+    return NULL;
+}
+
+/**
+ * Looks up a valid credential in the cache and takes a reference on it.
+ * Must be called with cred_cache_lock held.
+ */
+static struct cgsi_cred_entry *cgsi_cred_cache_find(struct cgsi_plugin_data *data,
+        gss_cred_usage_t usage, int imported,
+        struct cgsi_cred_file *files, int nfiles)
+{
+    struct cgsi_cred_entry **pp, *entry;
+
+    for (pp = &cred_cache; (entry = *pp) != NULL; pp = &entry->next)
+        {
+            if (entry->usage == usage && entry->imported == imported &&
+                    cgsi_strings_equal(entry->cipher_list, data->cipher_list) &&
+                    cgsi_strings_equal(entry->ciphersuites, data->ciphersuites) &&
+                    cgsi_cred_entry_valid(entry, files, nfiles))
+                {
+                    /* move it in front of the list */
+                    *pp = entry->next;
+                    entry->next = cred_cache;
+                    cred_cache = entry;
+                    entry->refcount++;
+                    return entry;
+                }
+        }
+
+    return NULL;
+}
+
+/**
+ * Returns a reference on the cached credential loaded from the files given,
+ * loading it if there is none or if the files have changed. The credential
+ * is loaded without holding the lock, and then replaces the ones loaded from
+ * the same files, which stay alive until their last user releases them.
+ * The least recently used credentials are dropped from the cache once it
+ * holds more than CGSI_CRED_CACHE_SIZE entries.
+ */
+static struct cgsi_cred_entry *cgsi_cred_cache_get(struct soap *soap,
+        struct cgsi_plugin_data *data,
+        gss_cred_usage_t usage,
+        int imported,
+        struct cgsi_cred_file *files,
+        int nfiles)
+{
+    struct cgsi_cred_entry *entry, *loaded, **pp, *dropped = NULL;
+    int n;
+
+    pthread_mutex_lock(&cred_cache_lock);
+    entry = cgsi_cred_cache_find(data, usage, imported, files, nfiles);
+    pthread_mutex_unlock(&cred_cache_lock);
+
+    if (entry != NULL)
+        {
+            char buf[TBUFSIZE];
+            snprintf(buf, TBUFSIZE, "Using cached credentials for:<%s>\n", entry->name);
+            trace(data, buf);
+            return entry;
+        }
+
+    trace(data, imported ? "Using gss_import_cred to load credentials\n" :
+          "Using gss_acquire_cred to load credentials\n");
+    loaded = cgsi_cred_entry_load(soap, data, usage, imported, files, nfiles);
+    if (loaded == NULL)
+        {
+            /* Soap fault already reported */
+            return NULL;
+        }
+
+    pthread_mutex_lock(&cred_cache_lock);
+
+    /* another thread may have loaded the same credentials meanwhile */
+    entry = cgsi_cred_cache_find(data, usage, imported, files, nfiles);
+    if (entry == NULL)
+        {
+            /* drop the superseded and the least recently used entries */
+            n = 0;
+            pp = &cred_cache;
+            while ((entry = *pp) != NULL)
+                {
+                    if ((entry->usage == usage && entry->imported == imported &&
+                            cgsi_strings_equal(entry->cipher_list, data->cipher_list) &&
+                            cgsi_strings_equal(entry->ciphersuites, data->ciphersuites) &&
+                            cgsi_cred_files_same_paths(entry->files, entry->nfiles, files, nfiles)) ||
+                            ++n >= CGSI_CRED_CACHE_SIZE)
+                        {
+                            *pp = entry->next;
+                            entry->next = dropped;
+                            dropped = entry;
+                        }
+                    else
+                        {
+                            pp = &entry->next;
+                        }
+                }
+
+            /* one reference for the cache, one for the caller */
+            entry = loaded;
+            loaded = NULL;
+            entry->refcount++;
+            entry->next = cred_cache;
+            cred_cache = entry;
+        }
+
+    pthread_mutex_unlock(&cred_cache_lock);
+
+    cgsi_cred_entry_release(loaded);
+    while (dropped != NULL)
+        {
+            loaded = dropped;
+            dropped = dropped->next;
+            cgsi_cred_entry_release(loaded);
+        }
+
+    return entry;
+}
+
+/**
+ * Drops a reference on a cached credential, freeing it with the last one.
+ */
+static void cgsi_cred_entry_release(struct cgsi_cred_entry *entry)
+{
+    OM_uint32 tmp_status;
+    int refcount;
+
+    if (entry == NULL)
+        return;
+
+    pthread_mutex_lock(&cred_cache_lock);
+    refcount = --entry->refcount;
+    pthread_mutex_unlock(&cred_cache_lock);
+
+    if (refcount > 0)
+        return;
+
+    (void) gss_release_name(&tmp_status, &entry->name_handle);
+    (void) gss_release_cred(&tmp_status, &entry->credential_handle);
+    free(entry->cipher_list);
+    free(entry->ciphersuites);
+    free(entry);
+}
+
+/**
+ * Releases the credentials of the connection, be they shared or not
+ */
+static void cgsi_release_cred(struct cgsi_plugin_data *data)
+{
+    OM_uint32 tmp_status;
+
+    if (data->cred_entry != NULL)
+        {
+            cgsi_cred_entry_release(data->cred_entry);
+            data->cred_entry = NULL;
+            data->credential_handle = GSS_C_NO_CREDENTIAL;
+        }
+    else
+        {
+            (void) gss_release_cred(&tmp_status, &data->credential_handle);
+        }
+}
+
+/******************************************************************************/
+/* NAME RESOLUTION */
+/******************************************************************************/
+
+/**
+ * Finds the name the host at the given address is known by, the local host
+ * name for loopback addresses. Puts "host@name" in host.
+ * Returns 0 if successful, else -1 with error describing the failure.
+ */
+static int cgsi_reverse_lookup(const struct sockaddr *peer, socklen_t peer_length,
+                               char *host, size_t size, const char **error)
+{
+    struct addrinfo *res = NULL, *resp;
+    const struct sockaddr *sa = peer;
+    socklen_t sa_length = peer_length;
+    size_t i;
+    int rc;
+
+    snprintf(host, size, "host@");
+
+    if (is_loopback((struct sockaddr *) peer))
+        {
+            sa = NULL;
+            if (gethostname(&host[5], size - 5))
+                {
+                    *error = "Could not get the local host name";
+                    return -1;
+                }
+            host[size - 1] = '\0';
+            rc = getaddrinfo(&host[5], NULL, NULL, &res);
+            if (rc)
+                {
+                    *error = "Could not lookup the local host name";
+                    return -1;
+                }
+            for (resp = res; resp; resp = resp->ai_next)
+                {
+                    if (resp->ai_family == AF_INET6 && !is_loopback(resp->ai_addr))
+                        {
+                            sa = resp->ai_addr;
+                            sa_length = resp->ai_addrlen;
+                        }
+                    else if (resp->ai_family == AF_INET && !is_loopback(resp->ai_addr))
+                        {
+                            sa = resp->ai_addr;
+                            sa_length = resp->ai_addrlen;
+                            break;
+                        }
+                }
+        }
+
+    if (sa)
+        {
+            rc = getnameinfo(sa, sa_length, &host[5], size - 5, NULL, 0, 0);
+            if (rc)
+                {
+                    if (res != NULL)
+                        freeaddrinfo(res);
+                    *error = "Could not convert the address information to a name or address";
+                    return -1;
+                }
+        }
+    if (res != NULL)
+        freeaddrinfo(res);
+
+    for (i = 5; i < size && host[i]; i++)
+        host[i] = tolower(host[i]);
+    return 0;
+}
+
+/**
+ * Extracts the cache key of an address: its family and address bytes
+ */
+static void cgsi_resolve_key(const struct sockaddr *sa, int *family, unsigned char *addr)
+{
+    memset(addr, 0, 16);
+    *family = sa->sa_family;
+    if (sa->sa_family == AF_INET)
+        memcpy(addr, &((const struct sockaddr_in *) sa)->sin_addr, 4);
+    else
+        memcpy(addr, &((const struct sockaddr_in6 *) sa)->sin6_addr, 16);
+}
+
+/**
+ * Remembers the name of the host at the given address
+ */
+static void cgsi_resolve_cache_put(const struct sockaddr *sa, const char *host)
+{
+    struct cgsi_resolve_entry *entry, *prev = NULL, *found = NULL, *evicted = NULL;
+    unsigned char addr[16];
+    int family, n = 0;
+
+    cgsi_resolve_key(sa, &family, addr);
+
+    /* Most recently resolved first */
+    pthread_mutex_lock(&resolve_cache_lock);
+    for (entry = resolve_cache; entry != NULL; prev = entry, entry = entry->next)
+        {
+            if (entry->family == family && memcmp(entry->addr, addr, 16) == 0)
+                {
+                    if (prev != NULL)
+                        prev->next = entry->next;
+                    else
+                        resolve_cache = entry->next;
+                    found = entry;
+                    break;
+                }
+            if (++n == CGSI_RESOLVE_CACHE_SIZE - 1 && entry->next != NULL)
+                {
+                    evicted = entry->next;
+                    entry->next = NULL;
+                    break;
+                }
+        }
+    entry = found;
+    if (entry == NULL)
+        entry = (struct cgsi_resolve_entry *) calloc(1, sizeof(struct cgsi_resolve_entry));
+    if (entry != NULL)
+        {
+            entry->family = family;
+            memcpy(entry->addr, addr, 16);
+            strncpy(entry->host, host, CGSI_MAXHOSTLEN);
+            entry->host[CGSI_MAXHOSTLEN - 1] = '\0';
+            entry->expires = time(NULL) + CGSI_RESOLVE_TTL;
+            entry->refreshing = 0;
+            entry->next = resolve_cache;
+            resolve_cache = entry;
+        }
+    pthread_mutex_unlock(&resolve_cache_lock);
+
+    while (evicted != NULL)
+        {
+            entry = evicted->next;
+            free(evicted);
+            evicted = entry;
+        }
+}
+
+/**
+ * Lets the expired name of the host at the given address be looked up
+ * again, after a lookup failed
+ */
+static void cgsi_resolve_cache_retry(const struct sockaddr *sa)
+{
+    struct cgsi_resolve_entry *entry;
+    unsigned char addr[16];
+    int family;
+
+    cgsi_resolve_key(sa, &family, addr);
+
+    pthread_mutex_lock(&resolve_cache_lock);
+    for (entry = resolve_cache; entry != NULL; entry = entry->next)
+        {
+            if (entry->family == family && memcmp(entry->addr, addr, 16) == 0)
+                {
+                    entry->refreshing = 0;
+                    break;
+                }
+        }
+    pthread_mutex_unlock(&resolve_cache_lock);
+}
+
+static void *cgsi_resolve_thread(void *arg)
+{
+    struct cgsi_resolve_job *job = (struct cgsi_resolve_job *) arg;
+    int abandoned;
+
+    if (cgsi_reverse_lookup((struct sockaddr *) &job->sa, job->sa_length,
+                            job->host, sizeof(job->host), &job->error) == 0)
+        cgsi_resolve_cache_put((struct sockaddr *) &job->sa, job->host);
+    else
+        cgsi_resolve_cache_retry((struct sockaddr *) &job->sa);
+
+    pthread_mutex_lock(&resolve_cache_lock);
+    resolve_threads--;
+    pthread_mutex_unlock(&resolve_cache_lock);
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    abandoned = job->abandoned;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    if (abandoned)
+        {
+            pthread_mutex_destroy(&job->lock);
+            pthread_cond_destroy(&job->cond);
+            free(job);
+        }
+    return NULL;
+}
+
+/**
+ * Starts looking up the name of the host at the given address in a thread
+ * of its own, which stores it in the cache. The job is returned in wait,
+ * to wait for, unless wait is NULL. At most CGSI_RESOLVE_MAX_THREADS
+ * lookups run at a time.
+ * Returns 0 if the thread was started, -1 otherwise.
+ */
+static int cgsi_resolve_start(const struct sockaddr *sa, socklen_t sa_length, struct cgsi_resolve_job **wait)
+{
+    struct cgsi_resolve_job *job;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int rc;
+
+    if (sa_length > sizeof(job->sa))
+        return -1;
+
+    pthread_mutex_lock(&resolve_cache_lock);
+    rc = (resolve_threads < CGSI_RESOLVE_MAX_THREADS);
+    if (rc)
+        resolve_threads++;
+    pthread_mutex_unlock(&resolve_cache_lock);
+    if (!rc)
+        return -1;
+
+    job = (struct cgsi_resolve_job *) calloc(1, sizeof(struct cgsi_resolve_job));
+    if (job == NULL)
+        goto error;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    memcpy(&job->sa, sa, sa_length);
+    job->sa_length = sa_length;
+    job->abandoned = (wait == NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, cgsi_resolve_thread, job);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+        {
+            pthread_mutex_destroy(&job->lock);
+            pthread_cond_destroy(&job->cond);
+            free(job);
+            goto error;
+        }
+    if (wait != NULL)
+        *wait = job;
+    return 0;
+
+error:
+    pthread_mutex_lock(&resolve_cache_lock);
+    resolve_threads--;
+    pthread_mutex_unlock(&resolve_cache_lock);
+    return -1;
+}
+
+/**
+ * Waits for the lookup to complete, or gives up on it if host is NULL.
+ * The job is freed in both cases.
+ * Returns 0 if the name was found, -1 otherwise with error set.
+ */
+static int cgsi_resolve_finish(struct cgsi_resolve_job *job, char *host, size_t size, const char **error)
+{
+    int ret = -1, done;
+
+    pthread_mutex_lock(&job->lock);
+    if (host == NULL)
+        job->abandoned = 1;
+    else
+        while (!job->done)
+            pthread_cond_wait(&job->cond, &job->lock);
+    done = job->done;
+    pthread_mutex_unlock(&job->lock);
+
+    /* An abandoned job still running is freed by its thread */
+    if (!done)
+        return -1;
+
+    if (host != NULL)
+        {
+            if (job->error == NULL)
+                {
+                    strncpy(host, job->host, size);
+                    host[size - 1] = '\0';
+                    ret = 0;
+                }
+            else
+                *error = job->error;
+        }
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    free(job);
+    return ret;
+}
+
+/**
+ * Looks up the name of the host at the given address in the cache.
+ * An expired name is still returned while it is looked up again in the
+ * background. Returns 0 if found, -1 otherwise.
+ */
+static int cgsi_resolve_cache_get(const struct sockaddr *sa, socklen_t sa_length, char *host, size_t size)
+{
+    struct cgsi_resolve_entry *entry;
+    unsigned char addr[16];
+    int family, refresh = 0, ret = -1;
+
+    cgsi_resolve_key(sa, &family, addr);
+
+    pthread_mutex_lock(&resolve_cache_lock);
+    for (entry = resolve_cache; entry != NULL; entry = entry->next)
+        {
+            if (entry->family == family && memcmp(entry->addr, addr, 16) == 0)
+                {
+                    strncpy(host, entry->host, size);
+                    host[size - 1] = '\0';
+                    if (entry->expires <= time(NULL) && !entry->refreshing)
+                        {
+                            entry->refreshing = 1;
+                            refresh = 1;
+                        }
+                    ret = 0;
+                    break;
+                }
+        }
+    pthread_mutex_unlock(&resolve_cache_lock);
+
+    pthread_mutex_lock(&stats_lock);
+    if (ret == 0)
+        plugin_stats.resolve_cache_hits++;
+    else
+        plugin_stats.resolve_cache_misses++;
+    pthread_mutex_unlock(&stats_lock);
+
+    /* A failed refresh is tried again on the next connection */
+    if (refresh && cgsi_resolve_start(sa, sa_length, NULL) != 0)
+        cgsi_resolve_cache_retry(sa);
+    return ret;
 }
 
-void cgsi_plugin_print_token(struct cgsi_plugin_data *data, char *token, int length)
+/**
+ * Imports the target name of the given "host@name" service, reusing the
+ * name imported by a previous connection until it expires.
+ */
+static OM_uint32 cgsi_import_target_name(OM_uint32 *minor_status, const char *service, gss_name_t *name)
 {
-    int i;
-    unsigned char *p;
-    char buf[TBUFSIZE];
+    struct cgsi_name_entry *entry, *prev = NULL, *evicted = NULL;
+    gss_buffer_desc namebuf;
+    OM_uint32 major_status, tmp_status;
+    time_t now = time(NULL);
+    int n;
 
-    /* can avoid printing all the token if the trace routine
-     * is disabled */
-    if (data->trace_mode < 2)
+    /* Most recently used first */
+    pthread_mutex_lock(&name_cache_lock);
+    for (entry = name_cache; entry != NULL; prev = entry, entry = entry->next)
         {
-            return;
+            if (strcmp(entry->service, service) == 0)
+                break;
+        }
+    if (entry != NULL)
+        {
+            if (prev != NULL)
+                prev->next = entry->next;
+            else
+                name_cache = entry->next;
+            entry->next = NULL;
+            if (entry->expires > now)
+                {
+                    major_status = gss_duplicate_name(minor_status, entry->name, name);
+                    entry->next = name_cache;
+                    name_cache = entry;
+                    pthread_mutex_unlock(&name_cache_lock);
+                    return major_status;
+                }
+            evicted = entry;
         }
+    pthread_mutex_unlock(&name_cache_lock);
 
-    /* printing the characters as unsigned hex digits */
-    p = (unsigned char *)token;
+    namebuf.value = (void *) service;
+    namebuf.length = strlen(service) + 1;
+    major_status = gss_import_name(minor_status, &namebuf, GSS_C_NT_HOSTBASED_SERVICE, name);
 
-    for (i=0; i < length; i++, p++)
+    if (major_status == GSS_S_COMPLETE && strlen(service) < CGSI_MAXHOSTLEN)
         {
-            snprintf(buf, TBUFSIZE,"%02x ", *p);
-            trace(data, buf);
-            if ((i % 16) == 15)
+            entry = (struct cgsi_name_entry *) calloc(1, sizeof(struct cgsi_name_entry));
+            if (entry != NULL && gss_duplicate_name(&tmp_status, *name, &entry->name) == GSS_S_COMPLETE)
                 {
-                    trace(data, "\n");
+                    strcpy(entry->service, service);
+                    entry->expires = now + CGSI_RESOLVE_TTL;
+
+                    pthread_mutex_lock(&name_cache_lock);
+                    entry->next = name_cache;
+                    name_cache = entry;
+                    for (n = 1; entry->next != NULL; n++, entry = entry->next)
+                        {
+                            if (n == CGSI_RESOLVE_CACHE_SIZE)
+                                {
+                                    if (evicted != NULL)
+                                        evicted->next = entry->next;
+                                    else
+                                        evicted = entry->next;
+                                    entry->next = NULL;
+                                    break;
+                                }
+                        }
+                    pthread_mutex_unlock(&name_cache_lock);
                 }
+            else
+                free(entry);
         }
-    trace(data, "\n");
+
+    while (evicted != NULL)
+        {
+            entry = evicted->next;
+            (void) gss_release_name(&tmp_status, &evicted->name);
+            free(evicted);
+            evicted = entry;
+        }
+    return major_status;
+}
+
+/******************************************************************************/
+/* SESSION CACHE */
+/******************************************************************************/
+
+static void cgsi_session_pending_free(void *arg)
+{
+    SSL_SESSION_free((SSL_SESSION *) arg);
 }
 
+static void cgsi_session_pending_key_create(void)
+{
+    (void) pthread_key_create(&session_pending_key, cgsi_session_pending_free);
+}
 
 /**
- * Function to display the GSS-API errors
+ * Sets the session offered by the thread on the SSL object GSI has just
+ * created, before the ClientHello is written
  */
-static void cgsi_gssapi_err(struct soap *soap, const char *msg, OM_uint32 maj_stat, OM_uint32 min_stat)
+static void cgsi_ssl_info_callback(const SSL *ssl, int where, int ret)
 {
+    SSL_SESSION *session;
 
-    int ret;
-    char buffer[BUFSIZE],hostname[NI_MAXHOST];
-    int bufsize;
-    char *buf;
-    struct cgsi_plugin_data *data;
-    int isclient = 1;
+    if (!(where & SSL_CB_HANDSHAKE_START) || SSL_is_server((SSL *) ssl))
+        return;
 
-    /* Check if we are a client */
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, client_plugin_id);
-    if (data == NULL)
+    pthread_once(&session_pending_once, cgsi_session_pending_key_create);
+    session = (SSL_SESSION *) pthread_getspecific(session_pending_key);
+    if (session == NULL)
+        return;
+
+    (void) pthread_setspecific(session_pending_key, NULL);
+    (void) SSL_set_session((SSL *) ssl, session);
+    SSL_SESSION_free(session);
+}
+
+/**
+ * Finds the cache entry of the endpoint of the connection.
+ * Must be called with session_cache_lock held.
+ */
+static struct cgsi_session_entry **cgsi_session_find(struct cgsi_plugin_data *data)
+{
+    struct cgsi_session_entry **prev;
+
+    for (prev = &session_cache; *prev != NULL; prev = &(*prev)->next)
         {
-            isclient = 0;
+            if ((*prev)->port == data->endpoint_port &&
+                    strcmp((*prev)->host, data->endpoint_host) == 0 &&
+                    strcmp((*prev)->identity, data->client_name) == 0)
+                return prev;
         }
+    return NULL;
+}
 
-    if (gethostname(hostname, sizeof(hostname))<0)
+/**
+ * Hands the cached session of the endpoint, if any, to the SSL info
+ * callback of the calling thread
+ */
+static void cgsi_session_offer(struct cgsi_plugin_data *data)
+{
+    struct cgsi_session_entry **prev, *entry;
+    SSL_SESSION *session = NULL;
+
+    pthread_once(&session_pending_once, cgsi_session_pending_key_create);
+
+    pthread_mutex_lock(&session_cache_lock);
+    prev = cgsi_session_find(data);
+    if (prev != NULL)
         {
-            strncpy(hostname, "unknown", sizeof(hostname));
+            /* Moving it to the front of the list */
+            entry = *prev;
+            *prev = entry->next;
+            entry->next = session_cache;
+            session_cache = entry;
+
+            if (entry->session != NULL && !entry->disabled)
+                {
+                    session = entry->session;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                    SSL_SESSION_up_ref(session);
+#else
+                    CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+                }
         }
-    hostname[sizeof(hostname)-1] = '\0';
+    pthread_mutex_unlock(&session_cache_lock);
 
-    bufsize = BUFSIZE;
-    snprintf(buffer, bufsize, CGSI_PLUGIN " running on %s reports %s\n", hostname, msg);
-    buf = buffer +strlen(buffer);
-    bufsize -= strlen(buffer);
+    pthread_mutex_lock(&stats_lock);
+    if (session != NULL)
+        plugin_stats.client_session_hits++;
+    else
+        plugin_stats.client_session_misses++;
+    pthread_mutex_unlock(&stats_lock);
 
-    ret =  cgsi_display_status_1(msg, maj_stat, GSS_C_GSS_CODE, buf, bufsize);
-    if (bufsize-ret > 1)
+    data->session_offered = 0;
+    if (session != NULL)
         {
-            strcat(buf, "\n");
-            ret++;
+            trace(data, "Offering the TLS session of the previous connection\n");
+            if (pthread_setspecific(session_pending_key, session) != 0)
+                SSL_SESSION_free(session);
+            else
+                data->session_offered = 1;
         }
-    buf += ret;
-    bufsize -= ret;
-    cgsi_display_status_1(msg, min_stat, GSS_C_MECH_CODE, buf, bufsize);
+}
 
-    if (isclient)
+/**
+ * Takes back the session offered if the handshake did not use it.
+ * If the handshake failed after using it, the endpoint no longer gets
+ * sessions offered.
+ */
+static void cgsi_session_withdraw(struct cgsi_plugin_data *data, int failed)
+{
+    struct cgsi_session_entry **prev;
+    SSL_SESSION *session;
+
+    pthread_once(&session_pending_once, cgsi_session_pending_key_create);
+    session = (SSL_SESSION *) pthread_getspecific(session_pending_key);
+    if (session != NULL)
         {
-            soap_sender_fault(soap, buffer, NULL);
+            (void) pthread_setspecific(session_pending_key, NULL);
+            SSL_SESSION_free(session);
+            return;
         }
-    else
+
+    if (!failed || !data->session_offered)
+        return;
+
+    pthread_mutex_lock(&session_cache_lock);
+    prev = cgsi_session_find(data);
+    if (prev != NULL && (*prev)->session != NULL)
         {
-            soap_receiver_fault(soap, buffer, NULL);
+            trace(data, "Handshake failed resuming the TLS session, no longer resuming\n");
+            (*prev)->disabled = 1;
         }
+    pthread_mutex_unlock(&session_cache_lock);
 }
 
 /**
-  * Displays the GSS-API error messages in the error buffer
+ * Keeps the TLS session of the established connection for the next
+ * connection to the same endpoint. handshake is set right after the
+ * handshake, and unset when the connection is closed.
  */
-static int cgsi_display_status_1(const char *m, OM_uint32 code, int type, char *buf, int buflen)
+static void cgsi_session_store(struct cgsi_plugin_data *data, int handshake)
 {
-    OM_uint32 maj_stat, min_stat;
-    gss_buffer_desc msg;
-    OM_uint32 msg_ctx;
-    int count,ret;
-    char *buf0 = buf;
+    struct cgsi_session_entry **prev, *entry, *evicted = NULL;
+    gss_ctx_id_desc *context;
+    SSL_SESSION *session, *old = NULL;
+    int count;
 
-    if (buflen<=1)
-        return(0);
+    context = (gss_ctx_id_desc *) data->context_handle;
+    if (context == NULL || context->gss_ssl == NULL)
+        return;
 
-    msg_ctx = 0;
-    count = 0;
-    while (1)
+    if (handshake && SSL_session_reused(context->gss_ssl))
         {
-            maj_stat = gss_display_status(&min_stat, code,
-                                          type, GSS_C_NULL_OID,
-                                          &msg_ctx, &msg);
+            trace(data, "TLS session resumed\n");
+            pthread_mutex_lock(&stats_lock);
+            plugin_stats.client_session_resumed++;
+            pthread_mutex_unlock(&stats_lock);
+        }
 
-            ret = snprintf(buf, buflen, "%s\n", (char *)msg.value);
-            (void) gss_release_buffer(&min_stat, &msg);
+    session = SSL_get1_session(context->gss_ssl);
+    if (session == NULL)
+        return;
 
-            if (ret < 0)
+    pthread_mutex_lock(&session_cache_lock);
+    prev = cgsi_session_find(data);
+    if (prev != NULL)
+        {
+            entry = *prev;
+            if (entry->session == session)
                 {
-                    *buf = '\0';
-                    break;
+                    pthread_mutex_unlock(&session_cache_lock);
+                    SSL_SESSION_free(session);
+                    return;
+                }
+            old = entry->session;
+            entry->session = session;
+        }
+    else
+        {
+            entry = (struct cgsi_session_entry *) calloc(1, sizeof(struct cgsi_session_entry));
+            if (entry == NULL)
+                {
+                    pthread_mutex_unlock(&session_cache_lock);
+                    SSL_SESSION_free(session);
+                    return;
+                }
+            strncpy(entry->host, data->endpoint_host, CGSI_MAXNAMELEN - 1);
+            entry->port = data->endpoint_port;
+            strncpy(entry->identity, data->client_name, CGSI_MAXNAMELEN - 1);
+            entry->session = session;
+            entry->next = session_cache;
+            session_cache = entry;
+
+            /* Dropping the least recently used endpoint */
+            count = 0;
+            for (prev = &session_cache; *prev != NULL; prev = &(*prev)->next)
+                {
+                    if (++count > CGSI_SESSION_CACHE_SIZE)
+                        {
+                            evicted = *prev;
+                            *prev = NULL;
+                            break;
+                        }
                 }
-
-            if (ret >= buflen)
-                ret = buflen - 1;
-
-            count += ret;
-            buf += ret;
-            buflen -= ret;
-
-            if (!msg_ctx || buflen<=1)
-                break;
         }
+    pthread_mutex_unlock(&session_cache_lock);
 
-    if (count>0 && buf0[count-1] == '\n')
+    if (old != NULL)
+        SSL_SESSION_free(old);
+    while (evicted != NULL)
         {
-            buf0[count-1] = '\0';
-            count--;
+            entry = evicted->next;
+            if (evicted->session != NULL)
+                SSL_SESSION_free(evicted->session);
+            free(evicted);
+            evicted = entry;
         }
+}
 
-    return count;
+int cgsi_plugin_set_gss_lock(int mode)
+{
+    if (mode != CGSI_GSS_LOCK_ALL && mode != CGSI_GSS_LOCK_FIRST && mode != CGSI_GSS_LOCK_NONE)
+        return -1;
+
+    pthread_mutex_lock(&gss_lock_mode_lock);
+    gss_lock_mode = mode;
+    pthread_mutex_unlock(&gss_lock_mode_lock);
+    return 0;
 }
 
-static void cgsi_err(struct soap *soap, const char *msg)
+int cgsi_plugin_get_stats(struct cgsi_plugin_stats *stats)
 {
+    if (stats == NULL)
+        return -1;
 
-    struct cgsi_plugin_data *data;
-    int isclient = 1;
-    char buffer[BUFSIZE],hostname[NI_MAXHOST];
+    pthread_mutex_lock(&stats_lock);
+    *stats = plugin_stats;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
 
-    /* Check if we are a client */
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, client_plugin_id);
-    if (data == NULL)
+/******************************************************************************/
+/* SERVER SESSION CACHE */
+/******************************************************************************/
+
+int cgsi_plugin_enable_session_cache(size_t nslots, int shared)
+{
+    struct cgsi_server_session_cache *cache;
+    pthread_mutexattr_t attr;
+    size_t size;
+
+    if (nslots == 0 || server_sessions != NULL)
+        return -1;
+
+    size = sizeof(struct cgsi_server_session_cache) +
+           (nslots - 1) * sizeof(struct cgsi_server_session);
+    if (shared)
         {
-            isclient = 0;
+            cache = (struct cgsi_server_session_cache *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (cache == (struct cgsi_server_session_cache *) MAP_FAILED)
+                return -1;
+            memset(cache, 0, size);
         }
-
-    if (gethostname(hostname, sizeof(hostname))<0)
+    else
         {
-            strncpy(hostname, "unknown", sizeof(hostname));
+            cache = (struct cgsi_server_session_cache *) calloc(1, size);
+            if (cache == NULL)
+                return -1;
         }
-    hostname[sizeof(hostname)-1] = '\0';
+    cache->shared = shared;
+    cache->nslots = nslots;
 
-    snprintf(buffer, sizeof(buffer), CGSI_PLUGIN " running on %s reports %s", hostname, msg);
-
-    if (isclient)
+    pthread_mutexattr_init(&attr);
+    if (shared)
         {
-            soap_sender_fault(soap, buffer, NULL);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            /* A process dying with the lock held does not block the others */
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
         }
-    else
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    server_sessions = cache;
+    return 0;
+}
+
+/**
+ * Takes the lock of the server session cache. The cache is emptied when
+ * a process died holding it, as it may have been left half updated.
+ */
+static void cgsi_server_sessions_lock(void)
+{
+    if (pthread_mutex_lock(&server_sessions->lock) == EOWNERDEAD)
         {
-            soap_receiver_fault(soap, buffer, NULL);
+            memset(server_sessions->slots, 0,
+                   server_sessions->nslots * sizeof(struct cgsi_server_session));
+            (void) pthread_mutex_consistent(&server_sessions->lock);
         }
 }
 
 /**
- * Parses the argument passed to the plugin constructor
- * and initializes the plugin_data object accordingly
+ * Returns the slot of the session ID.
+ * Must be called with the cache lock held.
  */
-static int cgsi_parse_opts(struct cgsi_plugin_data *p, void *arg, int isclient)
+static struct cgsi_server_session *cgsi_server_session_slot(const unsigned char *id, unsigned int len)
 {
-    int opts;
+    unsigned int h = 5381, i;
 
-    /* Default values */
-    p->disable_hostname_check = 0;
-    p->allow_only_self = 0;
-    p->disable_mapping = 0;
-    p->disable_voms_check = 0;
-    p->context_flags = GSS_C_CONF_FLAG | GSS_C_MUTUAL_FLAG | GSS_C_INTEG_FLAG;
+    for (i = 0; i < len; i++)
+        h = h * 33 + id[i];
+    return &server_sessions->slots[h % server_sessions->nslots];
+}
 
-    if (arg == NULL)
-        {
-            /* Default is just confidentiality and mutual authentication */
-            return 0;
-        }
+static int cgsi_session_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+    struct cgsi_server_session *slot;
+    const unsigned char *id;
+    unsigned int id_len;
+    unsigned char *p;
+    int der_len;
+
+    id = SSL_SESSION_get_id(session, &id_len);
+    der_len = i2d_SSL_SESSION(session, NULL);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+            der_len <= 0 || der_len > CGSI_SESSION_DER_LEN)
+        return 0;
+
+    cgsi_server_sessions_lock();
+    slot = cgsi_server_session_slot(id, id_len);
+    memset(slot, 0, offsetof(struct cgsi_server_session, der));
+    memcpy(slot->id, id, id_len);
+    slot->id_len = id_len;
+    slot->expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+    p = slot->der;
+    slot->der_len = i2d_SSL_SESSION(session, &p);
+    pthread_mutex_unlock(&server_sessions->lock);
+
+    /* No reference kept on the session */
+    return 0;
+}
 
-    opts = (*((int *)arg));
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *cgsi_session_get_cb(SSL *ssl, const unsigned char *id, int len, int *copy)
+#else
+static SSL_SESSION *cgsi_session_get_cb(SSL *ssl, unsigned char *id, int len, int *copy)
+#endif
+{
+    struct cgsi_server_session *slot;
+    SSL_SESSION *session = NULL;
+    const unsigned char *p;
 
-    if (opts & CGSI_OPT_DELEG_FLAG)
+    *copy = 0;
+    if (len <= 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    cgsi_server_sessions_lock();
+    slot = cgsi_server_session_slot(id, len);
+    /* Only sessions the peer attributes were recorded for can be resumed */
+    if (slot->id_len == (unsigned int) len && memcmp(slot->id, id, len) == 0 &&
+            slot->attrs && slot->expires > time(NULL))
         {
-            p->context_flags |= GSS_C_DELEG_FLAG;
+            p = slot->der;
+            session = d2i_SSL_SESSION(NULL, &p, slot->der_len);
         }
+    pthread_mutex_unlock(&server_sessions->lock);
 
-    if (opts & CGSI_OPT_SSL_COMPATIBLE)
+    if (session == NULL)
         {
-            p->context_flags |= GSS_C_GLOBUS_SSL_COMPATIBLE;
+            pthread_mutex_lock(&stats_lock);
+            plugin_stats.server_session_misses++;
+            pthread_mutex_unlock(&stats_lock);
         }
+    return session;
+}
 
-    if (opts & CGSI_OPT_DISABLE_NAME_CHECK)
+static void cgsi_session_remove_cb(SSL_CTX *ctx, SSL_SESSION *session)
+{
+    struct cgsi_server_session *slot;
+    const unsigned char *id;
+    unsigned int id_len;
+
+    id = SSL_SESSION_get_id(session, &id_len);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return;
+
+    cgsi_server_sessions_lock();
+    slot = cgsi_server_session_slot(id, id_len);
+    if (slot->id_len == id_len && memcmp(slot->id, id, id_len) == 0)
+        slot->id_len = 0;
+    pthread_mutex_unlock(&server_sessions->lock);
+}
+
+/**
+ * Makes the SSL context of the server credentials keep its sessions in
+ * the session cache, if it is enabled. The session ID context is the
+ * digest of the name of the credentials, so that a session is only
+ * resumed with the credentials it was established with, the cache
+ * being shared by all of them.
+ */
+static void cgsi_server_session_setup(SSL_CTX *ctx, const char *name)
+{
+    unsigned char sid_ctx[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+
+    if (server_sessions == NULL)
+        return;
+
+    /* Not caching the sessions rather than sharing them between credentials */
+    if (!EVP_Digest(name, strlen(name), sid_ctx, &len, EVP_sha256(), NULL) ||
+            len > SSL_MAX_SID_CTX_LENGTH ||
+            !SSL_CTX_set_session_id_context(ctx, sid_ctx, len))
+        return;
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    /* Stateful resumption only, the cache being where the peer attributes are */
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_timeout(ctx, CGSI_SESSION_TIMEOUT);
+    SSL_CTX_sess_set_new_cb(ctx, cgsi_session_new_cb);
+    SSL_CTX_sess_set_get_cb(ctx, cgsi_session_get_cb);
+    SSL_CTX_sess_set_remove_cb(ctx, cgsi_session_remove_cb);
+}
+
+/**
+ * Returns the slot of the session of the connection if it is in the cache.
+ * Must be called with the cache lock held.
+ */
+static struct cgsi_server_session *cgsi_server_session_find(struct cgsi_plugin_data *data)
+{
+    struct cgsi_server_session *slot;
+    gss_ctx_id_desc *context;
+    SSL_SESSION *session;
+    const unsigned char *id;
+    unsigned int id_len;
+
+    context = (gss_ctx_id_desc *) data->context_handle;
+    if (context == NULL || context->gss_ssl == NULL)
+        return NULL;
+    session = SSL_get_session(context->gss_ssl);
+    if (session == NULL)
+        return NULL;
+
+    id = SSL_SESSION_get_id(session, &id_len);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+    slot = cgsi_server_session_slot(id, id_len);
+    if (slot->id_len != id_len || memcmp(slot->id, id, id_len) != 0)
+        return NULL;
+    return slot;
+}
+
+/**
+ * Records the client name, user CA and VOMS attributes of the connection
+ * with its session, which can then be resumed until expires
+ */
+static void cgsi_server_session_record(struct cgsi_plugin_data *data, time_t expires)
+{
+    struct cgsi_server_session *slot;
+    size_t len, n = 0;
+    int i;
+
+    if (server_sessions == NULL || data->client_name[0] == '\0')
+        return;
+
+    cgsi_server_sessions_lock();
+    slot = cgsi_server_session_find(data);
+    if (slot != NULL && !slot->attrs)
         {
-            p->disable_hostname_check = 1;
+            for (i = 0; i < data->nbfqan; i++)
+                {
+                    len = strlen(data->fqan[i]) + 1;
+                    if (n + len > CGSI_SESSION_FQANS_LEN)
+                        break;
+                    memcpy(slot->fqans + n, data->fqan[i], len);
+                    n += len;
+                }
+            /* Not resumable if the attributes do not fit */
+            if (i == data->nbfqan &&
+                    (data->voname == NULL || strlen(data->voname) < CGSI_MAXNAMELEN))
+                {
+                    strncpy(slot->client_name, data->client_name, CGSI_MAXNAMELEN - 1);
+                    strncpy(slot->user_ca, data->user_ca, CGSI_MAXNAMELEN - 1);
+                    slot->has_voname = (data->voname != NULL);
+                    if (data->voname != NULL)
+                        strcpy(slot->voname, data->voname);
+                    slot->nbfqan = data->nbfqan;
+                    if (expires && expires < slot->expires)
+                        slot->expires = expires;
+                    slot->attrs = (expires != 0);
+                }
         }
+    pthread_mutex_unlock(&server_sessions->lock);
+}
 
-    if (opts & CGSI_OPT_DISABLE_MAPPING)
-        {
-            p->disable_mapping = 1;
+/**
+ * Fills in the client name, user CA and VOMS attributes of a resumed connection
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_server_session_restore(struct cgsi_plugin_data *data)
+{
+    struct cgsi_server_session *slot;
+    char **fqan = NULL;
+    char *voname = NULL, *p;
+    int i, ret = -1;
+
+    if (server_sessions == NULL)
+        return -1;
+
+    cgsi_server_sessions_lock();
+    slot = cgsi_server_session_find(data);
+    if (slot != NULL && slot->attrs)
+        {
+            if (slot->has_voname)
+                voname = strdup(slot->voname);
+            if (slot->nbfqan > 0)
+                fqan = (char **) calloc(slot->nbfqan + 1, sizeof(char *));
+            if ((slot->has_voname && voname == NULL) || (slot->nbfqan > 0 && fqan == NULL))
+                goto unlock;
+
+            for (i = 0, p = slot->fqans; i < slot->nbfqan; i++, p += strlen(p) + 1)
+                {
+                    if ((fqan[i] = strdup(p)) == NULL)
+                        goto unlock;
+                }
+
+            strncpy(data->client_name, slot->client_name, CGSI_MAXNAMELEN);
+            strncpy(data->user_ca, slot->user_ca, CGSI_MAXNAMELEN);
+            data->voname = voname;
+            data->fqan = fqan;
+            data->nbfqan = slot->nbfqan;
+            data->attrs_retrieved = 1;
+            voname = NULL;
+            fqan = NULL;
+            ret = 0;
         }
+unlock:
+    pthread_mutex_unlock(&server_sessions->lock);
 
-    if (opts & CGSI_OPT_DISABLE_VOMS_CHECK)
+    free(voname);
+    if (fqan != NULL)
         {
-            p->disable_voms_check = 1;
+            for (i = 0; fqan[i] != NULL; i++)
+                free(fqan[i]);
+            free(fqan);
         }
 
-    if (opts & CGSI_OPT_ALLOW_ONLY_SELF)
+    if (ret == 0)
         {
-            p->allow_only_self = 1;
+            pthread_mutex_lock(&stats_lock);
+            plugin_stats.server_session_resumed++;
+            pthread_mutex_unlock(&stats_lock);
         }
-
-    return 0;
+    return ret;
 }
 
+/******************************************************************************/
+/* GRIDMAP INDEX */
+/******************************************************************************/
+
 /**
- * Look's up the plugin, be it client or server
+ * Stats the gridmap file globus_gss_assist_gridmap() reads
  */
-static struct cgsi_plugin_data* get_plugin(struct soap *soap)
+static void cgsi_gridmap_file(struct cgsi_cred_file *file)
 {
+    char path[CGSI_MAXNAMELEN];
+    const char *paths[1];
+    const char *env;
 
-    struct cgsi_plugin_data *data = NULL;
-
-    /* Check if we are a client */
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, client_plugin_id);
-    if (data == NULL)
+    env = getenv("GRIDMAP");
+    if (env == NULL)
         {
-            data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
+            if (geteuid() == 0 || (env = getenv("HOME")) == NULL)
+                {
+                    env = "/etc/grid-security/grid-mapfile";
+                }
+            else
+                {
+                    snprintf(path, sizeof(path), "%s/.gridmap", env);
+                    env = path;
+                }
         }
-
-    return data;
+    paths[0] = env;
+    cgsi_cred_files_stat(file, paths, 1);
 }
 
-
 /**
- * Returns 1 if the context has been extablished, 0 if not,
- * or -1 if an error happened during plugin lookup.
- *
+ * Writes the DN in the form used as key of the index: the e-mail and
+ * user id attributes, which OpenSSL versions spell differently, get a
+ * single name.
+ * Returns 0 if successful, -1 if the result does not fit in the buffer.
  */
-int is_context_established(struct soap *soap)
+static int cgsi_dn_normalize(const char *dn, char *out, size_t outlen)
 {
+    const char *attr, *eq;
+    size_t len, n = 0;
 
-    struct cgsi_plugin_data *data = NULL;
+    while (*dn)
+        {
+            if (*dn == '/')
+                {
+                    attr = dn + 1;
+                    for (eq = attr; *eq && *eq != '=' && *eq != '/'; eq++)
+                        ;
+                    if (*eq == '=')
+                        {
+                            len = eq - attr;
+                            if ((len == 1 && strncasecmp(attr, "E", 1) == 0) ||
+                                    (len == 5 && strncasecmp(attr, "Email", 5) == 0) ||
+                                    (len == 12 && strncasecmp(attr, "emailAddress", 12) == 0))
+                                {
+                                    attr = "emailAddress";
+                                    len = 12;
+                                }
+                            else if ((len == 3 && strncasecmp(attr, "UID", 3) == 0) ||
+                                     (len == 6 && strncasecmp(attr, "USERID", 6) == 0))
+                                {
+                                    attr = "UID";
+                                    len = 3;
+                                }
+                            if (n + len + 2 >= outlen)
+                                return -1;
+                            out[n++] = '/';
+                            memcpy(out + n, attr, len);
+                            n += len;
+                            out[n++] = '=';
+                            dn = eq + 1;
+                            continue;
+                        }
+                }
+            if (n + 1 >= outlen)
+                return -1;
+            out[n++] = *dn++;
+        }
+    out[n] = '\0';
+    return 0;
+}
 
-    data = get_plugin(soap);
-    if (data == NULL) return -1;
+static unsigned int cgsi_dn_hash(const char *dn)
+{
+    unsigned int h = 5381;
 
-    return data->context_established;
+    while (*dn)
+        h = h * 33 + (unsigned char) *dn++;
+    return h;
 }
 
-/**
- * Copies the client DN in the buffer passed.
- * Returns 0 if everything ok, -1 otherwise.
- *
- */
-int get_client_dn(struct soap *soap, char *dn, size_t dnlen)
+/* Second hash of the Bloom filter (FNV-1a) */
+static unsigned int cgsi_dn_hash2(const char *dn)
 {
-    struct cgsi_plugin_data *data = NULL;
-    data = get_plugin(soap);
-    if (data == NULL) return -1;
+    unsigned int h = 2166136261U;
 
-    memset(dn, '\0', dnlen);
-    strncpy(dn, data->client_name, dnlen);
-    return 0;
+    while (*dn)
+        {
+            h ^= (unsigned char) *dn++;
+            h *= 16777619U;
+        }
+    return h | 1;
 }
 
 /**
- * Copies the client username in the buffer passed.
- * Returns 0 if everything ok, -1 otherwise.
- *
+ * Returns 1 if the DN may be among the exact entries of the index,
+ * 0 if it is certainly not
  */
-int get_client_username(struct soap *soap, char *username, size_t usernamelen)
+static int cgsi_gridmap_bloom_test(struct cgsi_gridmap *gm, unsigned int h1, unsigned int h2)
 {
-    struct cgsi_plugin_data *data = NULL;
-    data = get_plugin(soap);
-    if (data == NULL) return -1;
+    unsigned int bit;
+    int i;
 
-    memset(username, '\0', usernamelen);
-    strncpy(username, data->username, usernamelen);
-    return 0;
+    for (i = 0; i < CGSI_GRIDMAP_BLOOM_HASHES; i++)
+        {
+            bit = (h1 + i * h2) & (gm->bloom_bits - 1);
+            if (!(gm->bloom[bit >> 3] & (1 << (bit & 7))))
+                return 0;
+        }
+    return 1;
 }
 
+static void cgsi_gridmap_bloom_add(struct cgsi_gridmap *gm, unsigned int h1, unsigned int h2)
+{
+    unsigned int bit;
+    int i;
 
+    for (i = 0; i < CGSI_GRIDMAP_BLOOM_HASHES; i++)
+        {
+            bit = (h1 + i * h2) & (gm->bloom_bits - 1);
+            gm->bloom[bit >> 3] |= 1 << (bit & 7);
+        }
+}
 
 /**
- * Checks the environment to setup the trace mode,
- * if CGSI_TRACE is set
- * If CGSI_TRACEFILE is set, the output is written to that file,
- * otherwise, it is sent to stderr.
+ * Matches a string against a pattern where '*' stands for any sequence
+ * of characters
  */
-static int setup_trace(struct cgsi_plugin_data *data)
+static int cgsi_wildcard_match(const char *pattern, const char *s)
 {
-    char *envar;
-
-    data->trace_mode = 0;
-    data->trace_file[0] = data->trace_file[CGSI_MAXNAMELEN-1]= '\0';
+    const char *star = NULL, *retry = NULL;
 
-    envar = getenv(CGSI_TRACE);
-    if (envar != NULL)
+    while (*s)
         {
-            errno = 0;
-            data->trace_mode = strtol(envar, NULL, 10);
-            if (errno)
-                data->trace_mode = 1;
-            envar = getenv(CGSI_TRACEFILE);
-            if (envar != NULL)
+            if (*pattern == '*')
                 {
-                    strncpy(data->trace_file, envar, CGSI_MAXNAMELEN-1);
+                    star = ++pattern;
+                    retry = s;
+                }
+            else if (*pattern == *s)
+                {
+                    pattern++;
+                    s++;
+                }
+            else if (star != NULL)
+                {
+                    pattern = star;
+                    s = ++retry;
+                }
+            else
+                {
+                    return 0;
                 }
         }
-    return 0;
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
 }
 
-
-static int trace(struct cgsi_plugin_data *data, const char *tracestr)
+/**
+ * Parses one line of the gridmap file, as globus_gss_assist_gridmap()
+ * does: a DN, quoted if it contains spaces, followed by a comma
+ * separated list of usernames of which the first one is used.
+ * Returns 0 if the line holds a mapping, -1 otherwise.
+ */
+static int cgsi_gridmap_parse_line(char *line, char *dn, size_t dnlen, char **username)
 {
-    if (!data->trace_mode)
+    char *p = line;
+    size_t n = 0;
+    int quoted;
+    unsigned int c;
+
+    while (isspace((unsigned char) *p))
+        p++;
+    if (*p == '\0' || *p == '#')
+        return -1;
+
+    quoted = (*p == '"');
+    if (quoted)
+        p++;
+    while (*p && (quoted ? *p != '"' : !isspace((unsigned char) *p)))
+        {
+            if (n + 1 >= dnlen)
+                return -1;
+            if (*p == '\\' && p[1] == 'x' && isxdigit((unsigned char) p[2]) &&
+                    isxdigit((unsigned char) p[3]) && sscanf(p + 2, "%2x", &c) == 1)
+                {
+                    /* Hex escaped character */
+                    dn[n++] = (char) c;
+                    p += 4;
+                    continue;
+                }
+            if (*p == '\\' && p[1])
+                p++;
+            dn[n++] = *p++;
+        }
+    dn[n] = '\0';
+    if (quoted)
         {
-            return 0;
+            if (*p != '"')
+                return -1;
+            p++;
         }
 
-    return trace_str(data, tracestr, strlen(tracestr));
+    while (isspace((unsigned char) *p))
+        p++;
+    *username = p;
+    while (*p && *p != ',' && !isspace((unsigned char) *p))
+        p++;
+    *p = '\0';
+
+    return **username ? 0 : -1;
 }
 
-static int trace_str(struct cgsi_plugin_data *data, const char *msg, int len)
+/**
+ * Files a wildcard entry under the trie node of its literal prefix
+ */
+static int cgsi_gridmap_add_pattern(struct cgsi_gridmap *gm, const char *dn,
+                                    const char *username, int line)
 {
-    if (!data->trace_mode)
-        {
-            return 0;
-        }
+    struct cgsi_gridmap_node **slot, *node = gm->trie;
+    struct cgsi_gridmap_pattern *pattern;
+    const char *p;
 
-    /* If no trace file defined, write to stderr */
-    if (data->trace_file[0]=='\0')
+    for (p = dn; *p != '*'; p++)
         {
-            int i;
-            for (i = 0; i < len; ++i) {
-                if (data->start_new_line) {
-                    fputs("[CGSI-GSOAP] ", stderr);
-                    data->start_new_line = 0;
+            for (slot = &node->child; *slot != NULL; slot = &(*slot)->sibling)
+                {
+                    if ((*slot)->c == (unsigned char) *p)
+                        break;
+                }
+            if (*slot == NULL)
+                {
+                    *slot = (struct cgsi_gridmap_node *) calloc(1, sizeof(struct cgsi_gridmap_node));
+                    if (*slot == NULL)
+                        return -1;
+                    (*slot)->c = (unsigned char) *p;
                 }
+            node = *slot;
+        }
+
+    pattern = (struct cgsi_gridmap_pattern *) calloc(1, sizeof(struct cgsi_gridmap_pattern));
+    if (pattern == NULL)
+        return -1;
+    pattern->rest = strdup(p);
+    pattern->username = strdup(username);
+    pattern->line = line;
+    pattern->next = node->patterns;
+    node->patterns = pattern;
+    if (pattern->rest == NULL || pattern->username == NULL)
+        return -1;
+    return 0;
+}
 
-                fputc(msg[i], stderr);
-                if (msg[i] == '\n')
-                    data->start_new_line = 1;
-            }
-        }
-    else
+static void cgsi_gridmap_free_node(struct cgsi_gridmap_node *node)
+{
+    struct cgsi_gridmap_node *sibling;
+    struct cgsi_gridmap_pattern *pattern, *next;
+
+    while (node != NULL)
         {
-            int fd;
-            fd = open(data->trace_file, O_CREAT|O_WRONLY|O_APPEND, 0644);
-            if (fd <0) return -1;
-            write(fd, msg, len);
-            close(fd);
+            cgsi_gridmap_free_node(node->child);
+            for (pattern = node->patterns; pattern != NULL; pattern = next)
+                {
+                    next = pattern->next;
+                    free(pattern->rest);
+                    free(pattern->username);
+                    free(pattern);
+                }
+            sibling = node->sibling;
+            free(node);
+            node = sibling;
         }
-    return 0;
 }
 
-int get_delegated_credentials(struct soap *soap, void **buffer, size_t *length)
+static void cgsi_gridmap_free(struct cgsi_gridmap *gm)
 {
-    OM_uint32 maj_stat, min_stat;
-    gss_buffer_desc buffer_desc = GSS_C_EMPTY_BUFFER;
-    struct cgsi_plugin_data *data;
+    struct cgsi_gridmap_entry *entry, *next;
+    unsigned int i;
 
-    if (soap == NULL || buffer == NULL || length == NULL)
+    if (gm == NULL)
+        return;
+
+    if (gm->buckets != NULL)
         {
-            cgsi_err(soap, "invalid argument passed to get_delegated_credentials");
-            return -1;
+            for (i = 0; i < gm->nbuckets; i++)
+                {
+                    for (entry = gm->buckets[i]; entry != NULL; entry = next)
+                        {
+                            next = entry->next;
+                            free(entry->dn);
+                            free(entry->username);
+                            free(entry);
+                        }
+                }
+            free(gm->buckets);
         }
+    free(gm->bloom);
+    cgsi_gridmap_free_node(gm->trie);
+    free(gm);
+}
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap,
-            server_plugin_id);
+/**
+ * Builds the index of the gridmap file. A missing file gives an empty index.
+ * Returns NULL if the file cannot be read or memory is short.
+ */
+static struct cgsi_gridmap *cgsi_gridmap_load(struct cgsi_cred_file *file)
+{
+    struct cgsi_gridmap *gm;
+    struct cgsi_gridmap_entry *entry, **bucket;
+    char line[BUFSIZE * 4];
+    char dn[CGSI_MAXNAMELEN], key[CGSI_MAXNAMELEN * 2];
+    char *username;
+    unsigned int nlines = 0, h1, h2;
+    int lineno = 0, error = 0;
+    FILE *fp = NULL;
+
+    gm = (struct cgsi_gridmap *) calloc(1, sizeof(struct cgsi_gridmap));
+    if (gm == NULL)
+        return NULL;
+    gm->file = *file;
+    gm->refcount = 1;
+
+    if (file->present)
+        {
+            fp = fopen(file->path, "r");
+            if (fp == NULL)
+                {
+                    free(gm);
+                    return NULL;
+                }
+            while (fgets(line, sizeof(line), fp) != NULL)
+                nlines++;
+            rewind(fp);
+        }
+
+    /* Sizing the table and the filter after the number of lines */
+    gm->nbuckets = 64;
+    while (gm->nbuckets < nlines)
+        gm->nbuckets <<= 1;
+    gm->bloom_bits = gm->nbuckets * CGSI_GRIDMAP_BLOOM_BITS;
+    gm->buckets = (struct cgsi_gridmap_entry **) calloc(gm->nbuckets, sizeof(struct cgsi_gridmap_entry *));
+    gm->bloom = (unsigned char *) calloc(gm->bloom_bits / 8, 1);
+    gm->trie = (struct cgsi_gridmap_node *) calloc(1, sizeof(struct cgsi_gridmap_node));
+    if (gm->buckets == NULL || gm->bloom == NULL || gm->trie == NULL)
+        error = 1;
+
+    while (!error && fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+        {
+            lineno++;
+            if (strchr(line, '\n') == NULL && !feof(fp))
+                {
+                    /* Line too long to be a valid entry, skipping it */
+                    int c;
+                    while ((c = fgetc(fp)) != EOF && c != '\n')
+                        ;
+                    continue;
+                }
+            if (cgsi_gridmap_parse_line(line, dn, sizeof(dn), &username) != 0 ||
+                    cgsi_dn_normalize(dn, key, sizeof(key)) != 0)
+                continue;
 
-    if (data == NULL)
-        {
-            cgsi_err(soap, "get delegated credentials: could not get data structure");
-            return -1;
+            if (strchr(key, '*') != NULL)
+                {
+                    if (cgsi_gridmap_add_pattern(gm, key, username, lineno) != 0)
+                        error = 1;
+                    gm->npatterns++;
+                    continue;
+                }
+
+            /* The first line mapping a DN is the one which counts */
+            h1 = cgsi_dn_hash(key);
+            bucket = &gm->buckets[h1 & (gm->nbuckets - 1)];
+            for (entry = *bucket; entry != NULL; entry = entry->next)
+                {
+                    if (entry->hash == h1 && strcmp(entry->dn, key) == 0)
+                        break;
+                }
+            if (entry != NULL)
+                continue;
+
+            entry = (struct cgsi_gridmap_entry *) calloc(1, sizeof(struct cgsi_gridmap_entry));
+            if (entry == NULL)
+                {
+                    error = 1;
+                    continue;
+                }
+            entry->dn = strdup(key);
+            entry->username = strdup(username);
+            entry->hash = h1;
+            entry->line = lineno;
+            entry->next = *bucket;
+            *bucket = entry;
+            gm->nentries++;
+            if (entry->dn == NULL || entry->username == NULL)
+                error = 1;
+
+            h2 = cgsi_dn_hash2(key);
+            cgsi_gridmap_bloom_add(gm, h1, h2);
         }
 
-    if (data->deleg_credential_token)
+    if (fp != NULL)
         {
-            *buffer = data->deleg_credential_token;
-            *length = data->deleg_credential_token_len;
-            return 0;
+            if (ferror(fp))
+                error = 1;
+            fclose(fp);
         }
 
-    if (data->deleg_cred_set == 0)
+    if (error)
         {
-            cgsi_err(soap, "get delegated credentials: no delegated credentials available");
-            return -1;
+            cgsi_gridmap_free(gm);
+            return NULL;
         }
+    return gm;
+}
 
-    maj_stat = gss_export_cred(&min_stat,
-                               data->deleg_credential_handle,
-                               GSS_C_NO_OID,
-                               0,
-                               &buffer_desc);
+/**
+ * Looks the normalized DN up in the index, the exact entries in the hash
+ * table and the wildcard ones along the path of the DN in the trie.
+ * When several lines match, the first one in the file wins.
+ */
+static const char *cgsi_gridmap_find(struct cgsi_gridmap *gm, const char *key)
+{
+    struct cgsi_gridmap_entry *entry;
+    struct cgsi_gridmap_node *node;
+    struct cgsi_gridmap_pattern *pattern;
+    const char *found = NULL, *p;
+    unsigned int h1;
+    int line = 0;
 
-    if (maj_stat != GSS_S_COMPLETE)
+    h1 = cgsi_dn_hash(key);
+    if (gm->nentries > 0 && cgsi_gridmap_bloom_test(gm, h1, cgsi_dn_hash2(key)))
         {
-            cgsi_gssapi_err(soap,  "Error exporting credentials", maj_stat, min_stat);
-            return -1;
+            for (entry = gm->buckets[h1 & (gm->nbuckets - 1)]; entry != NULL; entry = entry->next)
+                {
+                    if (entry->hash == h1 && strcmp(entry->dn, key) == 0)
+                        {
+                            found = entry->username;
+                            line = entry->line;
+                            break;
+                        }
+                }
         }
 
-    data->deleg_credential_token = malloc(buffer_desc.length);
-    if (data->deleg_credential_token == NULL)
+    if (gm->npatterns == 0)
+        return found;
+
+    node = gm->trie;
+    p = key;
+    while (node != NULL)
         {
-            (void) gss_release_buffer(&min_stat, &buffer_desc);
-            cgsi_err(soap, "get_delegated_credentials: could not allocate memory");
-            return -1;
+            for (pattern = node->patterns; pattern != NULL; pattern = pattern->next)
+                {
+                    if ((found == NULL || pattern->line < line) &&
+                            cgsi_wildcard_match(pattern->rest, p))
+                        {
+                            found = pattern->username;
+                            line = pattern->line;
+                        }
+                }
+            if (*p == '\0')
+                break;
+            for (node = node->child; node != NULL; node = node->sibling)
+                {
+                    if (node->c == (unsigned char) *p)
+                        break;
+                }
+            p++;
         }
 
-    memcpy(data->deleg_credential_token, buffer_desc.value, buffer_desc.length);
-    data->deleg_credential_token_len = buffer_desc.length;
+    return found;
+}
 
-    (void) gss_release_buffer(&min_stat, &buffer_desc);
+/**
+ * Drops a reference on an index, freeing it with the last one
+ */
+static void cgsi_gridmap_release(struct cgsi_gridmap *gm)
+{
+    int refcount;
 
-    *buffer = data->deleg_credential_token;
-    *length = data->deleg_credential_token_len;
-    return 0;
+    pthread_mutex_lock(&gridmap_lock);
+    refcount = --gm->refcount;
+    pthread_mutex_unlock(&gridmap_lock);
+
+    if (refcount == 0)
+        cgsi_gridmap_free(gm);
 }
 
-int export_delegated_credentials(struct soap *soap, char *filename)
+/**
+ * Returns a reference on the index of the current gridmap file, reloading
+ * it if the file changed. A single thread reloads the file, off to the
+ * side, while the others keep on using the previous index.
+ * Returns NULL if there is no usable index.
+ */
+static struct cgsi_gridmap *cgsi_gridmap_get(void)
 {
-    const char *token;
-    size_t token_length;
-    int fd;
+    struct cgsi_cred_file file;
+    struct cgsi_gridmap *gm, *old = NULL;
 
-    if (soap == NULL)
+    cgsi_gridmap_file(&file);
+
+    pthread_mutex_lock(&gridmap_lock);
+    gm = gridmap_current;
+    if (gm != NULL && strcmp(gm->file.path, file.path) == 0 &&
+            gm->file.present == file.present &&
+            gm->file.dev == file.dev &&
+            gm->file.ino == file.ino &&
+            gm->file.mtime == file.mtime &&
+            gm->file.size == file.size)
         {
-            cgsi_err(soap, "invalid argument passed to export_delegated_credentials");
-            return -1;
+            gm->refcount++;
+            pthread_mutex_unlock(&gridmap_lock);
+            return gm;
         }
-
-    if (get_delegated_credentials(soap, (void **)&token, &token_length)<0)
+    if (gridmap_loading)
         {
-            cgsi_err(soap, "export delegated credentials: could not get credential token");
-            return -1;
+            if (gm != NULL)
+                gm->refcount++;
+            pthread_mutex_unlock(&gridmap_lock);
+            return gm;
         }
+    gridmap_loading = 1;
+    pthread_mutex_unlock(&gridmap_lock);
 
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd < 0)
+    gm = cgsi_gridmap_load(&file);
+
+    pthread_mutex_lock(&gridmap_lock);
+    gridmap_loading = 0;
+    if (gm != NULL)
         {
-            cgsi_err(soap, "export delegated credentials: could not open temp file");
-            return -1;
+            old = gridmap_current;
+            gridmap_current = gm;
+            gm->refcount++;
         }
+    pthread_mutex_unlock(&gridmap_lock);
+
+    if (old != NULL)
+        cgsi_gridmap_release(old);
+    return gm;
+}
+
+/**
+ * Maps the DN to a local username through the gridmap file.
+ * Falls back on globus_gss_assist_gridmap() if the file cannot be indexed.
+ * Returns 0 if the DN is mapped, -1 otherwise.
+ */
+static int cgsi_gridmap_lookup(const char *dn, char *username, size_t usernamelen)
+{
+    struct cgsi_gridmap *gm;
+    char key[CGSI_MAXNAMELEN * 2];
+    const char *found;
+    char *p;
+    int ret = -1;
+
+    if (username == NULL || usernamelen == 0)
+        return -1;
 
-    if (write(fd, token, token_length) != (ssize_t)token_length)
+    gm = cgsi_gridmap_get();
+    if (gm == NULL)
         {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "export delegated credentials: could not write to file (%s)",
-                     strerror(errno));
-            cgsi_err(soap, buf);
-            if(fd >= 0)
-                close(fd);
-            return -1;
+            if (globus_gss_assist_gridmap((char *) dn, &p))
+                return -1;
+            strncpy(username, p, usernamelen);
+            username[usernamelen - 1] = '\0';
+            free(p);
+            return 0;
         }
 
-    if (close(fd)<0)
+    if (cgsi_dn_normalize(dn, key, sizeof(key)) == 0 &&
+            (found = cgsi_gridmap_find(gm, key)) != NULL)
         {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "export delegated credentials: could not close file (%s)",
-                     strerror(errno));
-            cgsi_err(soap, buf);
-            return -1;
+            strncpy(username, found, usernamelen);
+            username[usernamelen - 1] = '\0';
+            ret = 0;
         }
 
-    return 0;
+    cgsi_gridmap_release(gm);
+    return ret;
 }
 
+int cgsi_plugin_map_dn(const char *dn, char *username, size_t usernamelen)
+{
+    if (dn == NULL)
+        return -1;
+    return cgsi_gridmap_lookup(dn, username, usernamelen);
+}
 
-#define PROXY_ENV_VAR "X509_USER_PROXY"
+/******************************************************************************/
+/* VOMS CACHE */
+/******************************************************************************/
 
-int set_default_proxy_file(struct soap *soap, char *filename)
+/**
+ * Computes the key of the VOMS cache: the SHA-256 of the digests of the
+ * certificate and of each certificate of its chain.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cgsi_chain_digest(X509 *cert, STACK_OF(X509) *chain, unsigned char *digest)
 {
-    int rc;
+    unsigned char *buf;
+    unsigned int len;
+    int i, n;
 
-    rc = setenv(PROXY_ENV_VAR, filename, 1);
-    if (rc < 0)
+    n = chain ? sk_X509_num(chain) : 0;
+    buf = (unsigned char *) malloc((n + 1) * CGSI_CHAIN_DIGEST_LEN);
+    if (buf == NULL)
+        return -1;
+
+    if (!X509_digest(cert, EVP_sha256(), buf, &len))
         {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "set default proxy file: could not setenv (%s)",
-                     strerror(errno));
-            cgsi_err(soap, buf);
+            free(buf);
             return -1;
         }
-    return 0;
+    for (i = 0; i < n; i++)
+        {
+            if (!X509_digest(sk_X509_value(chain, i), EVP_sha256(),
+                             buf + (i + 1) * CGSI_CHAIN_DIGEST_LEN, &len))
+                {
+                    free(buf);
+                    return -1;
+                }
+        }
+
+    i = EVP_Digest(buf, (n + 1) * CGSI_CHAIN_DIGEST_LEN, digest, &len, EVP_sha256(), NULL);
+    free(buf);
+    return i ? 0 : -1;
 }
 
+#if defined(USE_VOMS)
+/**
+ * Converts the GeneralizedTime of an attribute certificate (YYYYMMDDHHMMSSZ)
+ * Returns 0 if it cannot be parsed.
+ */
+static time_t cgsi_voms_time(const char *date)
+{
+    struct tm tm;
+
+    if (date == NULL)
+        return 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(date, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
+#endif
 
-void clear_default_proxy_file(int unlink_file)
+/**
+ * Duplicates a NULL terminated list of FQANs
+ */
+static char **cgsi_fqans_dup(char **fqan, int nbfqan)
 {
-    char *proxy_file;
+    char **copy;
+    int i;
 
-    /* Removing the credentials file if flagged so */
-    if (unlink_file)
+    copy = (char **) calloc(nbfqan + 1, sizeof(char *));
+    if (copy == NULL)
+        return NULL;
+    for (i = 0; i < nbfqan; i++)
         {
-            proxy_file = getenv(PROXY_ENV_VAR);
-            if (proxy_file != NULL)
+            copy[i] = strdup(fqan[i]);
+            if (copy[i] == NULL)
                 {
-                    unlink(proxy_file);
+                    while (i-- > 0)
+                        free(copy[i]);
+                    free(copy);
+                    return NULL;
                 }
         }
+    return copy;
+}
 
-    /* Clearing the environment variable */
-    unsetenv(PROXY_ENV_VAR);
+static void cgsi_voms_entry_free(struct cgsi_voms_entry *entry)
+{
+    int i;
+
+    if (entry->fqan)
+        {
+            for (i = 0; i < entry->nbfqan; i++)
+                free(entry->fqan[i]);
+            free(entry->fqan);
+        }
+    free(entry->voname);
+    free(entry);
 }
 
+static unsigned int cgsi_voms_bucket(const unsigned char *digest)
+{
+    return ((digest[0] << 8) | digest[1]) % CGSI_VOMS_CACHE_BUCKETS;
+}
 
-int has_delegated_credentials(struct soap *soap)
+/**
+ * Drops the expired entries, or all of them if all is set.
+ * Must be called with voms_cache_lock held.
+ */
+static void cgsi_voms_cache_purge(time_t now, int all)
 {
-    struct cgsi_plugin_data *data;
+    struct cgsi_voms_entry **prev, *entry;
+    int i;
 
-    if (soap == NULL)
+    for (i = 0; i < CGSI_VOMS_CACHE_BUCKETS; i++)
         {
-            return -1;
+            prev = &voms_cache[i];
+            while ((entry = *prev) != NULL)
+                {
+                    if (all || entry->expires <= now)
+                        {
+                            *prev = entry->next;
+                            cgsi_voms_entry_free(entry);
+                            voms_cache_count--;
+                        }
+                    else
+                        {
+                            prev = &entry->next;
+                        }
+                }
         }
+}
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
+/**
+ * Fills in the CA and VOMS attributes of the connection from the cache.
+ * voms_checked tells whether the VOMS attributes are needed, expires is
+ * lowered to the expiry of the entry.
+ * Returns 1 if they were found, 0 otherwise.
+ */
+static int cgsi_voms_cache_get(struct cgsi_plugin_data *data,
+                               const unsigned char *digest, int voms_checked, time_t *expires)
+{
+    struct cgsi_voms_entry *entry;
+    time_t now = time(NULL);
+    int found = 0;
 
-    if (data == NULL)
+    pthread_mutex_lock(&voms_cache_lock);
+    for (entry = voms_cache[cgsi_voms_bucket(digest)];
+            entry != NULL; entry = entry->next)
         {
-            cgsi_err(soap, "export delegated credentials: could not get data structure");
-            return -1;
+            if (memcmp(entry->digest, digest, CGSI_CHAIN_DIGEST_LEN) != 0)
+                continue;
+            if (entry->expires <= now || entry->voms_checked < voms_checked)
+                break;
+
+            strncpy(data->user_ca, entry->user_ca, CGSI_MAXNAMELEN);
+            data->user_ca[CGSI_MAXNAMELEN - 1] = '\0';
+            if (entry->expires < *expires)
+                *expires = entry->expires;
+            if (voms_checked)
+                {
+                    if (entry->voname != NULL)
+                        data->voname = strdup(entry->voname);
+                    if (entry->fqan != NULL)
+                        {
+                            data->fqan = cgsi_fqans_dup(entry->fqan, entry->nbfqan);
+                            if (data->fqan != NULL)
+                                data->nbfqan = entry->nbfqan;
+                        }
+                }
+            found = 1;
+            break;
         }
+    pthread_mutex_unlock(&voms_cache_lock);
 
-    if (data->deleg_cred_set != 0)
+    return found;
+}
+
+/**
+ * Remembers the CA and VOMS attributes of the connection until expires
+ */
+static void cgsi_voms_cache_put(struct cgsi_plugin_data *data,
+                                const unsigned char *digest, int voms_checked, time_t expires)
+{
+    struct cgsi_voms_entry **prev, *entry, *old;
+    time_t now = time(NULL);
+
+    if (expires <= now)
+        return;
+
+    entry = (struct cgsi_voms_entry *) calloc(1, sizeof(struct cgsi_voms_entry));
+    if (entry == NULL)
+        return;
+    memcpy(entry->digest, digest, CGSI_CHAIN_DIGEST_LEN);
+    entry->voms_checked = voms_checked;
+    strncpy(entry->user_ca, data->user_ca, CGSI_MAXNAMELEN);
+    entry->user_ca[CGSI_MAXNAMELEN - 1] = '\0';
+    entry->expires = expires;
+    if (data->voname != NULL)
+        {
+            entry->voname = strdup(data->voname);
+            if (entry->voname == NULL)
+                {
+                    cgsi_voms_entry_free(entry);
+                    return;
+                }
+        }
+    if (data->fqan != NULL)
         {
-            return 1;
+            entry->fqan = cgsi_fqans_dup(data->fqan, data->nbfqan);
+            if (entry->fqan == NULL)
+                {
+                    cgsi_voms_entry_free(entry);
+                    return;
+                }
+            entry->nbfqan = data->nbfqan;
         }
 
-    return 0;
+    pthread_mutex_lock(&voms_cache_lock);
+    prev = &voms_cache[cgsi_voms_bucket(digest)];
+    for (; (old = *prev) != NULL; prev = &old->next)
+        {
+            if (memcmp(old->digest, digest, CGSI_CHAIN_DIGEST_LEN) == 0)
+                {
+                    /* Replacing an expired or less complete entry */
+                    *prev = old->next;
+                    cgsi_voms_entry_free(old);
+                    voms_cache_count--;
+                    break;
+                }
+        }
+    if (voms_cache_count >= CGSI_VOMS_CACHE_SIZE)
+        cgsi_voms_cache_purge(now, 0);
+    if (voms_cache_count >= CGSI_VOMS_CACHE_SIZE)
+        cgsi_voms_cache_purge(now, 1);
+    prev = &voms_cache[cgsi_voms_bucket(digest)];
+    entry->next = *prev;
+    *prev = entry;
+    voms_cache_count++;
+    pthread_mutex_unlock(&voms_cache_lock);
 }
 
+/*****************************************************************
+ *                                                               *
+ *               VOMS FUNCTIONS                                  *
+ *                                                               *
+ *****************************************************************/
 
-int soap_cgsi_init(struct soap *soap, int cgsi_options)
+#if defined(USE_VOMS)
+static void cgsi_voms_context_free(void *arg)
 {
-    int params, rc;
-
-    params = cgsi_options;
-    if( cgsi_options & CGSI_OPT_KEEP_ALIVE )
-        soap_init2( soap, SOAP_IO_KEEPALIVE, SOAP_IO_KEEPALIVE );
-    else
-        soap_init(soap);
-    rc = soap_register_plugin_arg(soap, cgsi_plugin, &params);
-    if (rc < 0) return -1;
+    struct cgsi_voms_context *ctx = (struct cgsi_voms_context *) arg;
 
-    return 0;
+    if (ctx->vd != NULL)
+        VOMS_Destroy(ctx->vd);
+    free(ctx);
 }
 
-static void activate_globus_modules(void)
+static void cgsi_voms_context_key_create(void)
 {
-    (void) globus_module_activate(GLOBUS_GSI_GSS_ASSIST_MODULE);
-    (void) globus_module_activate(GLOBUS_GSI_GSSAPI_MODULE);
-    (void) globus_module_activate(GLOBUS_OPENSSL_MODULE);
+    (void) pthread_key_create(&voms_context_key, cgsi_voms_context_free);
 }
 
 /**
- * Activate or deactivate required globus modules
+ * Returns the VOMS context of the calling thread, initializing it
+ * the first time and once it is too old. The attributes of the
+ * previous peer are deleted, as VOMS_Retrieve() does not clear them
+ * when the new peer has none.
+ * Returns NULL if VOMS cannot be initialized.
  */
-static void cgsi_plugin_init_globus_modules(void)
+static struct vomsdata *cgsi_voms_context_get(void)
 {
-    static pthread_once_t globus_initialized = PTHREAD_ONCE_INIT;
-    pthread_once(&globus_initialized, activate_globus_modules);
-}
+    struct cgsi_voms_context *ctx;
+    time_t now = time(NULL);
 
-static int _get_user_ca (X509 *px509_cred, STACK_OF(X509) *px509_chain, char *user_ca)
-{
-    X509 *cert;
-    globus_gsi_cert_utils_cert_type_t cert_type;
-    int i;
+    pthread_once(&voms_context_once, cgsi_voms_context_key_create);
 
-    if (! px509_cred || ! px509_chain)
-        return (-1);
-    cert = px509_cred;
-    if (globus_gsi_cert_utils_get_cert_type(cert, &cert_type) != GLOBUS_SUCCESS)
-        return (-1);
-    if (cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_EEC ||
-            cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_CA)
-        {
-            X509_NAME_oneline(X509_get_issuer_name(cert), user_ca, 255);
-            return (0);
-        }
-    for (i = 0; i < sk_X509_num(px509_chain); i++)
+    ctx = (struct cgsi_voms_context *) pthread_getspecific(voms_context_key);
+    if (ctx == NULL)
         {
-            cert = sk_X509_value (px509_chain, i);
-            if (globus_gsi_cert_utils_get_cert_type(cert, &cert_type) != GLOBUS_SUCCESS)
-                return (-1);
-            if (cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_EEC ||
-                    cert_type == GLOBUS_GSI_CERT_UTILS_TYPE_CA)
+            ctx = (struct cgsi_voms_context *) calloc(1, sizeof(struct cgsi_voms_context));
+            if (ctx == NULL)
+                return NULL;
+            if (pthread_setspecific(voms_context_key, ctx) != 0)
                 {
-                    X509_NAME_oneline(X509_get_issuer_name(cert), user_ca, 255);
-                    return (0);
+                    free(ctx);
+                    return NULL;
                 }
         }
-    return (-1);
-}
 
-/* Returns the CA */
-char *get_client_ca(struct soap *soap)
-{
-    struct cgsi_plugin_data *data;
-
-    if (soap == NULL) return NULL;
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
-    if (data == NULL)
+    if (ctx->vd != NULL &&
+            (now - ctx->created >= CGSI_VOMS_CONTEXT_TTL || ctx->uses >= CGSI_VOMS_CONTEXT_USES))
         {
-            cgsi_err(soap, "get_client_ca: could not get data structure");
-            return NULL;
+            VOMS_Destroy(ctx->vd);
+            ctx->vd = NULL;
         }
+    if (ctx->vd != NULL && ctx->vd->data != NULL)
+        {
+            int error = 0;
 
-    if (*data->user_ca == '\0')
+            /* Not reusing a context which may still hold them */
+            if (!VOMS_DeleteAll(ctx->vd, &error) || ctx->vd->data != NULL)
+                {
+                    VOMS_Destroy(ctx->vd);
+                    ctx->vd = NULL;
+                }
+        }
+    if (ctx->vd == NULL)
         {
-            return NULL;
+            if ((ctx->vd = VOMS_Init(NULL, NULL)) == NULL)
+                return NULL;
+            ctx->created = now;
+            ctx->uses = 0;
         }
 
-    return data->user_ca;
+    ctx->uses++;
+    return ctx->vd;
 }
 
-/*****************************************************************
- *                                                               *
- *               VOMS FUNCTIONS                                  *
- *                                                               *
- *****************************************************************/
+/**
+ * Drops the VOMS context of the calling thread, after an error
+ */
+static void cgsi_voms_context_reset(void)
+{
+    struct cgsi_voms_context *ctx;
+
+    ctx = (struct cgsi_voms_context *) pthread_getspecific(voms_context_key);
+    if (ctx != NULL && ctx->vd != NULL)
+        {
+            VOMS_Destroy(ctx->vd);
+            ctx->vd = NULL;
+        }
+}
+#endif
 
 int retrieve_userca_and_voms_creds(struct soap *soap)
 {
@@ -2501,6 +6661,9 @@ int retrieve_userca_and_voms_creds(struct soap *soap)
     gss_cred_id_desc *       cred_desc = NULL;
     globus_gsi_cred_handle_t gsi_cred_handle;
     struct cgsi_plugin_data *data;
+    unsigned char digest[CGSI_CHAIN_DIGEST_LEN];
+    int cacheable = 0, voms_checked = 0;
+    time_t expires = 0;
 
     ret = -1;
 
@@ -2509,18 +6672,18 @@ int retrieve_userca_and_voms_creds(struct soap *soap)
             return -1;
         }
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
+    data = cgsi_find_plugin(soap, server_plugin_id);
     if (data == NULL)
         {
             cgsi_err(soap, "retrieve_userca_and_voms_creds: could not get data structure");
             return -1;
         }
 
-    /* fqan is set, if this function was already called */
+    /* attrs_retrieved is set, if this function was already called successfully */
     /* connection initialization resets this structure  */
-    if (data->fqan != NULL)
+    if (data->attrs_retrieved)
         {
-            trace(data, "retrieve_userca_and_voms_creds: data->fqans already initialized\n");
+            trace(data, "retrieve_userca_and_voms_creds: attributes already retrieved\n");
             return 0;
         }
 
@@ -2537,18 +6700,12 @@ int retrieve_userca_and_voms_creds(struct soap *soap)
 
     cred_desc = (gss_cred_id_desc *) cred;
 
-    if (globus_module_activate(GLOBUS_GSI_CREDENTIAL_MODULE) != GLOBUS_SUCCESS)
-        {
-            trace(data, "retrieve_userca_and_voms_creds: Could not activate GLOBUS_GSI_CREDENTIAL_MODULE\n");
-            goto leave;
-        }
-
+    /* GLOBUS_GSI_CREDENTIAL_MODULE is activated once, with the other modules */
     /* Getting the X509 certicate */
     gsi_cred_handle = cred_desc->cred_handle;
     if (globus_gsi_cred_get_cert(gsi_cred_handle, &px509_cred) != GLOBUS_SUCCESS)
         {
             trace(data, "retrieve_userca_and_voms_creds: failed to get the credentials\n");
-            globus_module_deactivate(GLOBUS_GSI_CREDENTIAL_MODULE);
             goto leave;
         }
 
@@ -2556,28 +6713,42 @@ int retrieve_userca_and_voms_creds(struct soap *soap)
     if (globus_gsi_cred_get_cert_chain (gsi_cred_handle, &px509_chain) != GLOBUS_SUCCESS)
         {
             trace(data, "retrieve_userca_and_voms_creds: failed to get the credentials chain\n");
-            X509_free (px509_cred);
-            (void)globus_module_deactivate (GLOBUS_GSI_CREDENTIAL_MODULE);
             goto leave;
         }
 
+#if defined(USE_VOMS)
+    voms_checked = !data->disable_voms_check;
+#endif
+
+    /* Repeat connections of the same proxy reuse the attributes parsed before,
+       the cache entry expiring with the proxy or the attribute certificates */
+    if (globus_gsi_cred_get_goodtill(gsi_cred_handle, &expires) == GLOBUS_SUCCESS &&
+            cgsi_chain_digest(px509_cred, px509_chain, digest) == 0)
+        {
+            if (cgsi_voms_cache_get(data, digest, voms_checked, &expires))
+                {
+                    trace(data, "retrieve_userca_and_voms_creds: found in the cache\n");
+                    cgsi_server_session_record(data, expires);
+                    ret = 0;
+                    goto leave;
+                }
+            cacheable = 1;
+        }
+
     if (_get_user_ca (px509_cred, px509_chain, data->user_ca) < 0) {
         trace(data, "retrieve_userca_and_voms_creds: could not get the user's CA\n");
         goto leave;
     }
 
-    /* No need for the globus module anymore, the rest are calls to VOMS */
-    (void)globus_module_deactivate (GLOBUS_GSI_CREDENTIAL_MODULE);
-
 #if defined(USE_VOMS)
 
     if (data->disable_voms_check)
         {
             trace(data, "retrieve_userca_and_voms_creds: voms_check disabled\n");
             ret = 0;
-            goto leave;
+            goto store;
         }
-    if ((vd = VOMS_Init (NULL, NULL)) == NULL)
+    if ((vd = cgsi_voms_context_get()) == NULL)
         {
             trace(data, "retrieve_userca_and_voms_creds: failed to initialize VOMS\n");
             goto leave;
@@ -2592,17 +6763,30 @@ int retrieve_userca_and_voms_creds(struct soap *soap)
             trace(data, buffer);
             trace(data, "\n");
             cgsi_err(soap, buffer);
-            VOMS_Destroy (vd);
+            cgsi_voms_context_reset();
             goto leave;
         }
 
-    volist = vd->data;
+    /* The context is empty when reused, vd->data only holds attributes
+       of this peer */
+    volist = (error == VERR_NOEXT) ? NULL : vd->data;
 
     if (volist != NULL)
         {
             int i = 0;
             int nbfqan;
             char buffer[BUFSIZE];
+            struct voms **v;
+            time_t ac_expires;
+
+            for (v = volist; *v != NULL; v++)
+                {
+                    ac_expires = cgsi_voms_time((*v)->date2);
+                    if (ac_expires == 0)
+                        cacheable = 0;
+                    else if (ac_expires < expires)
+                        expires = ac_expires;
+                }
 
             /* Copying the voname */
             if ((*volist)->voname != NULL)
@@ -2640,13 +6824,23 @@ int retrieve_userca_and_voms_creds(struct soap *soap)
         {
             trace(data, "retrieve_userca_and_voms_creds: no vos present\n");
         }
-    VOMS_Destroy (vd);
 
 #endif
 
     ret = 0;
 
+#if defined(USE_VOMS)
+store:
+#endif
+    if (cacheable)
+        {
+            cgsi_voms_cache_put(data, digest, voms_checked, expires);
+            cgsi_server_session_record(data, expires);
+        }
+
 leave:
+    if (ret == 0)
+        data->attrs_retrieved = 1;
     if (px509_cred) X509_free (px509_cred);
     if (px509_chain) sk_X509_pop_free(px509_chain,X509_free);
 
@@ -2664,13 +6858,18 @@ char *get_client_voname(struct soap *soap)
     struct cgsi_plugin_data *data;
 
     if (soap == NULL) return NULL;
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
+    data = cgsi_find_plugin(soap, server_plugin_id);
     if (data == NULL)
         {
             cgsi_err(soap, "get_client_voname: could not get data structure");
             return NULL;
         }
 
+    if (cgsi_lazy_retrieve_attrs(soap, data) != 0)
+        {
+            return NULL;
+        }
+
     if (data->voname == NULL)
         {
             return NULL;
@@ -2692,7 +6891,7 @@ char **get_client_roles(struct soap *soap, int *nbfqan)
         }
     *nbfqan = 0;
 
-    data = (struct cgsi_plugin_data*)soap_lookup_plugin(soap, server_plugin_id);
+    data = cgsi_find_plugin(soap, server_plugin_id);
 
     if (data == NULL)
         {
@@ -2700,6 +6899,11 @@ char **get_client_roles(struct soap *soap, int *nbfqan)
             return NULL;
         }
 
+    if (cgsi_lazy_retrieve_attrs(soap, data) != 0)
+        {
+            return NULL;
+        }
+
     if (data->fqan == NULL)
         {
             return NULL;
@@ -2743,7 +6947,7 @@ static void free_conn_state(struct cgsi_plugin_data *data)
     char **p;
 
     (void) gss_delete_sec_context (&minor_status, &data->context_handle,GSS_C_NO_BUFFER);
-    (void) gss_release_cred (&minor_status, &data->credential_handle);
+    cgsi_release_cred(data);
     (void) gss_release_cred(&minor_status, &data->deleg_credential_handle);
 
     data->context_established = 0;
@@ -2752,7 +6956,9 @@ static void free_conn_state(struct cgsi_plugin_data *data)
     data->server_name[0] = '\0';
     data->username[0] = '\0';
     data->nb_iter = 0;
+    data->session_offered = 0;
     data->deleg_cred_set = 0;
+    data->attrs_retrieved = 0;
     if (data->voname)
         {
             free(data->voname);
@@ -2769,67 +6975,53 @@ static void free_conn_state(struct cgsi_plugin_data *data)
         }
     data->nbfqan = 0;
     data->had_send_error = 0;
+    data->had_recv_error = 0;
+    data->unwrap_pending = 0;
+    data->direct_layout = 0;
     if (data->deleg_credential_token)
         {
             free(data->deleg_credential_token);
             data->deleg_credential_token = NULL;
         }
     data->deleg_credential_token_len = 0;
-    data->buffered_in = buffer_free(data->buffered_in);
-}
-
-
-gss_buffer_t buffer_create(gss_buffer_t buf, size_t offset)
-{
-    gss_buffer_t new_buf;
-
-    new_buf = (gss_buffer_t) malloc(sizeof(gss_buffer_desc));
-
-    return buffer_copy_from(new_buf, buf, offset);
+    (void) gss_release_buffer(&minor_status, &data->buffered_in);
+    data->buffered_offset = 0;
+    data->send_len = 0;
+    data->read_start = data->read_end = 0;
+    (void) gss_release_buffer(&minor_status, &data->step_out);
+    (void) gss_release_name(&minor_status, &data->accept_client);
+    (void) gss_release_cred(&minor_status, &data->accept_deleg);
+    (void) gss_release_name(&minor_status, &data->connect_target);
+    if (data->connect_resolve != NULL)
+        {
+            (void) cgsi_resolve_finish(data->connect_resolve, NULL, 0, NULL);
+            data->connect_resolve = NULL;
+        }
+    client_cgsi_connect_free_addrs(data);
+    data->step_out_offset = 0;
+    data->step_state = CGSI_STEP_IDLE;
+
+    cgsi_plugin_count_records(data);
 }
 
-
-gss_buffer_t buffer_free(gss_buffer_t buf)
+/**
+ * Adds the records and lookups of the connection to the process-wide counters
+ */
+static void cgsi_plugin_count_records(struct cgsi_plugin_data *data)
 {
-    if(buf != NULL)
-        {
-            free(buf->value);
-            free(buf);
+    if (data->recv_in_place || data->recv_allocated || data->recv_direct || data->send_allocated ||
+        data->lookups_by_name)
+        {
+            pthread_mutex_lock(&stats_lock);
+            plugin_stats.recv_records_in_place += data->recv_in_place;
+            plugin_stats.recv_records_direct += data->recv_direct;
+            plugin_stats.recv_records_allocated += data->recv_allocated;
+            plugin_stats.send_records_allocated += data->send_allocated;
+            plugin_stats.plugin_lookups_by_name += data->lookups_by_name;
+            pthread_mutex_unlock(&stats_lock);
+            data->recv_in_place = data->recv_allocated = data->send_allocated = 0;
+            data->recv_direct = 0;
+            data->lookups_by_name = 0;
         }
-    return NULL;
 }
 
-gss_buffer_t buffer_consume_upto(gss_buffer_t buf, size_t offset)
-{
-    void *old_data;
-
-    old_data = buf->value;
-
-    buffer_copy_from(buf, buf, offset);
-
-    free(old_data);
-
-    return buf;
-}
-
-gss_buffer_t buffer_copy_from(gss_buffer_t dest, gss_buffer_t src, size_t offset)
-{
-    size_t new_len;
-    void *new_data;
-
-    if(offset > src->length)
-        {
-            // This is probably triggered by a bug somewhere.
-            offset = src->length;
-        }
-
-    new_len = src->length - offset;
-    new_data = malloc(new_len);
-
-    memcpy(new_data, ((char *)src->value) + offset, new_len);
-
-    dest->value = new_data;
-    dest->length = new_len;
-
-    return dest;
-}
@@ -28,6 +28,7 @@
  */
 
 #include <stdsoap2.h>
+#include <sys/socket.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,6 +59,22 @@ extern "C" {
 /** Allow client and server to only connect together when
  *  they have the same identity */
 #define CGSI_OPT_ALLOW_ONLY_SELF    0x100
+/** Retrieve the user CA and VOMS attributes on the first call to
+ *  get_client_ca(), get_client_voname() or get_client_roles()
+ *  instead of at connect time */
+#define CGSI_OPT_LAZY_VOMS_CHECK    0x200
+/** With CGSI_OPT_DISABLE_NAME_CHECK, run the handshake while the name
+ *  of the server is looked up, checking it once the handshake completes
+ *  instead of before it starts (not with delegation) */
+#define CGSI_OPT_DEFER_NAME_CHECK   0x400
+/** Coalesce small sends into full TLS records, sent when the buffer
+ *  is full, before receiving, when closing or by cgsi_plugin_flush() */
+#define CGSI_OPT_COALESCE_SENDS     0x800
+/** Decrypt the received records with the SSL object of the GSS context,
+ *  straight into gSOAP's buffer. This relies on the layout of the
+ *  context of the Globus GSSAPI the plugin is built with, and falls back
+ *  to gss_unwrap() when the context does not match it */
+#define CGSI_OPT_DIRECT_DECRYPT     0x1000
 
 /**
  * Helper function to create the gsoap object and
@@ -137,6 +154,21 @@ int get_client_dn(struct soap *soap, char *dn, size_t dnlen);
  */
 int get_client_username(struct soap *soap, char *username, size_t dnlen);
 
+/**
+ * Maps a DN to a local username through the gridmap file, like
+ * globus_gss_assist_gridmap() does. The file is indexed in memory
+ * and reindexed when it changes. Lines whose DN contains '*' match
+ * any sequence of characters at that place. When several lines
+ * match, the first one wins.
+ *
+ * @param dn The Distinguished name (DN) to map
+ * @param username Pointer to a buffer where the username is to be written
+ * @param usernamelen The length of the buffer
+ *
+ * @return 0 if the DN is mapped, -1 otherwise
+ */
+int cgsi_plugin_map_dn(const char *dn, char *username, size_t usernamelen);
+
 /**
  * Make the delegated credential available as a token in memory.
  * The soap structure retains ownership of the memory. The user should
@@ -188,6 +220,302 @@ int set_default_proxy_file(struct soap *soap, char *filename);
  */
 void clear_default_proxy_file(int unlink_file);
 
+/**
+ * Enables the server side TLS session cache, letting returning clients
+ * resume their session instead of doing a full handshake. It has to be
+ * called before the first connection is accepted. A session can be
+ * resumed once the user CA and VOMS attributes of the client have been
+ * retrieved, these being restored with the session.
+ * With CGSI_OPT_DISABLE_VOMS_CHECK the user CA is retrieved at the end
+ * of the handshake for that purpose, and the sessions are resumed
+ * without VOMS attributes. With CGSI_OPT_LAZY_VOMS_CHECK, the session
+ * of a connection is only resumable if get_client_ca(),
+ * get_client_voname() or get_client_roles() was called on it, as the
+ * attributes cannot be retrieved from a resumed session.
+ * A session is only resumed with the server credentials it was
+ * established with. When a process sharing the cache dies while
+ * updating it, the cache is emptied.
+ *
+ * @param nslots The number of sessions the cache can hold
+ * @param shared 1 to put the cache in shared memory, so that the
+ *               processes forked afterwards share it, 0 otherwise
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int cgsi_plugin_enable_session_cache(size_t nslots, int shared);
+
+/* Serialization of gss_init_sec_context() by client connections */
+/** Every call, for Globus versions which are not thread-safe (default) */
+#define CGSI_GSS_LOCK_ALL   0
+/** The first call, which creates the context from the shared credential */
+#define CGSI_GSS_LOCK_FIRST 1
+/** No serialization, for thread-safe Globus versions */
+#define CGSI_GSS_LOCK_NONE  2
+
+/**
+ * Sets how the client handshakes of the process are serialized.
+ * Later calls of a handshake only use the state of its own context,
+ * so CGSI_GSS_LOCK_FIRST lets the handshakes run in parallel with
+ * Globus versions whose context creation is the only unsafe part.
+ * The mode can be changed at any time, it applies to the following calls.
+ *
+ * @param mode One of CGSI_GSS_LOCK_ALL, CGSI_GSS_LOCK_FIRST, CGSI_GSS_LOCK_NONE
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int cgsi_plugin_set_gss_lock(int mode);
+
+/**
+ * Sends the data buffered by the plugin. With CGSI_OPT_COALESCE_SENDS,
+ * small sends are coalesced into full TLS records, which are sent when
+ * the buffer is full, before receiving and when closing the connection.
+ * This is only needed to push data out without receiving or closing
+ * afterwards. Without the option, every send is written immediately.
+ *
+ * @param soap The soap structure for the request
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int cgsi_plugin_flush(struct soap *soap);
+
+/* Results of cgsi_accept_step() */
+/** The context is established, the connection can be served */
+#define CGSI_ACCEPT_DONE        0
+/** The handshake goes on once the socket is readable */
+#define CGSI_ACCEPT_WANT_READ   1
+/** The handshake goes on once the socket is writable */
+#define CGSI_ACCEPT_WANT_WRITE  2
+/** The handshake failed, the fault is reported in the soap structure */
+#define CGSI_ACCEPT_ERROR      -1
+
+/**
+ * Runs the server handshake of a connection as far as it can go without
+ * blocking, so that an event loop can drive many handshakes at once and
+ * hand only established connections to its workers.
+ *
+ * After soap_accept(), the loop calls it with fd_ready set to 0 to start
+ * the handshake and learn what to wait for. It then calls it with fd_ready
+ * set to 1 each time the socket is ready for what was asked, until
+ * CGSI_ACCEPT_DONE. The first frecv of the connection then skips the
+ * handshake. The socket is read and written with MSG_DONTWAIT, so it may
+ * stay in blocking mode for the workers. Timeouts are up to the caller,
+ * which gives up on a handshake by closing the connection (soap_closesock()).
+ * Each connection needs its own soap structure, copied with soap_copy()
+ * right after soap_accept().
+ *
+ * @param soap The soap structure of the accepted connection
+ * @param fd_ready 1 if the socket is ready for what the previous call asked, 0 otherwise
+ *
+ * @return One of CGSI_ACCEPT_DONE, CGSI_ACCEPT_WANT_READ, CGSI_ACCEPT_WANT_WRITE, CGSI_ACCEPT_ERROR
+ */
+int cgsi_accept_step(struct soap *soap, int fd_ready);
+
+/* Results of cgsi_connect_start() and cgsi_connect_step(), the same as those of cgsi_accept_step() */
+/** The context is established, the next call to the endpoint uses the connection */
+#define CGSI_CONNECT_DONE       CGSI_ACCEPT_DONE
+/** The handshake goes on once the socket is readable */
+#define CGSI_CONNECT_WANT_READ  CGSI_ACCEPT_WANT_READ
+/** The handshake goes on once the socket is writable */
+#define CGSI_CONNECT_WANT_WRITE CGSI_ACCEPT_WANT_WRITE
+/** The connection or the handshake failed, the fault is reported in the soap structure */
+#define CGSI_CONNECT_ERROR      CGSI_ACCEPT_ERROR
+
+/**
+ * Starts connecting a client to the endpoint without blocking, so that a
+ * thread can run the handshakes with many servers at once. The connection
+ * is polled on soap->socket, and cgsi_connect_step() is called each time
+ * it is ready for what was asked, until CGSI_CONNECT_DONE. The next call
+ * made with the soap structure to the same endpoint then goes over the
+ * connection: soap->keep_alive is set to 1 when the handshake completes,
+ * whether SOAP_IO_KEEPALIVE is set or not, and the caller resets it to
+ * close the connection after that call. The host name is resolved with
+ * getaddrinfo() before returning, which blocks: use
+ * cgsi_connect_start_addr() to connect to an address resolved beforehand
+ * or asynchronously. The soap structure must not have a connection open.
+ *
+ * @param soap The soap structure of the client
+ * @param endpoint The endpoint to connect to
+ *
+ * @return CGSI_CONNECT_WANT_WRITE while connecting, or CGSI_CONNECT_ERROR
+ */
+int cgsi_connect_start(struct soap *soap, const char *endpoint);
+
+/**
+ * Starts connecting a client to the endpoint as cgsi_connect_start() does,
+ * but at the address given, without resolving the host name of the
+ * endpoint. The host name is still the one the server name is checked with.
+ *
+ * @param soap The soap structure of the client
+ * @param endpoint The endpoint to connect to
+ * @param addr The address of the server, port included
+ * @param addrlen The length of the address
+ *
+ * @return CGSI_CONNECT_WANT_WRITE while connecting, or CGSI_CONNECT_ERROR
+ */
+int cgsi_connect_start_addr(struct soap *soap, const char *endpoint,
+                            const struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * Runs the connection and handshake started by cgsi_connect_start() as far
+ * as it can go without blocking. Timeouts are up to the caller, which gives
+ * up on a connection by closing it (soap_closesock()). With
+ * CGSI_OPT_DISABLE_NAME_CHECK, a server address whose name is not cached
+ * is looked up before the handshake, blocking, unless
+ * CGSI_OPT_DEFER_NAME_CHECK is set too.
+ *
+ * @param soap The soap structure of the client
+ * @param fd_ready 1 if the socket is ready for what the previous call asked, 0 otherwise
+ *
+ * @return One of CGSI_CONNECT_DONE, CGSI_CONNECT_WANT_READ, CGSI_CONNECT_WANT_WRITE, CGSI_CONNECT_ERROR
+ */
+int cgsi_connect_step(struct soap *soap, int fd_ready);
+
+/**
+ * Pool of threads running the server handshakes, see cgsi_handshake_pool_create()
+ */
+struct cgsi_handshake_pool;
+
+/**
+ * Queues and counters of a handshake pool. The totals of the times divided
+ * by the number of connections give the average waits, which tell whether
+ * the handshake workers or the request workers should be more.
+ */
+struct cgsi_handshake_pool_stats
+{
+    /** Connections waiting for a handshake worker */
+    unsigned long pending;
+    /** Highest number of connections waiting for a handshake worker */
+    unsigned long pending_max;
+    /** Handshakes in progress */
+    unsigned long running;
+    /** Established connections waiting for a request worker */
+    unsigned long ready;
+    /** Highest number of established connections waiting for a request worker */
+    unsigned long ready_max;
+    /** Connections queued for a handshake */
+    unsigned long submitted;
+    /** Connections refused because the handshake queue was full */
+    unsigned long rejected;
+    /** Handshakes which succeeded */
+    unsigned long established;
+    /** Handshakes which failed, the connection being closed by the pool */
+    unsigned long failed;
+    /** Established connections taken by the request workers */
+    unsigned long served;
+    /** Total seconds the connections waited for a handshake worker */
+    double pending_wait;
+    /** Total seconds the handshake workers spent in handshakes */
+    double handshake_time;
+    /** Total seconds the established connections waited for a request worker */
+    double ready_wait;
+};
+
+/**
+ * Starts a pool of threads running the server handshakes, so that bursts
+ * of handshakes do not hold up the threads serving the requests. The
+ * accept thread copies each accepted connection with soap_copy() and hands
+ * it over with cgsi_handshake_pool_submit(). A worker of the pool runs the
+ * handshake, including the VOMS check and the user mapping if enabled,
+ * then queues the connection for cgsi_handshake_pool_next(), which the
+ * request workers call to get connections ready to be served.
+ *
+ * @param nworkers The number of handshake workers
+ * @param max_pending The number of connections which may wait for a worker
+ *
+ * @return The pool, or NULL if it could not be started
+ */
+struct cgsi_handshake_pool *cgsi_handshake_pool_create(int nworkers, int max_pending);
+
+/**
+ * Queues an accepted connection for its handshake. The pool owns the soap
+ * structure if successful: it closes and frees it (soap_end(), soap_done()
+ * and free()) if the handshake fails, and hands it to a request worker
+ * otherwise. The caller keeps it if the queue is full.
+ *
+ * @param pool The handshake pool
+ * @param soap The soap structure of the connection, copied with soap_copy()
+ *
+ * @return 0 if successful, -1 otherwise with the fault reported in the soap structure
+ */
+int cgsi_handshake_pool_submit(struct cgsi_handshake_pool *pool, struct soap *soap);
+
+/**
+ * Gets a connection whose handshake is done. The caller serves it with
+ * soap_serve() and then frees it as any soap_copy(): soap_destroy(),
+ * soap_end(), soap_done() and free().
+ *
+ * @param pool The handshake pool
+ * @param timeout_ms How long to wait for a connection in milliseconds, forever if negative
+ *
+ * @return The connection, or NULL if none was ready in time
+ */
+struct soap *cgsi_handshake_pool_next(struct cgsi_handshake_pool *pool, int timeout_ms);
+
+/**
+ * Gets a snapshot of the queues and counters of a handshake pool
+ *
+ * @param pool The handshake pool
+ * @param stats Pointer to the structure to fill in
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int cgsi_handshake_pool_get_stats(struct cgsi_handshake_pool *pool, struct cgsi_handshake_pool_stats *stats);
+
+/**
+ * Stops the handshake workers, once their current handshakes are done,
+ * closes the connections still queued and frees the pool. The request
+ * workers must not use the pool anymore.
+ *
+ * @param pool The handshake pool
+ */
+void cgsi_handshake_pool_destroy(struct cgsi_handshake_pool *pool);
+
+/**
+ * Process-wide counters of the plugin
+ */
+struct cgsi_plugin_stats
+{
+    /** Client connections which found a TLS session to resume */
+    unsigned long client_session_hits;
+    /** Client connections which had no TLS session to resume */
+    unsigned long client_session_misses;
+    /** Client connections the server accepted to resume the session of */
+    unsigned long client_session_resumed;
+    /** Server connections which resumed a cached session */
+    unsigned long server_session_resumed;
+    /** Sessions clients asked to resume which were not in the server cache */
+    unsigned long server_session_misses;
+    /** Client connections which found the server name in the reverse lookup cache */
+    unsigned long resolve_cache_hits;
+    /** Client connections which had to look the server name up */
+    unsigned long resolve_cache_misses;
+    /** Records received and unwrapped without allocating them, counted when the connection ends */
+    unsigned long recv_records_in_place;
+    /** Records received into an allocated token, counted when the connection ends */
+    unsigned long recv_records_allocated;
+    /** Records decrypted by SSL straight into gSOAP's buffer (CGSI_OPT_DIRECT_DECRYPT),
+        counted when the connection ends */
+    unsigned long recv_records_direct;
+    /** Records wrapped into a token allocated by GSSAPI, counted when the connection ends */
+    unsigned long send_records_allocated;
+    /** Lookups of the plugin data by name, which the reads and writes normally do without,
+        counted when the connection ends */
+    unsigned long plugin_lookups_by_name;
+    /** Calls of gss_init_sec_context() made under the handshake lock */
+    unsigned long gss_lock_acquired;
+    /** Of those, calls which had to wait for another thread */
+    unsigned long gss_lock_contended;
+};
+
+/**
+ * Gets a snapshot of the process-wide counters of the plugin
+ *
+ * @param stats Pointer to the structure to fill in
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int cgsi_plugin_get_stats(struct cgsi_plugin_stats *stats);
+
 /**
  * Parses the optional VOMS extension of the peer certificate.
  * It has to be called before get_client_voname() and get_client_roles()!
@@ -288,6 +616,24 @@ int cgsi_plugin_get_flags(struct soap *soap, int is_server);
  */
 int cgsi_plugin_set_credentials(struct soap *soap, int is_server, const char* x509_cert, const char* x509_key);
 
+/**
+ * Set the cipher policy of the SSL contexts. The order of the list is
+ * the order of preference, which a server enforces over the client's one,
+ * so that e.g. hardware accelerated AEAD suites can be put first.
+ * The SSL context is configured once, when the credentials are loaded.
+ *
+ * @param soap The soap structure for the request
+ * @param is_server 0 if client, 1 if server
+ * @param cipher_list OpenSSL cipher list for TLSv1.2 and below. If NULL,
+ *                    servers use the OpenSSL default without the LOW
+ *                    cipher suites, and clients the OpenSSL default.
+ * @param ciphersuites OpenSSL TLSv1.3 ciphersuites. If NULL, the OpenSSL
+ *                     default is used.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cgsi_plugin_set_ciphers(struct soap *soap, int is_server, const char *cipher_list, const char *ciphersuites);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,9 @@
 #include <globus_gss_assist.h>
 #include <cgsi_plugin.h>
 #include <stdsoap2.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <netdb.h>
 
 #define CGSI_TRACE "CGSI_TRACE"
 #define CGSI_TRACEFILE "CGSI_TRACEFILE"
@@ -39,10 +42,238 @@
 
 #define CGSI_MAXNAMELEN 512
 
+/* Maximum number of files a cached credential can depend on */
+#define CGSI_CRED_MAXFILES 8
+
+/* Identity of a file a cached credential has been loaded from */
+struct cgsi_cred_file
+{
+    char path[CGSI_MAXNAMELEN];
+    int present;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+};
+
+/* Reference counted credential, shared by all the connections of the process */
+struct cgsi_cred_entry
+{
+    gss_cred_usage_t usage;
+    int imported;
+    gss_cred_id_t credential_handle;
+    gss_name_t name_handle;
+    char name[CGSI_MAXNAMELEN];
+    char *cipher_list;
+    char *ciphersuites;
+    time_t expires;
+    int nfiles;
+    struct cgsi_cred_file files[CGSI_CRED_MAXFILES];
+    int refcount;
+    struct cgsi_cred_entry *next;
+};
+
+/* Bloom filter of the gridmap index: bits per hash bucket and hash functions */
+#define CGSI_GRIDMAP_BLOOM_BITS 16
+#define CGSI_GRIDMAP_BLOOM_HASHES 4
+
+/* Gridmap line mapping a DN without wildcard */
+struct cgsi_gridmap_entry
+{
+    char *dn;
+    char *username;
+    unsigned int hash;
+    int line;
+    struct cgsi_gridmap_entry *next;
+};
+
+/* Gridmap line with a wildcard, rest is the pattern after the literal prefix */
+struct cgsi_gridmap_pattern
+{
+    char *rest;
+    char *username;
+    int line;
+    struct cgsi_gridmap_pattern *next;
+};
+
+/* Node of the trie of the literal prefixes of the wildcard lines */
+struct cgsi_gridmap_node
+{
+    unsigned char c;
+    struct cgsi_gridmap_node *child;
+    struct cgsi_gridmap_node *sibling;
+    struct cgsi_gridmap_pattern *patterns;
+};
+
+/* Reference counted index of a gridmap file, keyed on normalized DNs */
+struct cgsi_gridmap
+{
+    struct cgsi_cred_file file;
+    unsigned int nbuckets;
+    struct cgsi_gridmap_entry **buckets;
+    int nentries;
+    unsigned int bloom_bits;
+    unsigned char *bloom;
+    struct cgsi_gridmap_node *trie;
+    int npatterns;
+    int refcount;
+};
+
+/* Number of hash buckets and maximum number of entries of the VOMS cache */
+#define CGSI_VOMS_CACHE_BUCKETS 1024
+#define CGSI_VOMS_CACHE_SIZE 8192
+
+/* Length of the digest of a certificate chain (SHA-256) */
+#define CGSI_CHAIN_DIGEST_LEN 32
+
+/* CA and VOMS attributes of a peer, keyed by the digest of its certificate chain */
+struct cgsi_voms_entry
+{
+    unsigned char digest[CGSI_CHAIN_DIGEST_LEN];
+    int voms_checked;
+    char user_ca[CGSI_MAXNAMELEN];
+    char *voname;
+    char **fqan;
+    int nbfqan;
+    time_t expires;
+    struct cgsi_voms_entry *next;
+};
+
+/* Maximum number of endpoints the client keeps a TLS session for */
+#define CGSI_SESSION_CACHE_SIZE 64
+
+/* TLS session of the client, keyed by endpoint and client identity */
+struct cgsi_session_entry
+{
+    char host[CGSI_MAXNAMELEN];
+    int port;
+    char identity[CGSI_MAXNAMELEN];
+    SSL_SESSION *session;
+    int disabled;
+    struct cgsi_session_entry *next;
+};
+
+/* Largest plaintext of a TLS record, the size the sends are coalesced up to
+   with CGSI_OPT_COALESCE_SENDS */
+#define CGSI_SEND_BUFSIZE 16384
+/* Number of records of a large send wrapped and written together */
+#define CGSI_SEND_IOV 16
+
+/* Size of the buffer the socket is read into, room for several records */
+#define CGSI_READ_AHEAD_SIZE 65536
+
+/* Lifetime of the reverse lookups and imported names of the servers */
+#define CGSI_RESOLVE_TTL 300
+#define CGSI_RESOLVE_CACHE_SIZE 256
+/* Maximum number of reverse lookups running in threads of their own */
+#define CGSI_RESOLVE_MAX_THREADS 8
+/* Room for "host@" followed by a host name */
+#define CGSI_MAXHOSTLEN (NI_MAXHOST + 5)
+
+/* Canonical name of a server address, as found by reverse lookup */
+struct cgsi_resolve_entry
+{
+    int family;
+    unsigned char addr[16];
+    char host[CGSI_MAXHOSTLEN];
+    time_t expires;
+    int refreshing;
+    struct cgsi_resolve_entry *next;
+};
+
+/* Target name imported for a "host@name" service name */
+struct cgsi_name_entry
+{
+    char service[CGSI_MAXHOSTLEN];
+    gss_name_t name;
+    time_t expires;
+    struct cgsi_name_entry *next;
+};
+
+/* Reverse lookup running in its own thread. It is freed by the thread
+   if nobody waits for it anymore when it completes, else by the waiter */
+struct cgsi_resolve_job
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int abandoned;
+    struct sockaddr_storage sa;
+    socklen_t sa_length;
+    char host[CGSI_MAXHOSTLEN];
+    const char *error;
+};
+
+/* Steps of a handshake driven by cgsi_accept_step() or cgsi_connect_step() */
+#define CGSI_STEP_IDLE       0  /* no handshake in progress */
+#define CGSI_STEP_READING    1  /* waiting for a token of the peer */
+#define CGSI_STEP_WRITING    2  /* sending a token, more are expected */
+#define CGSI_STEP_FLUSHING   3  /* sending the last token */
+#define CGSI_STEP_CONNECTING 4  /* waiting for the connection to the server */
+
+/* Connection queued in a handshake pool, with the time it was queued at */
+struct cgsi_handshake_item
+{
+    struct soap *soap;
+    struct timespec queued;
+    struct cgsi_handshake_item *next;
+};
+
+/* Handshake workers, with the connections waiting for them and those they established */
+struct cgsi_handshake_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t pending_cond;
+    pthread_cond_t ready_cond;
+    int stopping;
+    int nworkers;
+    pthread_t *workers;
+    unsigned long max_pending;
+    struct cgsi_handshake_item *pending_head;
+    struct cgsi_handshake_item *pending_tail;
+    struct cgsi_handshake_item *ready_head;
+    struct cgsi_handshake_item *ready_tail;
+    struct cgsi_handshake_pool_stats stats;
+};
+
+/* Lifetime of the TLS sessions the server lets clients resume */
+#define CGSI_SESSION_TIMEOUT 300
+/* Room for the serialized session and the FQANs of a cached server session */
+#define CGSI_SESSION_DER_LEN 6144
+#define CGSI_SESSION_FQANS_LEN 2048
+
+/* TLS session of the server and attributes of the peer it authenticated.
+   Only holds plain data, as the cache may be in memory shared between processes */
+struct cgsi_server_session
+{
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int id_len;
+    time_t expires;
+    int attrs;
+    char client_name[CGSI_MAXNAMELEN];
+    char user_ca[CGSI_MAXNAMELEN];
+    char voname[CGSI_MAXNAMELEN];
+    int has_voname;
+    int nbfqan;
+    char fqans[CGSI_SESSION_FQANS_LEN];
+    unsigned int der_len;
+    unsigned char der[CGSI_SESSION_DER_LEN];
+};
+
+/* Direct-mapped cache of the server sessions, keyed by session ID */
+struct cgsi_server_session_cache
+{
+    pthread_mutex_t lock;
+    int shared;
+    size_t nslots;
+    struct cgsi_server_session slots[1];
+};
+
 struct cgsi_plugin_data
 {
     int context_established;
     gss_cred_id_t credential_handle;
+    struct cgsi_cred_entry *cred_entry;
     gss_ctx_id_t  context_handle;
     int socket_fd;
     int (*fsend)(struct soap*, const char*, size_t);
@@ -51,6 +282,9 @@ struct cgsi_plugin_data
     int (*fclose)(struct soap*);
     char client_name[CGSI_MAXNAMELEN];
     char server_name[CGSI_MAXNAMELEN];
+    char endpoint_host[CGSI_MAXNAMELEN];
+    int endpoint_port;
+    int session_offered;
     char username[CGSI_MAXNAMELEN];
     char user_ca[CGSI_MAXNAMELEN];
     int nb_iter;
@@ -60,18 +294,63 @@ struct cgsi_plugin_data
     char trace_file[CGSI_MAXNAMELEN];
     gss_cred_id_t deleg_credential_handle;
     int deleg_cred_set;
-    gss_buffer_t buffered_in;
+    /* Unwrapped record partly returned to gSOAP, and how much of it was */
+    gss_buffer_desc buffered_in;
+    size_t buffered_offset;
+    /* Plaintext of the last record left in the SSL object of the context */
+    int unwrap_pending;
+    /* Bytes read from the socket and not parsed into records yet */
+    char *read_buf;
+    size_t read_start;
+    size_t read_end;
+    /* Records and lookups by name of the connection, added to the
+       process-wide counters when it ends */
+    unsigned long recv_in_place;
+    unsigned long recv_allocated;
+    unsigned long recv_direct;
+    unsigned long send_allocated;
+    unsigned long lookups_by_name;
+    /* Plaintext waiting to be wrapped into full TLS records */
+    char *send_buf;
+    size_t send_len;
+    /* Handshake in progress, kept between the calls of cgsi_accept_step()
+       or cgsi_connect_step() */
+    int step_state;
+    gss_buffer_desc step_out;
+    size_t step_out_offset;
+    OM_uint32 accept_flags;
+    gss_name_t accept_client;
+    gss_cred_id_t accept_deleg;
+    gss_name_t connect_target;
+    struct cgsi_resolve_job *connect_resolve;
+    struct addrinfo *connect_addrs;
+    struct addrinfo *connect_next;
+    /* Address passed to cgsi_connect_start_addr(), not resolved */
+    struct addrinfo connect_ai;
+    struct sockaddr_storage connect_sa;
     /* API-defined credentials */
     char* x509_cert;
     char* x509_key;
+    /* API-defined cipher policy */
+    char *cipher_list;
+    char *ciphersuites;
     /* Pointers to VOMS data */
     char *voname;
     char **fqan;
     int nbfqan;
     int disable_mapping;
     int disable_voms_check;
+    int lazy_voms_check;
+    int defer_name_check;
+    int coalesce_sends;
+    int direct_decrypt;
+    /* Whether the GSS context was found to have the layout the records
+       are decrypted directly with: 0 not checked yet, 1 yes, -1 no */
+    int direct_layout;
+    int attrs_retrieved;
     int allow_only_self;
     int had_send_error;
+    int had_recv_error;
     void *deleg_credential_token;
     size_t deleg_credential_token_len;
     int start_new_line;
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Wrap/unwrap throughput of the GSI security context for each cipher suite.
+ *
+ * The context is established in memory between a client using the proxy
+ * (X509_USER_PROXY) and a server using the host certificate (X509_USER_CERT
+ * and X509_USER_KEY), then records are wrapped by one side and unwrapped
+ * by the other, as cgsi_plugin_send() and cgsi_plugin_recv() do.
+ *
+ * The TLSv1.3 suites (TLS_*) are set with SSL_CTX_set_ciphersuites(), the
+ * others with SSL_CTX_set_cipher_list() and the server limited to TLSv1.2,
+ * as TLSv1.3 would otherwise be negotiated with its default suite whatever
+ * the cipher list. The suite actually negotiated is printed for each run.
+ *
+ * Usage: cgsi-gsoap-cipher-bench [-s SIZE] [-n COUNT] [CIPHER ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <globus_gss_assist.h>
+#include "gssapi_openssl.h"
+
+static const char *default_ciphers[] = {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    "TLS_AES_128_GCM_SHA256",
+    "TLS_AES_256_GCM_SHA384",
+    "TLS_CHACHA20_POLY1305_SHA256",
+#endif
+    "ECDHE-RSA-AES128-GCM-SHA256",
+    "ECDHE-RSA-AES256-GCM-SHA384",
+    "ECDHE-RSA-CHACHA20-POLY1305",
+    "AES128-GCM-SHA256",
+    "AES256-SHA256",
+    "AES128-SHA",
+    NULL
+};
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void gss_fail(const char *msg, OM_uint32 maj_stat, OM_uint32 min_stat) {
+    OM_uint32 tmp_stat, msg_ctx = 0;
+    gss_buffer_desc status = GSS_C_EMPTY_BUFFER;
+
+    fprintf(stderr, "ERROR: %s\n", msg);
+    do {
+        gss_display_status(&tmp_stat, min_stat, GSS_C_MECH_CODE, GSS_C_NULL_OID,
+                           &msg_ctx, &status);
+        fprintf(stderr, "  %s\n", (char *)status.value);
+        gss_release_buffer(&tmp_stat, &status);
+    } while (msg_ctx);
+    exit(EXIT_FAILURE);
+}
+
+/* Runs the handshake in memory, passing the tokens from one side to the other */
+static void establish(gss_cred_id_t client_cred, gss_cred_id_t server_cred,
+                      gss_ctx_id_t *client_ctx, gss_ctx_id_t *server_ctx) {
+    OM_uint32 maj_stat, min_stat, tmp_stat, ret_flags;
+    OM_uint32 client_stat = GSS_S_CONTINUE_NEEDED, server_stat = GSS_S_CONTINUE_NEEDED;
+    gss_buffer_desc to_server = GSS_C_EMPTY_BUFFER, to_client = GSS_C_EMPTY_BUFFER;
+
+    while (client_stat == GSS_S_CONTINUE_NEEDED || server_stat == GSS_S_CONTINUE_NEEDED) {
+        if (client_stat == GSS_S_CONTINUE_NEEDED) {
+            maj_stat = gss_init_sec_context(&min_stat, client_cred, client_ctx,
+                GSS_C_NO_NAME, GSS_C_NO_OID,
+                GSS_C_CONF_FLAG | GSS_C_MUTUAL_FLAG | GSS_C_INTEG_FLAG | GSS_C_GLOBUS_SSL_COMPATIBLE,
+                0, GSS_C_NO_CHANNEL_BINDINGS, &to_client, NULL, &to_server, &ret_flags, NULL);
+            gss_release_buffer(&tmp_stat, &to_client);
+            if (GSS_ERROR(maj_stat))
+                gss_fail("gss_init_sec_context failed", maj_stat, min_stat);
+            client_stat = maj_stat;
+        }
+        if (server_stat == GSS_S_CONTINUE_NEEDED && to_server.length > 0) {
+            maj_stat = gss_accept_sec_context(&min_stat, server_ctx, server_cred,
+                &to_server, GSS_C_NO_CHANNEL_BINDINGS, NULL, NULL, &to_client,
+                &ret_flags, NULL, NULL);
+            gss_release_buffer(&tmp_stat, &to_server);
+            if (GSS_ERROR(maj_stat))
+                gss_fail("gss_accept_sec_context failed", maj_stat, min_stat);
+            server_stat = maj_stat;
+        }
+    }
+    gss_release_buffer(&tmp_stat, &to_server);
+    gss_release_buffer(&tmp_stat, &to_client);
+}
+
+static void bench(const char *cipher, gss_cred_id_t client_cred, size_t size, int count) {
+    OM_uint32 maj_stat, min_stat, tmp_stat;
+    gss_cred_id_t server_cred = GSS_C_NO_CREDENTIAL;
+    gss_ctx_id_t client_ctx = GSS_C_NO_CONTEXT, server_ctx = GSS_C_NO_CONTEXT;
+    gss_buffer_desc in, *wrapped;
+    gss_buffer_desc out = GSS_C_EMPTY_BUFFER;
+    double start, t_handshake, t_wrap, t_unwrap;
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    int supported, i;
+
+    /* a fresh SSL context for each suite */
+    maj_stat = gss_acquire_cred(&min_stat, GSS_C_NO_NAME, 0, GSS_C_NULL_OID_SET,
+                                GSS_C_ACCEPT, &server_cred, NULL, NULL);
+    if (maj_stat != GSS_S_COMPLETE)
+        gss_fail("could not load the server credentials", maj_stat, min_stat);
+
+    ssl_ctx = ((gss_cred_id_desc *)server_cred)->ssl_context;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (!strncmp(cipher, "TLS_", 4)) {
+        supported = SSL_CTX_set_ciphersuites(ssl_ctx, cipher);
+    } else {
+        supported = SSL_CTX_set_cipher_list(ssl_ctx, cipher) &&
+                    SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION);
+    }
+#else
+    supported = SSL_CTX_set_cipher_list(ssl_ctx, cipher);
+#endif
+    if (!supported) {
+        fprintf(stdout, "%-32s not supported\n", cipher);
+        gss_release_cred(&tmp_stat, &server_cred);
+        return;
+    }
+
+    start = now();
+    establish(client_cred, server_cred, &client_ctx, &server_ctx);
+    t_handshake = now() - start;
+
+    in.length = size;
+    in.value = malloc(size);
+    wrapped = calloc(count, sizeof(gss_buffer_desc));
+    if (in.value == NULL || wrapped == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(in.value, 'x', size);
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        maj_stat = gss_wrap(&min_stat, client_ctx, 0, GSS_C_QOP_DEFAULT, &in, NULL, &wrapped[i]);
+        if (maj_stat != GSS_S_COMPLETE)
+            gss_fail("gss_wrap failed", maj_stat, min_stat);
+    }
+    t_wrap = now() - start;
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        maj_stat = gss_unwrap(&min_stat, server_ctx, &wrapped[i], &out, NULL, NULL);
+        if (maj_stat != GSS_S_COMPLETE || out.length != size)
+            gss_fail("gss_unwrap failed", maj_stat, min_stat);
+        gss_release_buffer(&tmp_stat, &out);
+    }
+    t_unwrap = now() - start;
+
+    ssl = ((gss_ctx_id_desc *)client_ctx)->gss_ssl;
+    if (strcmp(cipher, SSL_get_cipher_name(ssl)))
+        fprintf(stderr, "WARNING: %s requested, %s negotiated\n", cipher, SSL_get_cipher_name(ssl));
+    fprintf(stdout, "%-32s %-8s handshake %7.2f ms  wrap %9.1f MB/s  unwrap %9.1f MB/s\n",
+        SSL_get_cipher_name(ssl), SSL_get_version(ssl),
+        t_handshake * 1e3,
+        (double)size * count / t_wrap / 1e6,
+        (double)size * count / t_unwrap / 1e6);
+    fflush(stdout);
+
+    for (i = 0; i < count; i++)
+        gss_release_buffer(&tmp_stat, &wrapped[i]);
+    free(wrapped);
+    free(in.value);
+    gss_delete_sec_context(&tmp_stat, &client_ctx, GSS_C_NO_BUFFER);
+    gss_delete_sec_context(&tmp_stat, &server_ctx, GSS_C_NO_BUFFER);
+    gss_release_cred(&tmp_stat, &server_cred);
+}
+
+int main(int argc, char **argv) {
+    OM_uint32 maj_stat, min_stat, tmp_stat;
+    gss_cred_id_t client_cred = GSS_C_NO_CREDENTIAL;
+    size_t size = 16384;
+    int count = 10000;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "s:n:")) != -1) switch (c) {
+        case 's':
+            size = atol(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s SIZE] [-n COUNT] [CIPHER ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+
+    globus_module_activate(GLOBUS_GSI_GSSAPI_MODULE);
+
+    maj_stat = gss_acquire_cred(&min_stat, GSS_C_NO_NAME, 0, GSS_C_NULL_OID_SET,
+                                GSS_C_INITIATE, &client_cred, NULL, NULL);
+    if (maj_stat != GSS_S_COMPLETE)
+        gss_fail("could not load the client credentials", maj_stat, min_stat);
+
+    fprintf(stdout, "INFO: %d records of %lu bytes per cipher suite\n", count, (unsigned long)size);
+
+    if (optind < argc) {
+        for (i = optind; i < argc; i++)
+            bench(argv[i], client_cred, size, count);
+    } else {
+        for (i = 0; default_ciphers[i] != NULL; i++)
+            bench(default_ciphers[i], client_cred, size, count);
+    }
+
+    gss_release_cred(&tmp_stat, &client_cred);
+    globus_module_deactivate(GLOBUS_GSI_GSSAPI_MODULE);
+    return EXIT_SUCCESS;
+}
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include "cgsi_plugin.h"
 #include "cgsi_gsoap_testH.h"
 #include "cgsi_gsoap_test.nsmap"
@@ -85,6 +86,47 @@ char *getAttributes(struct soap *psoap, const char *endpoint) {
     return strdup(get_resp.getAttributesReturn);
 }
 
+/* Echoes payloads of the given size, reporting the throughput */
+void echo_bench(struct soap *psoap, const char *endpoint, size_t size, int count) {
+    int ret, i;
+    char *payload;
+    struct timeval start, end;
+    double elapsed;
+    struct cgsi_USCOREgsoap_USCOREtest__echoResponse echo_resp;
+
+    payload = malloc(size + 1);
+    if (payload == NULL) {
+        printf("ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < size; i++)
+        payload[i] = 'a' + i % 26;
+    payload[size] = '\0';
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; i++) {
+        ret = soap_call_cgsi_USCOREgsoap_USCOREtest__echo(psoap,
+            endpoint, NULL, payload, &echo_resp);
+
+        if ( SOAP_OK != ret ) {
+            printf("ERROR: gSOAP error\n");
+            soap_print_fault(psoap, stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (echo_resp.echoReturn == NULL || strcmp(echo_resp.echoReturn, payload)) {
+            printf("ERROR: the payload echoed differs\n");
+            exit(EXIT_FAILURE);
+        }
+        soap_end(psoap);
+    }
+    gettimeofday(&end, NULL);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("INFO: echoed %d payloads of %lu bytes in %.3f s, %.1f MB/s\n",
+        count, (unsigned long)size, elapsed, 2.0 * size * count / elapsed / 1e6);
+    free(payload);
+}
+
 void test_destroy(struct soap *psoap) {
     soap_destroy(psoap);
     soap_end(psoap);
@@ -94,12 +136,20 @@ void test_destroy(struct soap *psoap) {
 
 int main(int argc, char **argv) {
     struct soap *psoap;
+    struct cgsi_plugin_stats stats;
     char *attributes = NULL;
+    char *first = NULL;
     char *endpoint = "https://localhost:8111/cgsi-gsoap-test";
     int i, delegate=0, namecheck=0, allow_only_self=0;
+    size_t echo_size=0;
+    int echo_count=1;
+    int repeat=1;
 
-    for(i=0;i<argc;i++) {
+    for(i=1;i<argc;i++) {
       if (!strcmp(argv[i],"-d")) delegate++;
+      else if (!strcmp(argv[i],"-b") && i+1<argc) echo_size = atol(argv[++i]);
+      else if (!strcmp(argv[i],"-c") && i+1<argc) echo_count = atoi(argv[++i]);
+      else if (!strcmp(argv[i],"-r") && i+1<argc) repeat = atoi(argv[++i]);
       else if (!strcmp(argv[i],"-n")) namecheck++;
       else if (!strcmp(argv[i],"-l")) allow_only_self++;
       else endpoint = argv[i];
@@ -121,11 +171,34 @@ int main(int argc, char **argv) {
 
     psoap = test_setup(endpoint,delegate,namecheck,allow_only_self);
 
-    attributes = getAttributes(psoap, endpoint);
-    if (attributes) {
+    if (echo_size > 0) {
+      echo_bench(psoap, endpoint, echo_size, echo_count);
+      test_destroy(psoap);
+      return EXIT_SUCCESS;
+    }
+
+    /* Each call makes a new connection, the following ones resuming
+       the TLS session of the first if the server lets them */
+    for (i = 0; i < repeat; i++) {
+      attributes = getAttributes(psoap, endpoint);
       printf("Server responded: %s\n", attributes);
-      free(attributes);
-      attributes = NULL;
+      if (first == NULL) {
+        first = attributes;
+      } else {
+        if (strcmp(first, attributes)) {
+          printf("ERROR: the server saw different attributes on connection %d\n", i + 1);
+          exit(EXIT_FAILURE);
+        }
+        free(attributes);
+      }
+      soap_end(psoap);
+    }
+    free(first);
+
+    if (repeat > 1) {
+      cgsi_plugin_get_stats(&stats);
+      printf("INFO: %lu of %d connections resumed their TLS session\n",
+        stats.client_session_resumed, repeat);
     }
 
     test_destroy(psoap);
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Wall-clock time of the handshakes of a client with several servers, one
+ * after the other, then all at once from a single thread with
+ * cgsi_connect_start_addr() and cgsi_connect_step(), the addresses of the
+ * servers being resolved beforehand so that nothing blocks the thread.
+ *
+ * The process runs the servers, each in its own thread with the host
+ * certificate (X509_USER_CERT and X509_USER_KEY), and the client with the
+ * proxy (X509_USER_PROXY). The servers wait DELAY milliseconds before
+ * handling each token of the client, standing for the round trips to
+ * remote endpoints.
+ *
+ * Usage: cgsi-gsoap-fanout [-n SERVERS] [-p PORT] [-d DELAY] [-r ROUNDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include "cgsi_plugin.h"
+
+struct Namespace namespaces[] = { { NULL } };
+
+/* Address of a server, resolved once */
+struct address {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+static int delay = 10;
+static volatile int running = 1;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Accepts connections and runs their handshake, until the server socket is closed */
+static void *server_thread(void *arg) {
+    struct soap *psoap = (struct soap *)arg;
+    struct pollfd pfd;
+    int ret;
+
+    while (running) {
+        if (!soap_valid_socket(soap_accept(psoap)))
+            continue;
+        ret = cgsi_accept_step(psoap, 0);
+        while (ret == CGSI_ACCEPT_WANT_READ || ret == CGSI_ACCEPT_WANT_WRITE) {
+            pfd.fd = psoap->socket;
+            pfd.events = ret == CGSI_ACCEPT_WANT_READ ? POLLIN : POLLOUT;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 5000) <= 0)
+                break;
+            if (ret == CGSI_ACCEPT_WANT_READ)
+                usleep(delay * 1000);
+            ret = cgsi_accept_step(psoap, 1);
+        }
+        if (ret != CGSI_ACCEPT_DONE)
+            soap_print_fault(psoap, stderr);
+        soap_closesock(psoap);
+        soap_end(psoap);
+    }
+    return NULL;
+}
+
+static void resolve(struct address *address, int port) {
+    struct addrinfo hints, *res;
+    char service[16];
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    ret = getaddrinfo("localhost", service, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: could not resolve localhost: %s\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&address->addr, res->ai_addr, res->ai_addrlen);
+    address->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+static void disconnect(struct soap *psoap) {
+    psoap->keep_alive = 0;
+    soap_closesock(psoap);
+    soap_end(psoap);
+}
+
+/* Connects to one server, waiting for each step */
+static void connect_one(struct soap *psoap, const char *endpoint) {
+    struct pollfd pfd;
+    int ret;
+
+    ret = cgsi_connect_start(psoap, endpoint);
+    while (ret == CGSI_CONNECT_WANT_READ || ret == CGSI_CONNECT_WANT_WRITE) {
+        pfd.fd = psoap->socket;
+        pfd.events = ret == CGSI_CONNECT_WANT_READ ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 5000) <= 0) {
+            fprintf(stderr, "ERROR: Timeout connecting to %s\n", endpoint);
+            exit(EXIT_FAILURE);
+        }
+        ret = cgsi_connect_step(psoap, 1);
+    }
+    if (ret != CGSI_CONNECT_DONE) {
+        soap_print_fault(psoap, stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static double serial(struct soap **clients, char **endpoints, int n) {
+    double start = now();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        connect_one(clients[i], endpoints[i]);
+        disconnect(clients[i]);
+    }
+    return now() - start;
+}
+
+/* Connects to all the servers at once, stepping the connections which are ready */
+static double parallel(struct soap **clients, char **endpoints, struct address *addresses, int n) {
+    struct pollfd *pfds;
+    double start = now(), elapsed;
+    int i, ret, pending = n;
+
+    pfds = calloc(n, sizeof(struct pollfd));
+    if (pfds == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+        ret = cgsi_connect_start_addr(clients[i], endpoints[i], (struct sockaddr *)&addresses[i].addr,
+                                      addresses[i].addrlen);
+        if (ret == CGSI_CONNECT_ERROR) {
+            soap_print_fault(clients[i], stderr);
+            exit(EXIT_FAILURE);
+        }
+        pfds[i].fd = clients[i]->socket;
+        pfds[i].events = ret == CGSI_CONNECT_WANT_READ ? POLLIN : POLLOUT;
+    }
+
+    while (pending > 0) {
+        if (poll(pfds, n, 5000) <= 0) {
+            fprintf(stderr, "ERROR: Timeout connecting to the servers\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+            pfds[i].revents = 0;
+            ret = cgsi_connect_step(clients[i], 1);
+            if (ret == CGSI_CONNECT_ERROR) {
+                soap_print_fault(clients[i], stderr);
+                exit(EXIT_FAILURE);
+            }
+            if (ret == CGSI_CONNECT_DONE) {
+                pfds[i].fd = -1;
+                pending--;
+            } else {
+                /* the socket may have changed if an address failed */
+                pfds[i].fd = clients[i]->socket;
+                pfds[i].events = ret == CGSI_CONNECT_WANT_READ ? POLLIN : POLLOUT;
+            }
+        }
+    }
+    elapsed = now() - start;
+
+    for (i = 0; i < n; i++)
+        disconnect(clients[i]);
+    free(pfds);
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    struct soap **servers, **clients;
+    pthread_t *threads;
+    char **endpoints;
+    struct address *addresses;
+    double t_serial = 0, t_parallel = 0;
+    int c, i, n = 16, port = 8120, rounds = 3;
+
+    while ((c = getopt(argc, argv, "n:p:d:r:")) != -1) switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'd':
+            delay = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n SERVERS] [-p PORT] [-d DELAY] [-r ROUNDS]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+    if (n <= 0 || rounds <= 0) {
+        fprintf(stderr, "ERROR: The number of servers and rounds must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    servers = calloc(n, sizeof(struct soap *));
+    clients = calloc(n, sizeof(struct soap *));
+    threads = calloc(n, sizeof(pthread_t));
+    endpoints = calloc(n, sizeof(char *));
+    addresses = calloc(n, sizeof(struct address));
+    if (servers == NULL || clients == NULL || threads == NULL || endpoints == NULL || addresses == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+        servers[i] = soap_new();
+        if (servers[i] == NULL || soap_cgsi_init(servers[i], CGSI_OPT_SERVER | CGSI_OPT_DISABLE_MAPPING |
+                                                             CGSI_OPT_DISABLE_VOMS_CHECK)) {
+            fprintf(stderr, "ERROR: Failed to initialize the server\n");
+            exit(EXIT_FAILURE);
+        }
+        servers[i]->accept_timeout = 1;
+        servers[i]->recv_timeout = 5;
+        servers[i]->send_timeout = 5;
+        if (!soap_valid_socket(soap_bind(servers[i], "localhost", port + i, 100))) {
+            soap_print_fault(servers[i], stderr);
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&threads[i], NULL, server_thread, servers[i]);
+
+        clients[i] = soap_new();
+        if (clients[i] == NULL || soap_cgsi_init(clients[i], CGSI_OPT_DISABLE_NAME_CHECK | CGSI_OPT_DEFER_NAME_CHECK)) {
+            fprintf(stderr, "ERROR: Failed to initialize the client\n");
+            exit(EXIT_FAILURE);
+        }
+        endpoints[i] = malloc(64);
+        if (endpoints[i] == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(endpoints[i], 64, "httpg://localhost:%d/", port + i);
+        resolve(&addresses[i], port + i);
+    }
+
+    for (i = 0; i < rounds; i++) {
+        t_serial += serial(clients, endpoints, n);
+        t_parallel += parallel(clients, endpoints, addresses, n);
+    }
+
+    fprintf(stdout, "%8s  %8s  %10s  %10s  %8s\n", "servers", "delay", "serial", "parallel", "speedup");
+    fprintf(stdout, "%8d  %6dms  %9.3fs  %9.3fs  %7.1fx\n", n, delay,
+            t_serial / rounds, t_parallel / rounds, t_serial / t_parallel);
+
+    running = 0;
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        soap_done(servers[i]);
+        free(servers[i]);
+        soap_done(clients[i]);
+        free(clients[i]);
+        free(endpoints[i]);
+    }
+    free(endpoints);
+    free(addresses);
+    free(threads);
+    free(clients);
+    free(servers);
+    return EXIT_SUCCESS;
+}
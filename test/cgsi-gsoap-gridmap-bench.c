@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Gridmap lookups per second of cgsi_plugin_map_dn() and
+ * globus_gss_assist_gridmap(), for generated gridmap files of
+ * increasing size.
+ *
+ * Usage: cgsi-gsoap-gridmap-bench [-t SECONDS] [ENTRIES ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <globus_gss_assist.h>
+#include "cgsi_plugin.h"
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void make_dn(char *buf, size_t len, int i) {
+    snprintf(buf, len, "/DC=ch/DC=cern/OU=Organic Units/OU=Users/CN=user%d/CN=%d/CN=User Number %d",
+             i, 100000 + i, i);
+}
+
+/* Writes a gridmap file of the given number of lines, a few of them with wildcards */
+static void make_gridmap(const char *path, int entries) {
+    char dn[256];
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < entries; i++) {
+        if (i % 1000 == 999)
+            fprintf(fp, "\"/DC=org/DC=example/OU=Robots/CN=robot%d*\" robot\n", i);
+        make_dn(dn, sizeof(dn), i);
+        fprintf(fp, "\"%s\" user%d,group%d\n", dn, i, i % 10);
+    }
+    fclose(fp);
+}
+
+static int cgsi_lookup(const char *dn) {
+    char username[256];
+    return cgsi_plugin_map_dn(dn, username, sizeof(username));
+}
+
+static int globus_lookup(const char *dn) {
+    char *username = NULL;
+    if (globus_gss_assist_gridmap((char *)dn, &username))
+        return -1;
+    free(username);
+    return 0;
+}
+
+/* Runs lookups of mapped DNs (or unknown ones) for the given duration */
+static double rate(int (*lookup)(const char *), int entries, int hit, double duration) {
+    char dn[256];
+    double start, elapsed;
+    long n = 0;
+
+    start = now();
+    do {
+        if (hit) {
+            make_dn(dn, sizeof(dn), (int)((n * 7919) % entries));
+            if (lookup(dn) != 0) {
+                fprintf(stderr, "ERROR: %s not mapped\n", dn);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            make_dn(dn, sizeof(dn), entries + (int)n);
+            if (lookup(dn) == 0) {
+                fprintf(stderr, "ERROR: %s mapped\n", dn);
+                exit(EXIT_FAILURE);
+            }
+        }
+        n++;
+        elapsed = now() - start;
+    } while (elapsed < duration);
+
+    return n / elapsed;
+}
+
+int main(int argc, char **argv) {
+    static const int default_sizes[] = { 1000, 10000, 100000, 0 };
+    char path[] = "/tmp/cgsi-gridmap-bench-XXXXXX";
+    double duration = 1.0;
+    int c, i, fd, entries;
+
+    while ((c = getopt(argc, argv, "t:")) != -1) switch (c) {
+        case 't':
+            duration = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t SECONDS] [ENTRIES ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    setenv("GRIDMAP", path, 1);
+
+    globus_module_activate(GLOBUS_GSI_GSS_ASSIST_MODULE);
+
+    fprintf(stdout, "%8s  %14s %14s  %14s %14s\n", "entries",
+            "cgsi hit/s", "cgsi miss/s", "globus hit/s", "globus miss/s");
+    for (i = 0; optind + i < argc || (optind == argc && default_sizes[i]); i++) {
+        entries = optind < argc ? atoi(argv[optind + i]) : default_sizes[i];
+        make_gridmap(path, entries);
+
+        /* the first lookup indexes the file */
+        cgsi_lookup("/CN=warmup");
+
+        fprintf(stdout, "%8d  %14.0f %14.0f  %14.0f %14.0f\n", entries,
+                rate(cgsi_lookup, entries, 1, duration),
+                rate(cgsi_lookup, entries, 0, duration),
+                rate(globus_lookup, entries, 1, duration),
+                rate(globus_lookup, entries, 0, duration));
+        fflush(stdout);
+    }
+
+    globus_module_deactivate(GLOBUS_GSI_GSS_ASSIST_MODULE);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Checks that cgsi_plugin_map_dn() maps DNs as globus_gss_assist_gridmap()
+ * does, both reading the same gridmap file: quoting, escapes, comments,
+ * lists of usernames, duplicate DNs and the spellings of the e-mail and
+ * user id attributes. The wildcard lines, which only cgsi_plugin_map_dn()
+ * supports, are left out.
+ *
+ * Usage: cgsi-gsoap-gridmap-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <globus_gss_assist.h>
+#include "cgsi_plugin.h"
+
+static const char gridmap[] =
+    "# comment line\n"
+    "\n"
+    "\"/DC=ch/DC=cern/OU=Users/CN=John Doe\" jdoe\n"
+    "/DC=ch/DC=cern/OU=Users/CN=jsmith jsmith\n"
+    "   \"/DC=ch/DC=cern/OU=Users/CN=Anna Lee\"   alee,atlas001,atlas002\n"
+    "\"/DC=ch/DC=cern/OU=Users/CN=Dup\" first\n"
+    "\"/DC=ch/DC=cern/OU=Users/CN=Dup\" second\n"
+    "\"/DC=ch/DC=cern/OU=Users/CN=Hex\\x20Escaped\" hex\n"
+    "\"/DC=ch/DC=cern/OU=Users/CN=Quote \\\"Q\\\"\" quote\n"
+    "\"/C=CH/O=CERN/CN=Mail User/Email=mail@cern.ch\" mail\n"
+    "\"/C=CH/O=CERN/CN=Other Mail/emailAddress=other@cern.ch\" othermail\n"
+    "\"/C=CH/O=CERN/CN=Uid User/USERID=uid1\" uid\n"
+    "\"/DC=ch/DC=cern/OU=Users/CN=No User\"\n"
+    "\t\"/DC=ch/DC=cern/OU=Users/CN=Tabbed\"\ttabbed\n";
+
+static const char *dns[] = {
+    "/DC=ch/DC=cern/OU=Users/CN=John Doe",
+    "/DC=ch/DC=cern/OU=Users/CN=john doe",
+    "/DC=ch/DC=cern/OU=Users/CN=John",
+    "/DC=ch/DC=cern/OU=Users/CN=jsmith",
+    "/DC=ch/DC=cern/OU=Users/CN=Anna Lee",
+    "/DC=ch/DC=cern/OU=Users/CN=Dup",
+    "/DC=ch/DC=cern/OU=Users/CN=Hex Escaped",
+    "/DC=ch/DC=cern/OU=Users/CN=Quote \"Q\"",
+    "/C=CH/O=CERN/CN=Mail User/Email=mail@cern.ch",
+    "/C=CH/O=CERN/CN=Mail User/emailAddress=mail@cern.ch",
+    "/C=CH/O=CERN/CN=Mail User/E=mail@cern.ch",
+    "/C=CH/O=CERN/CN=Other Mail/Email=other@cern.ch",
+    "/C=CH/O=CERN/CN=Other Mail/emailAddress=other@cern.ch",
+    "/C=CH/O=CERN/CN=Uid User/USERID=uid1",
+    "/C=CH/O=CERN/CN=Uid User/UID=uid1",
+    "/DC=ch/DC=cern/OU=Users/CN=No User",
+    "/DC=ch/DC=cern/OU=Users/CN=Tabbed",
+    "/DC=ch/DC=cern/OU=Users/CN=Unknown",
+    "",
+    NULL
+};
+
+int main(int argc, char **argv) {
+    char path[] = "/tmp/cgsi-gridmap-test-XXXXXX";
+    char username[256];
+    char *globus_username;
+    int cgsi_ret, globus_ret, failed = 0, fd, i;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, gridmap, strlen(gridmap)) != (ssize_t)strlen(gridmap)) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    setenv("GRIDMAP", path, 1);
+
+    globus_module_activate(GLOBUS_GSI_GSS_ASSIST_MODULE);
+
+    for (i = 0; dns[i] != NULL; i++) {
+        cgsi_ret = cgsi_plugin_map_dn(dns[i], username, sizeof(username));
+        globus_username = NULL;
+        globus_ret = globus_gss_assist_gridmap((char *)dns[i], &globus_username) ? -1 : 0;
+
+        if (cgsi_ret != globus_ret ||
+            (cgsi_ret == 0 && (globus_username == NULL || strcmp(username, globus_username)))) {
+            fprintf(stdout, "ERROR: '%s' mapped to %s by cgsi_plugin_map_dn, to %s by globus_gss_assist_gridmap\n",
+                    dns[i], cgsi_ret == 0 ? username : "nothing",
+                    globus_ret == 0 && globus_username ? globus_username : "nothing");
+            failed++;
+        } else {
+            fprintf(stdout, "INFO: '%s' mapped to %s\n", dns[i], cgsi_ret == 0 ? username : "nothing");
+        }
+        free(globus_username);
+    }
+
+    globus_module_deactivate(GLOBUS_GSI_GSS_ASSIST_MODULE);
+    unlink(path);
+
+    if (failed) {
+        fprintf(stdout, "ERROR: %d of the DNs mapped differently\n", failed);
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "INFO: cgsi_plugin_map_dn and globus_gss_assist_gridmap agree\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Load generating client for CGSI-gSOAP, to be run against
+ * cgsi-gsoap-mt-server.
+ *
+ * CONCURRENCY threads share REQUESTS calls to the endpoint, each thread
+ * with its own soap structure. The calls are getAttributes, or echo of a
+ * payload of SIZE bytes with -b. With -k the connections are kept alive
+ * between the calls of a thread, else each call makes a new connection
+ * and handshake. The client reports the handshakes and requests per
+ * second and the percentiles of the latency of the calls.
+ *
+ * Usage: cgsi-gsoap-load [-c CONCURRENCY] [-n REQUESTS] [-b SIZE] [-k] [-d] ENDPOINT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "cgsi_plugin.h"
+#include "cgsi_gsoap_testH.h"
+#include "cgsi_gsoap_test.nsmap"
+
+const static char HTTPS_PREFIX[] = "https:";
+const static char HTTPG_PREFIX[] = "httpg:";
+
+static const char *endpoint;
+static int flags;
+static char *payload;
+static size_t payload_size;
+
+/* Calls left to make, shared by the threads */
+static long requests_left;
+static pthread_mutex_t requests_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Latencies of the calls of a thread, in seconds */
+struct worker {
+    pthread_t thread;
+    double *latencies;
+    long count;
+    long failed;
+};
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int take_request(void) {
+    int ret;
+
+    pthread_mutex_lock(&requests_lock);
+    ret = requests_left > 0;
+    if (ret)
+        requests_left--;
+    pthread_mutex_unlock(&requests_lock);
+    return ret;
+}
+
+static int call(struct soap *psoap) {
+    struct cgsi_USCOREgsoap_USCOREtest__getAttributesResponse get_resp;
+    struct cgsi_USCOREgsoap_USCOREtest__echoResponse echo_resp;
+
+    if (payload == NULL)
+        return soap_call_cgsi_USCOREgsoap_USCOREtest__getAttributes(psoap, endpoint, NULL, &get_resp);
+
+    if (soap_call_cgsi_USCOREgsoap_USCOREtest__echo(psoap, endpoint, NULL, payload, &echo_resp) != SOAP_OK)
+        return psoap->error;
+    if (echo_resp.echoReturn == NULL || strcmp(echo_resp.echoReturn, payload)) {
+        fprintf(stderr, "ERROR: the payload echoed differs\n");
+        return SOAP_ERR;
+    }
+    return SOAP_OK;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+    struct soap *psoap;
+    double start;
+
+    psoap = soap_new();
+    if (psoap == NULL || soap_cgsi_init(psoap, flags)) {
+        fprintf(stderr, "ERROR: Failed to initialize the SOAP layer\n");
+        exit(EXIT_FAILURE);
+    }
+    if (soap_set_namespaces(psoap, namespaces)) {
+        fprintf(stderr, "ERROR: Failed to set namespaces\n");
+        exit(EXIT_FAILURE);
+    }
+    psoap->recv_timeout = 30;
+    psoap->send_timeout = 30;
+
+    while (take_request()) {
+        start = now();
+        if (call(psoap) != SOAP_OK) {
+            if (worker->failed++ == 0)
+                soap_print_fault(psoap, stderr);
+            /* gives up on the connection */
+            soap_closesock(psoap);
+        } else {
+            worker->latencies[worker->count++] = now() - start;
+        }
+        soap_destroy(psoap);
+        soap_end(psoap);
+    }
+
+    psoap->keep_alive = 0;
+    soap_closesock(psoap);
+    soap_done(psoap);
+    free(psoap);
+    return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, long count, double p) {
+    long i = (long)(p * count);
+
+    if (i >= count)
+        i = count - 1;
+    return sorted[i];
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c CONCURRENCY] [-n REQUESTS] [-b SIZE] [-k] [-d] ENDPOINT\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    struct cgsi_plugin_stats before, after;
+    struct worker *workers;
+    double start, elapsed, *latencies;
+    unsigned long handshakes;
+    long requests = 1000, count = 0, failed = 0;
+    int concurrency = 8, keep_alive = 0, delegate = 0, c, i;
+    size_t j;
+
+    while ((c = getopt(argc, argv, "c:n:b:kd")) != -1) switch (c) {
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'b':
+            payload_size = atol(optarg);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'd':
+            delegate = 1;
+            break;
+        default:
+            usage(argv[0]);
+    }
+    if (optind != argc - 1 || concurrency <= 0 || requests <= 0)
+        usage(argv[0]);
+    endpoint = argv[optind];
+
+    if (!strncmp(endpoint, HTTPS_PREFIX, strlen(HTTPS_PREFIX))) {
+        flags = CGSI_OPT_SSL_COMPATIBLE;
+    } else if (!strncmp(endpoint, HTTPG_PREFIX, strlen(HTTPG_PREFIX))) {
+        flags = 0;
+    } else {
+        fprintf(stderr, "ERROR: Not secure endpoint '%s'\n", endpoint);
+        exit(EXIT_FAILURE);
+    }
+    flags |= CGSI_OPT_DISABLE_NAME_CHECK;
+    if (keep_alive) flags |= CGSI_OPT_KEEP_ALIVE;
+    if (delegate) flags |= CGSI_OPT_DELEG_FLAG;
+
+    if (payload_size > 0) {
+        payload = malloc(payload_size + 1);
+        if (payload == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < payload_size; j++)
+            payload[j] = 'a' + j % 26;
+        payload[payload_size] = '\0';
+    }
+
+    workers = calloc(concurrency, sizeof(struct worker));
+    if (workers == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < concurrency; i++) {
+        workers[i].latencies = malloc(requests * sizeof(double));
+        if (workers[i].latencies == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(stdout, "INFO: %ld requests to %s from %d threads, %s, %s\n", requests, endpoint, concurrency,
+            keep_alive ? "connections kept alive" : "one connection per request",
+            payload ? "echo" : "getAttributes");
+
+    requests_left = requests;
+    cgsi_plugin_get_stats(&before);
+    start = now();
+    for (i = 0; i < concurrency; i++)
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+    for (i = 0; i < concurrency; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = now() - start;
+    cgsi_plugin_get_stats(&after);
+
+    /* Every client handshake looks for a TLS session to resume */
+    handshakes = (after.client_session_hits + after.client_session_misses) -
+                 (before.client_session_hits + before.client_session_misses);
+
+    latencies = malloc(requests * sizeof(double));
+    if (latencies == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < concurrency; i++) {
+        memcpy(latencies + count, workers[i].latencies, workers[i].count * sizeof(double));
+        count += workers[i].count;
+        failed += workers[i].failed;
+        free(workers[i].latencies);
+    }
+    qsort(latencies, count, sizeof(double), compare);
+
+    fprintf(stdout, "INFO: %ld requests succeeded, %ld failed in %.3f s\n", count, failed, elapsed);
+    fprintf(stdout, "INFO: %lu handshakes, %.1f handshakes/s, %lu sessions resumed\n", handshakes,
+            handshakes / elapsed, after.client_session_resumed - before.client_session_resumed);
+    fprintf(stdout, "INFO: %.1f requests/s\n", count / elapsed);
+    if (count > 0)
+        fprintf(stdout, "INFO: latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+                1000 * percentile(latencies, count, 0.50), 1000 * percentile(latencies, count, 0.99),
+                1000 * percentile(latencies, count, 0.999), 1000 * latencies[count - 1]);
+
+    free(latencies);
+    free(workers);
+    free(payload);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
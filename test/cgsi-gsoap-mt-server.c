@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Multi-threaded test server for CGSI-gSOAP, the reference for measuring
+ * the plugin under concurrent load (see cgsi-gsoap-load).
+ *
+ * The main thread accepts the connections and hands a soap_copy() of each
+ * to a pool of worker threads, which serve it, keeping it alive for up to
+ * -k requests. With -w the handshakes are run by a pool of handshake
+ * workers first (see cgsi_handshake_pool_create()), the workers only
+ * getting established connections.
+ *
+ * Usage: cgsi-gsoap-mt-server -p PORT [-t THREADS] [-q QUEUE] [-k KEEPALIVE]
+ *                             [-w HANDSHAKE_WORKERS] [-r CONNECTIONS] (-s|-g) -o
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cgsi_plugin.h"
+#include "cgsi_gsoap_testH.h"
+#include "cgsi_gsoap_test.nsmap"
+
+/* Accepted connections waiting for a worker, when there is no handshake pool */
+static struct soap **queue;
+static int queue_size = 64;
+static int queue_head, queue_len;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+static struct cgsi_handshake_pool *handshake_pool;
+static volatile int running = 1;
+
+/* Counters of the workers, under queue_lock */
+static unsigned long connections_served, requests_served, requests_failed;
+
+int cgsi_USCOREgsoap_USCOREtest__getAttributes(struct soap *psoap,
+    struct cgsi_USCOREgsoap_USCOREtest__getAttributesResponse *response) {
+    char dn[512];
+    char **fqans;
+    char *attributes;
+    int nbfqans, i;
+    size_t length;
+
+    if (get_client_dn(psoap, dn, sizeof(dn)) != 0 || retrieve_voms_credentials(psoap) != 0)
+        return SOAP_SVR_FAULT;
+    nbfqans = 0;
+    fqans = get_client_roles(psoap, &nbfqans);
+    if (fqans == NULL)
+        nbfqans = 0;
+
+    length = strlen(dn) + 2;
+    for (i = 0; i < nbfqans; i++)
+        length += strlen(fqans[i]) + 1;
+    attributes = soap_malloc(psoap, length);
+    if (attributes == NULL)
+        return SOAP_EOM;
+    strcpy(attributes, dn);
+    strcat(attributes, "\n");
+    for (i = 0; i < nbfqans; i++) {
+        strcat(attributes, fqans[i]);
+        strcat(attributes, "\n");
+    }
+    response->getAttributesReturn = attributes;
+    return SOAP_OK;
+}
+
+int cgsi_USCOREgsoap_USCOREtest__echo(struct soap *psoap, char *input,
+    struct cgsi_USCOREgsoap_USCOREtest__echoResponse *response) {
+    response->echoReturn = input;
+    return SOAP_OK;
+}
+
+/* Counts the requests of the connections as they are served */
+static int count_request(struct soap *psoap) {
+    pthread_mutex_lock(&queue_lock);
+    requests_served++;
+    pthread_mutex_unlock(&queue_lock);
+    return SOAP_OK;
+}
+
+static struct soap *next_connection(void) {
+    struct soap *tsoap;
+
+    if (handshake_pool != NULL) {
+        tsoap = NULL;
+        while (tsoap == NULL && running)
+            tsoap = cgsi_handshake_pool_next(handshake_pool, 1000);
+        return tsoap;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == 0 && running)
+        pthread_cond_wait(&queue_not_empty, &queue_lock);
+    if (queue_len == 0) {
+        pthread_mutex_unlock(&queue_lock);
+        return NULL;
+    }
+    tsoap = queue[queue_head];
+    queue_head = (queue_head + 1) % queue_size;
+    queue_len--;
+    pthread_cond_signal(&queue_not_full);
+    pthread_mutex_unlock(&queue_lock);
+    return tsoap;
+}
+
+static void *worker_thread(void *arg) {
+    struct soap *tsoap;
+    int ret;
+
+    while ((tsoap = next_connection()) != NULL) {
+        tsoap->fserveloop = count_request;
+        ret = soap_serve(tsoap);
+        soap_destroy(tsoap);
+        soap_end(tsoap);
+        soap_done(tsoap);
+        free(tsoap);
+
+        pthread_mutex_lock(&queue_lock);
+        connections_served++;
+        if (ret != SOAP_OK)
+            requests_failed++;
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return NULL;
+}
+
+static void enqueue(struct soap *tsoap) {
+    if (handshake_pool != NULL) {
+        if (cgsi_handshake_pool_submit(handshake_pool, tsoap) != 0) {
+            soap_print_fault(tsoap, stderr);
+            soap_closesock(tsoap);
+            soap_end(tsoap);
+            soap_done(tsoap);
+            free(tsoap);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == queue_size)
+        pthread_cond_wait(&queue_not_full, &queue_lock);
+    queue[(queue_head + queue_len) % queue_size] = tsoap;
+    queue_len++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -p PORT [-t THREADS] [-q QUEUE] [-k KEEPALIVE] "
+                    "[-w HANDSHAKE_WORKERS] [-r CONNECTIONS] (-s|-g) -o\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    struct cgsi_handshake_pool_stats stats;
+    struct soap *psoap, *tsoap;
+    pthread_t *workers;
+    int flags = CGSI_OPT_SERVER | CGSI_OPT_DISABLE_MAPPING | CGSI_OPT_KEEP_ALIVE;
+    int port = 8111, nthreads = 8, keep_alive = 100, handshake_workers = 0;
+    int to_serve = 0, c, i;
+
+    while ((c = getopt(argc, argv, "p:t:q:k:w:r:sgo")) != -1) switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 'k':
+            keep_alive = atoi(optarg);
+            break;
+        case 'w':
+            handshake_workers = atoi(optarg);
+            break;
+        case 'r':
+            to_serve = atoi(optarg);
+            break;
+        case 's':
+            flags |= CGSI_OPT_SSL_COMPATIBLE;
+            break;
+        case 'g':
+            flags |= CGSI_OPT_DELEG_FLAG;
+            break;
+        case 'o':
+            flags |= CGSI_OPT_DISABLE_VOMS_CHECK;
+            break;
+        default:
+            usage(argv[0]);
+    }
+    if (nthreads <= 0 || queue_size <= 0 || keep_alive < 0 || handshake_workers < 0)
+        usage(argv[0]);
+    if (keep_alive == 0)
+        flags &= ~CGSI_OPT_KEEP_ALIVE;
+
+    fprintf(stdout, "INFO: CGSI-gSOAP multi-threaded test server on port %d, %d workers, "
+                    "%d requests per connection, %d handshake workers\n",
+            port, nthreads, keep_alive ? keep_alive : 1, handshake_workers);
+    fflush(stdout);
+
+    psoap = soap_new();
+    if (psoap == NULL || soap_cgsi_init(psoap, flags)) {
+        fprintf(stdout, "ERROR: Failed to initialize the SOAP layer\n");
+        exit(EXIT_FAILURE);
+    }
+    if (soap_set_namespaces(psoap, namespaces)) {
+        fprintf(stdout, "ERROR: Failed to set namespaces\n");
+        soap_print_fault(psoap, stdout);
+        exit(EXIT_FAILURE);
+    }
+    psoap->max_keep_alive = keep_alive;
+    psoap->accept_timeout = 1;
+    psoap->recv_timeout = 5;
+    psoap->send_timeout = 5;
+
+    if (!soap_valid_socket(soap_bind(psoap, NULL, port, 100))) {
+        fprintf(stdout, "ERROR: soap_bind has failed.\n");
+        soap_print_fault(psoap, stdout);
+        exit(EXIT_FAILURE);
+    }
+
+    queue = calloc(queue_size, sizeof(struct soap *));
+    workers = calloc(nthreads, sizeof(pthread_t));
+    if (queue == NULL || workers == NULL) {
+        fprintf(stdout, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (handshake_workers > 0) {
+        handshake_pool = cgsi_handshake_pool_create(handshake_workers, queue_size);
+        if (handshake_pool == NULL) {
+            fprintf(stdout, "ERROR: Failed to start the handshake pool\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&workers[i], NULL, worker_thread, NULL);
+
+    for (i = 0; to_serve == 0 || i < to_serve; ) {
+        if (!soap_valid_socket(soap_accept(psoap))) {
+            if (psoap->errnum != 0) {
+                soap_print_fault(psoap, stdout);
+                break;
+            }
+            continue; // accept timeout
+        }
+        tsoap = soap_copy(psoap);
+        psoap->socket = SOAP_INVALID_SOCKET;
+        if (tsoap == NULL) {
+            fprintf(stdout, "ERROR: Failed to copy the SOAP instance\n");
+            continue;
+        }
+        enqueue(tsoap);
+        i++;
+    }
+
+    /* Lets the workers serve the connections queued, then stops them */
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len > 0) {
+        pthread_mutex_unlock(&queue_lock);
+        usleep(10000);
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    if (handshake_pool != NULL) {
+        for (;;) {
+            cgsi_handshake_pool_get_stats(handshake_pool, &stats);
+            if (stats.pending + stats.running + stats.ready == 0)
+                break;
+            usleep(10000);
+        }
+    }
+    pthread_mutex_lock(&queue_lock);
+    running = 0;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i], NULL);
+
+    fprintf(stdout, "INFO: served %lu connections, %lu requests, %lu failed\n",
+            connections_served, requests_served, requests_failed);
+    if (handshake_pool != NULL) {
+        cgsi_handshake_pool_get_stats(handshake_pool, &stats);
+        fprintf(stdout, "INFO: handshakes: %lu established, %lu failed, %lu rejected\n",
+                stats.established, stats.failed, stats.rejected);
+        cgsi_handshake_pool_destroy(handshake_pool);
+    }
+
+    free(workers);
+    free(queue);
+    soap_closesock(psoap);
+    soap_done(psoap);
+    free(psoap);
+    fprintf(stdout, "server is properly shut down\n");
+    return EXIT_SUCCESS;
+}
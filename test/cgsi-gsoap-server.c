@@ -23,6 +23,8 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include "cgsi_plugin.h"
 #include "cgsi_gsoap_testH.h"
 #include "cgsi_gsoap_test.nsmap"
@@ -74,15 +76,137 @@ int cgsi_USCOREgsoap_USCOREtest__getAttributes(struct soap *psoap,
     return SOAP_OK;
 }
 
-void parse_options(int argc, char **argv, int *flags, int *port, int *to_serve) {
+int cgsi_USCOREgsoap_USCOREtest__echo(struct soap *psoap, char *input,
+    struct cgsi_USCOREgsoap_USCOREtest__echoResponse *response) {
+    response->echoReturn = input;
+    return SOAP_OK;
+}
+
+/* Runs the handshake with cgsi_accept_step(), as an event loop would */
+int accept_in_steps(struct soap *psoap) {
+    struct pollfd pfd;
+    int ret;
+
+    ret = cgsi_accept_step(psoap, 0);
+    while (ret == CGSI_ACCEPT_WANT_READ || ret == CGSI_ACCEPT_WANT_WRITE) {
+        pfd.fd = psoap->socket;
+        pfd.events = ret == CGSI_ACCEPT_WANT_READ ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, psoap->recv_timeout * 1000) <= 0) {
+            fprintf(stdout, "ERROR: handshake timed out\n");
+            return -1;
+        }
+        ret = cgsi_accept_step(psoap, 1);
+    }
+    if (ret != CGSI_ACCEPT_DONE) {
+        soap_print_fault(psoap, stdout);
+        return -1;
+    }
+    fprintf(stdout, "INFO: handshake done in steps\n");
+    return 0;
+}
+
+/* Accept thread of the handshake pool mode */
+struct acceptor {
+    struct soap *psoap;
+    struct cgsi_handshake_pool *pool;
+    volatile int running;
+};
+
+/* Hands the accepted connections over to the handshake pool */
+void *accept_to_pool(void *arg) {
+    struct acceptor *acceptor = (struct acceptor *)arg;
+    struct soap *tsoap;
+
+    while (acceptor->running) {
+        if (!soap_valid_socket(soap_accept(acceptor->psoap)))
+            continue;
+        tsoap = soap_copy(acceptor->psoap);
+        acceptor->psoap->socket = SOAP_INVALID_SOCKET;
+        if (tsoap == NULL) {
+            fprintf(stdout, "ERROR: Failed to copy the SOAP instance\n");
+            continue;
+        }
+        if (cgsi_handshake_pool_submit(acceptor->pool, tsoap) != 0) {
+            soap_print_fault(tsoap, stdout);
+            soap_closesock(tsoap);
+            soap_end(tsoap);
+            soap_done(tsoap);
+            free(tsoap);
+        }
+    }
+    return NULL;
+}
+
+/* Serves the connections established by a pool of handshake workers */
+void serve_with_pool(struct soap *psoap, int to_serve, int workers) {
+    struct acceptor acceptor;
+    struct cgsi_handshake_pool_stats stats;
+    struct soap *tsoap;
+    pthread_t thread;
+    int i;
+
+    acceptor.psoap = psoap;
+    acceptor.running = 1;
+    acceptor.pool = cgsi_handshake_pool_create(workers, 100);
+    if (acceptor.pool == NULL) {
+        fprintf(stdout, "ERROR: Failed to start the handshake pool\n");
+        exit(EXIT_FAILURE);
+    }
+    // the accept thread checks regularly whether it should stop
+    psoap->accept_timeout = 1;
+    pthread_create(&thread, NULL, accept_to_pool, &acceptor);
+
+    for (i = 0; i < to_serve; i++) {
+        tsoap = cgsi_handshake_pool_next(acceptor.pool, 60000);
+        if (tsoap == NULL) {
+            fprintf(stdout, "ERROR: no connection established in time\n");
+            break;
+        }
+        fprintf(stdout, "\nINFO: ==================================================\n");
+        fprintf(stdout, "INFO: %d: established connection socket=%d\n", i, tsoap->socket);
+        if (soap_serve(tsoap) != SOAP_OK) // process RPC request
+            soap_print_fault(tsoap, stdout); // print error
+        fprintf(stdout, "INFO: request served\n");
+        fflush(stdout);
+        soap_destroy(tsoap);
+        soap_end(tsoap);
+        soap_done(tsoap);
+        free(tsoap);
+    }
+
+    acceptor.running = 0;
+    pthread_join(thread, NULL);
+
+    cgsi_handshake_pool_get_stats(acceptor.pool, &stats);
+    fprintf(stdout, "INFO: handshakes: %lu established, %lu failed, %lu rejected\n",
+        stats.established, stats.failed, stats.rejected);
+    fprintf(stdout, "INFO: queues: %lu waiting for a handshake at most, %lu waiting to be served at most\n",
+        stats.pending_max, stats.ready_max);
+    if (stats.established + stats.failed > 0)
+        fprintf(stdout, "INFO: average times: %.3fms waiting for a handshake, %.3fms in handshake\n",
+            1000 * stats.pending_wait / (stats.established + stats.failed),
+            1000 * stats.handshake_time / (stats.established + stats.failed));
+    if (stats.served > 0)
+        fprintf(stdout, "INFO: average time waiting to be served: %.3fms\n",
+            1000 * stats.ready_wait / stats.served);
+    fflush(stdout);
+    cgsi_handshake_pool_destroy(acceptor.pool);
+}
+
+void parse_options(int argc, char **argv, int *flags, int *port, int *to_serve, int *steps, int *workers,
+                   int *session_cache) {
     *flags = CGSI_OPT_SERVER | CGSI_OPT_DISABLE_MAPPING;
     *port = 8111;
     *to_serve = 1;
+    *steps = 0;
+    *workers = 0;
+    *session_cache = 0;
     int c;
      
-    while ((c = getopt(argc, argv, "p:r:sgol")) != -1) switch (c) {
+    while ((c = getopt(argc, argv, "p:r:sgolew:c")) != -1) switch (c) {
         case 'h':
-            printf("Usage: %s -p PORT (-s|-g) -o -l\n", argv[0]);
+            printf("Usage: %s -p PORT (-s|-g) -o -l (-e|-w WORKERS) -c\n", argv[0]);
             fflush(stdout);
             exit (EXIT_SUCCESS);
             break;
@@ -116,6 +240,21 @@ void parse_options(int argc, char **argv, int *flags, int *port, int *to_serve)
             fprintf(stdout, "INFO: will only allow clients that share the server's identity to connect\n");
             fflush(stdout);
             break;
+        case 'e':
+            *steps = 1;
+            fprintf(stdout, "INFO: non-blocking handshakes with cgsi_accept_step()\n");
+            fflush(stdout);
+            break;
+        case 'w':
+            *workers = atoi(optarg);
+            fprintf(stdout, "INFO: handshakes run by a pool of %d workers\n", *workers);
+            fflush(stdout);
+            break;
+        case 'c':
+            *session_cache = 1;
+            fprintf(stdout, "INFO: clients can resume their TLS session\n");
+            fflush(stdout);
+            break;
         case ':':
             fprintf(stderr, "ERROR: Option argument is missing\n");
             fflush(stderr);
@@ -142,11 +281,19 @@ int main(int argc, char **argv) {
     int flags, i;
     int port = 8111;
     int to_serve = 1;
+    int steps;
+    int workers;
+    int session_cache;
 
-    parse_options(argc, argv, &flags, &port, &to_serve);
+    parse_options(argc, argv, &flags, &port, &to_serve, &steps, &workers, &session_cache);
     fprintf(stdout, "INFO: CGSI-gSOAP test server is going to serve %d requests.\n", to_serve);
     fflush(stdout);
 
+    if (session_cache && cgsi_plugin_enable_session_cache(64, 0)) {
+        fprintf(stdout, "ERROR: Failed to enable the TLS session cache\n");
+        exit(EXIT_FAILURE);
+    }
+
     psoap = soap_new();
     if (psoap == NULL) {
         fprintf(stdout, "ERROR: Failed to create a SOAP instance\n");
@@ -179,7 +326,10 @@ int main(int argc, char **argv) {
 
     /* main loop */
 
-    for (i = 0; i < to_serve; i++) {
+    if (workers > 0)
+        serve_with_pool(psoap, to_serve, workers);
+
+    for (i = 0; workers == 0 && i < to_serve; i++) {
         s = soap_accept(psoap);
         if (s < 0) {
             soap_print_fault(psoap, stdout);
@@ -191,6 +341,10 @@ int main(int argc, char **argv) {
             (int)((psoap->ip >> 16) & 0xFF), 
             (int)((psoap->ip >> 8) & 0xFF), 
             (int)(psoap->ip & 0xFF), s);
+         if (steps && accept_in_steps(psoap) != 0) {
+             soap_closesock(psoap);
+             continue;
+         }
          if (soap_serve(psoap) != SOAP_OK) // process RPC request
             soap_print_fault(psoap, stdout); // print error
          fprintf(stdout, "INFO: request served\n");
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Client handshakes per second for an increasing number of client threads.
+ *
+ * The process runs a server with as many accepting threads as there are
+ * client threads, using the host certificate (X509_USER_CERT and
+ * X509_USER_KEY), and clients using the proxy (X509_USER_PROXY) which
+ * connect and disconnect in a loop. The counters of the handshake lock
+ * show how often the clients waited for each other.
+ *
+ * Usage: cgsi-gsoap-stress [-m all|first|none] [-p PORT] [-t SECONDS] [THREADS ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "cgsi_plugin.h"
+
+struct Namespace namespaces[] = { { NULL } };
+
+static struct soap *server;
+static char endpoint[64];
+static double duration = 2.0;
+static volatile int running;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Accepts connections until the server socket is closed */
+static void *server_thread(void *arg) {
+    struct soap *psoap;
+    char c;
+
+    psoap = soap_copy(server);
+    if (psoap == NULL)
+        return NULL;
+    while (soap_valid_socket(server->master)) {
+        if (!soap_valid_socket(soap_accept(psoap)))
+            continue;
+        /* The first read runs the handshake, then sees the client disconnect */
+        psoap->frecv(psoap, &c, 1);
+        soap_closesock(psoap);
+        soap_end(psoap);
+    }
+    soap_done(psoap);
+    free(psoap);
+    return NULL;
+}
+
+/* Connects and disconnects while the test runs, returning the number of handshakes */
+static void *client_thread(void *arg) {
+    struct soap *psoap;
+    long *count = (long *)arg;
+
+    psoap = soap_new();
+    if (psoap == NULL || soap_cgsi_init(psoap, CGSI_OPT_DISABLE_NAME_CHECK)) {
+        fprintf(stderr, "ERROR: Failed to initialize the client\n");
+        exit(EXIT_FAILURE);
+    }
+    psoap->recv_timeout = 5;
+    psoap->send_timeout = 5;
+
+    while (running) {
+        if (soap_connect(psoap, endpoint, NULL) != SOAP_OK) {
+            soap_print_fault(psoap, stderr);
+            exit(EXIT_FAILURE);
+        }
+        soap_closesock(psoap);
+        soap_end(psoap);
+        (*count)++;
+    }
+
+    soap_done(psoap);
+    free(psoap);
+    return NULL;
+}
+
+static void run(int nthreads) {
+    struct cgsi_plugin_stats before, after;
+    pthread_t *threads;
+    long *counts, total = 0;
+    double start, elapsed;
+    int i;
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    counts = calloc(nthreads, sizeof(long));
+    if (threads == NULL || counts == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cgsi_plugin_get_stats(&before);
+    running = 1;
+    start = now();
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, client_thread, &counts[i]);
+    sleep((unsigned int)duration);
+    usleep((useconds_t)((duration - (unsigned int)duration) * 1e6));
+    running = 0;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += counts[i];
+    }
+    elapsed = now() - start;
+    cgsi_plugin_get_stats(&after);
+
+    fprintf(stdout, "%8d  %12.1f  %10lu  %10lu\n", nthreads, total / elapsed,
+            after.gss_lock_acquired - before.gss_lock_acquired,
+            after.gss_lock_contended - before.gss_lock_contended);
+    fflush(stdout);
+
+    free(counts);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    static const int default_threads[] = { 1, 2, 4, 8, 16, 32, 64, 0 };
+    pthread_t *acceptors;
+    int c, i, nthreads, maxthreads = 0;
+    int mode = CGSI_GSS_LOCK_ALL;
+    int port = 8112;
+
+    while ((c = getopt(argc, argv, "m:p:t:")) != -1) switch (c) {
+        case 'm':
+            if (!strcmp(optarg, "all"))
+                mode = CGSI_GSS_LOCK_ALL;
+            else if (!strcmp(optarg, "first"))
+                mode = CGSI_GSS_LOCK_FIRST;
+            else if (!strcmp(optarg, "none"))
+                mode = CGSI_GSS_LOCK_NONE;
+            else {
+                fprintf(stderr, "ERROR: Unknown lock mode '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m all|first|none] [-p PORT] [-t SECONDS] [THREADS ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; optind + i < argc || (optind == argc && default_threads[i]); i++) {
+        nthreads = optind < argc ? atoi(argv[optind + i]) : default_threads[i];
+        if (nthreads > maxthreads)
+            maxthreads = nthreads;
+    }
+
+    cgsi_plugin_set_gss_lock(mode);
+
+    server = soap_new();
+    if (server == NULL || soap_cgsi_init(server, CGSI_OPT_SERVER | CGSI_OPT_DISABLE_MAPPING |
+                                                 CGSI_OPT_DISABLE_VOMS_CHECK)) {
+        fprintf(stderr, "ERROR: Failed to initialize the server\n");
+        exit(EXIT_FAILURE);
+    }
+    if (getenv("X509_USER_CERT") && getenv("X509_USER_KEY") &&
+        cgsi_plugin_set_credentials(server, 1, getenv("X509_USER_CERT"), getenv("X509_USER_KEY"))) {
+        fprintf(stderr, "ERROR: Failed to set the server credentials\n");
+        exit(EXIT_FAILURE);
+    }
+    server->accept_timeout = 1;
+    server->recv_timeout = 5;
+    server->send_timeout = 5;
+    if (!soap_valid_socket(soap_bind(server, "localhost", port, 100))) {
+        soap_print_fault(server, stderr);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(endpoint, sizeof(endpoint), "httpg://localhost:%d/", port);
+
+    acceptors = calloc(maxthreads, sizeof(pthread_t));
+    if (acceptors == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < maxthreads; i++)
+        pthread_create(&acceptors[i], NULL, server_thread, NULL);
+
+    fprintf(stdout, "%8s  %12s  %10s  %10s\n", "threads", "handshakes/s", "locked", "contended");
+    for (i = 0; optind + i < argc || (optind == argc && default_threads[i]); i++)
+        run(optind < argc ? atoi(argv[optind + i]) : default_threads[i]);
+
+    /* wakes up the accepting threads */
+    c = server->master;
+    server->master = SOAP_INVALID_SOCKET;
+    close(c);
+    for (i = 0; i < maxthreads; i++)
+        pthread_join(acceptors[i], NULL);
+    free(acceptors);
+
+    soap_done(server);
+    free(server);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2004.
+ * See http://www.eu-egee.org/partners/ for details on the copyright holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Throughput of the data path of the plugin (wrapping, framing and
+ * unwrapping of the records) without the network nor the gSOAP parser.
+ *
+ * A client and a server soap structure of the same process are connected
+ * by a socketpair, with fopen, frecv and fclose installed before the
+ * plugin is registered, so that the plugin uses them as its transport.
+ * gSOAP's own fsend is kept, for the plugin to write the records of
+ * large sends with sendmsg().
+ * After the handshake, messages of 64 bytes to 16 MB are streamed with the
+ * fsend and frecv of the plugin in both directions, TOTAL MB per message
+ * size and direction, each on a new connection.
+ *
+ * Both ends use the host certificate (X509_USER_CERT and X509_USER_KEY),
+ * the client only accepting a server of its own identity.
+ *
+ * The system calls on sockets and the allocations are counted by
+ * overriding send(), recv(), sendmsg(), poll() and the glibc allocators,
+ * the records from the statistics of the plugin.
+ *
+ * Usage: cgsi-gsoap-transport-bench [-t TOTAL] [SIZE ...]
+ */
+
+/* for ppoll() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "cgsi_plugin.h"
+
+struct Namespace namespaces[] = { { NULL } };
+
+/* Size of the buffer the receiver reads into, as large as gSOAP's */
+#define RECV_BUFSIZE 65536
+
+static unsigned long syscalls, allocations;
+
+/* Counted system calls on the sockets */
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    __sync_fetch_and_add(&syscalls, 1);
+    return sendto(fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    __sync_fetch_and_add(&syscalls, 1);
+    return recvfrom(fd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    __sync_fetch_and_add(&syscalls, 1);
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    struct timespec ts;
+
+    __sync_fetch_and_add(&syscalls, 1);
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    return ppoll(fds, nfds, timeout < 0 ? NULL : &ts, NULL);
+}
+
+#ifdef __GLIBC__
+/* Counted allocations, free() is left to glibc */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/* Transport of the plugin, over the socket set in the soap structure */
+
+static int bench_fopen(struct soap *psoap, const char *endpoint, const char *host, int port) {
+    return psoap->socket;
+}
+
+static int bench_fclose(struct soap *psoap) {
+    if (soap_valid_socket(psoap->socket))
+        close(psoap->socket);
+    psoap->socket = SOAP_INVALID_SOCKET;
+    return SOAP_OK;
+}
+
+static size_t bench_frecv(struct soap *psoap, char *s, size_t n) {
+    ssize_t ret;
+
+    ret = recv(psoap->socket, s, n, 0);
+    return ret > 0 ? ret : 0;
+}
+
+static struct soap *bench_soap(int flags) {
+    struct soap *psoap;
+
+    psoap = soap_new();
+    if (psoap == NULL) {
+        fprintf(stderr, "ERROR: Failed to create a SOAP instance\n");
+        exit(EXIT_FAILURE);
+    }
+    psoap->fopen = bench_fopen;
+    psoap->fclose = bench_fclose;
+    psoap->frecv = bench_frecv;
+    psoap->recv_timeout = 30;
+    psoap->send_timeout = 30;
+    if (soap_register_plugin_arg(psoap, cgsi_plugin, &flags)) {
+        fprintf(stderr, "ERROR: Failed to register the plugin\n");
+        exit(EXIT_FAILURE);
+    }
+    return psoap;
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Runs the server handshake */
+static void *accept_thread(void *arg) {
+    struct soap *psoap = (struct soap *)arg;
+    struct pollfd pfd;
+    int ret;
+
+    ret = cgsi_accept_step(psoap, 0);
+    while (ret == CGSI_ACCEPT_WANT_READ || ret == CGSI_ACCEPT_WANT_WRITE) {
+        pfd.fd = psoap->socket;
+        pfd.events = ret == CGSI_ACCEPT_WANT_READ ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 30000) <= 0)
+            break;
+        ret = cgsi_accept_step(psoap, 1);
+    }
+    if (ret != CGSI_ACCEPT_DONE) {
+        soap_print_fault(psoap, stderr);
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+/* Connects the client to the server over a new socketpair */
+static void connect_pair(struct soap *client, struct soap *server) {
+    pthread_t thread;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    client->socket = sv[0];
+    server->socket = sv[1];
+
+    pthread_create(&thread, NULL, accept_thread, server);
+    if (client->fopen(client, "httpg://localhost/", "localhost", 0) < 0) {
+        soap_print_fault(client, stderr);
+        exit(EXIT_FAILURE);
+    }
+    pthread_join(thread, NULL);
+}
+
+struct stream {
+    struct soap *psoap;
+    size_t size;
+    long count;
+};
+
+static void *send_thread(void *arg) {
+    struct stream *stream = (struct stream *)arg;
+    char *buf;
+    long i;
+
+    buf = malloc(stream->size);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'a', stream->size);
+    for (i = 0; i < stream->count; i++) {
+        if (stream->psoap->fsend(stream->psoap, buf, stream->size) != SOAP_OK) {
+            soap_print_fault(stream->psoap, stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cgsi_plugin_flush(stream->psoap) != 0) {
+        soap_print_fault(stream->psoap, stderr);
+        exit(EXIT_FAILURE);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void receive(struct soap *psoap, size_t total, char *buf) {
+    size_t ret;
+
+    while (total > 0) {
+        ret = psoap->frecv(psoap, buf, total < RECV_BUFSIZE ? total : RECV_BUFSIZE);
+        if (ret == 0) {
+            soap_print_fault(psoap, stderr);
+            exit(EXIT_FAILURE);
+        }
+        total -= ret;
+    }
+}
+
+static unsigned long records(const struct cgsi_plugin_stats *stats) {
+    return stats->recv_records_in_place + stats->recv_records_allocated + stats->recv_records_direct;
+}
+
+/* Streams messages from one end to the other, printing the figures */
+static void run(struct soap *client, struct soap *server, int to_server, size_t size, size_t total) {
+    struct cgsi_plugin_stats before, after;
+    struct stream stream;
+    pthread_t thread;
+    unsigned long nsyscalls, nallocations;
+    double start, elapsed, mb;
+    char *buf;
+
+    buf = malloc(RECV_BUFSIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    connect_pair(client, server);
+
+    stream.psoap = to_server ? client : server;
+    stream.size = size;
+    stream.count = total / size > 0 ? total / size : 1;
+    mb = (double)size * stream.count / (1024 * 1024);
+
+    cgsi_plugin_get_stats(&before);
+    nsyscalls = syscalls;
+    nallocations = allocations;
+    start = now();
+    pthread_create(&thread, NULL, send_thread, &stream);
+    receive(to_server ? server : client, size * stream.count, buf);
+    pthread_join(thread, NULL);
+    elapsed = now() - start;
+    nsyscalls = syscalls - nsyscalls;
+    nallocations = allocations - nallocations;
+
+    /* The records are counted when the connections end */
+    client->fclose(client);
+    server->fclose(server);
+    cgsi_plugin_get_stats(&after);
+
+    fprintf(stdout, "%9lu  %9s  %9.1f  %10.0f  %10.1f  %10.1f\n", (unsigned long)size,
+            to_server ? "to server" : "to client", mb / elapsed,
+            (records(&after) - records(&before)) / elapsed, nallocations / mb, nsyscalls / mb);
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144,
+                                    1048576, 4194304, 16777216 };
+    struct soap *client, *server;
+    const char *cert, *key;
+    size_t total = 32;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "t:")) != -1) switch (c) {
+        case 't':
+            total = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t TOTAL] [SIZE ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+    if (total == 0) {
+        fprintf(stderr, "ERROR: The total must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    total *= 1024 * 1024;
+
+    cert = getenv("X509_USER_CERT");
+    key = getenv("X509_USER_KEY");
+    if (cert == NULL || key == NULL) {
+        fprintf(stderr, "ERROR: X509_USER_CERT and X509_USER_KEY must point to the host certificate\n");
+        exit(EXIT_FAILURE);
+    }
+
+    server = bench_soap(CGSI_OPT_SERVER | CGSI_OPT_DISABLE_MAPPING | CGSI_OPT_DISABLE_VOMS_CHECK |
+                        CGSI_OPT_COALESCE_SENDS | CGSI_OPT_DIRECT_DECRYPT);
+    client = bench_soap(CGSI_OPT_ALLOW_ONLY_SELF | CGSI_OPT_COALESCE_SENDS | CGSI_OPT_DIRECT_DECRYPT);
+    if (cgsi_plugin_set_credentials(client, 0, cert, key) != 0) {
+        soap_print_fault(client, stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "%9s  %9s  %9s  %10s  %10s  %10s\n", "size", "direction", "MB/s",
+            "records/s", "allocs/MB", "syscalls/MB");
+    if (optind < argc) {
+        for (i = optind; i < argc; i++) {
+            if (atol(argv[i]) <= 0) {
+                fprintf(stderr, "ERROR: Invalid message size %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            run(client, server, 1, atol(argv[i]), total);
+            run(client, server, 0, atol(argv[i]), total);
+        }
+    } else {
+        for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+            run(client, server, 1, sizes[i], total);
+            run(client, server, 0, sizes[i], total);
+        }
+    }
+
+    soap_done(client);
+    free(client);
+    soap_done(server);
+    free(server);
+    return EXIT_SUCCESS;
+}
@@ -20,7 +20,7 @@
 #
 
 TEST_MODULE='CGSI-gSOAP'
-TEST_REQUIRES='cgsi-gsoap-client cgsi-gsoap-server glite-test-certs'
+TEST_REQUIRES='cgsi-gsoap-client cgsi-gsoap-server cgsi-gsoap-mt-server cgsi-gsoap-load glite-test-certs'
 export PATH=$PATH:.
 
 if [ -f 'shunit' ]; then
@@ -45,7 +45,7 @@ function server_start {
         echo "  export X509_USER_KEY=$X509_USER_KEY"
         #export CGSI_TRACE='yes'
     fi
-    cgsi-gsoap-server $@ >$tempbase.server.log 2>&1 &
+    ${TEST_SERVER:-cgsi-gsoap-server} $@ >$tempbase.server.log 2>&1 &
     echo $! >$tempbase.server.pid
 }
 
@@ -163,6 +163,151 @@ function test_delegation {
     server_stop
 }
 
+function test_large_payload {
+    echo "------------------------------------------------"
+    echo " echo throughput of large SOAP payloads"
+    echo "------------------------------------------------"
+
+    PORT=8115
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    server_start -r 20 -s -p $PORT -o
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme.pem
+    test_success "echoed 10 payloads of 1048576 bytes" cgsi-gsoap-client -b 1048576 -c 10 $ENDPOINT
+    test_success "echoed 10 payloads of 8388608 bytes" cgsi-gsoap-client -b 8388608 -c 10 $ENDPOINT
+
+    server_stop
+}
+
+function test_accept_step {
+    echo "------------------------------------------------"
+    echo " handshakes driven by cgsi_accept_step()"
+    echo "------------------------------------------------"
+
+    PORT=8116
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    server_start -r 5 -s -e -p $PORT -o
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme.pem
+    test_success /org.acme cgsi-gsoap-client $ENDPOINT
+    test_success "echoed 2 payloads of 1048576 bytes" cgsi-gsoap-client -b 1048576 -c 2 $ENDPOINT
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/vomswv-acme.pem
+    test_failure "CGSI-gSOAP: Cannot find certificate of AC issuer for vo org.acme" cgsi-gsoap-client $ENDPOINT
+
+    server_stop
+}
+
+function test_handshake_pool {
+    echo "------------------------------------------------"
+    echo " handshakes run by a pool of workers"
+    echo "------------------------------------------------"
+
+    PORT=8117
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    server_start -r 5 -s -w 2 -p $PORT -o
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme.pem
+    test_success /org.acme cgsi-gsoap-client $ENDPOINT
+    test_success "echoed 2 payloads of 1048576 bytes" cgsi-gsoap-client -b 1048576 -c 2 $ENDPOINT
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/vomswv-acme.pem
+    test_failure "CGSI-gSOAP: Cannot find certificate of AC issuer for vo org.acme" cgsi-gsoap-client $ENDPOINT
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme-Radmin.pem
+    test_success /org.acme/Role=Admin cgsi-gsoap-client $ENDPOINT
+
+    server_stop
+}
+
+function test_load {
+    echo "------------------------------------------------"
+    echo " concurrent load on the multi-threaded server"
+    echo "------------------------------------------------"
+
+    PORT=8118
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    TEST_SERVER=cgsi-gsoap-mt-server server_start -t 4 -s -p $PORT -o
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme.pem
+    test_success "40 requests succeeded, 0 failed" cgsi-gsoap-load -c 4 -n 40 $ENDPOINT
+    test_success "200 requests succeeded, 0 failed" cgsi-gsoap-load -c 4 -n 200 -k -b 65536 $ENDPOINT
+
+    server_stop
+
+    echo "------------------------------------------------"
+    echo " concurrent load with a pool of handshake workers"
+    echo "------------------------------------------------"
+
+    PORT=8119
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    TEST_SERVER=cgsi-gsoap-mt-server server_start -t 4 -w 2 -s -p $PORT -o
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme.pem
+    test_success "40 requests succeeded, 0 failed" cgsi-gsoap-load -c 8 -n 40 $ENDPOINT
+
+    server_stop
+}
+
+function test_session_resume {
+    echo "------------------------------------------------"
+    echo " resumption of the TLS sessions of the clients"
+    echo "------------------------------------------------"
+
+    PORT=8121
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    server_start -r 6 -s -c -p $PORT
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    # the attributes of the resumed connections are checked against
+    # those of the first one by the client
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme-Radmin.pem
+    test_success /org.acme/Role=Admin cgsi-gsoap-client -r 3 $ENDPOINT
+    test_success "2 of 3 connections resumed their TLS session" cgsi-gsoap-client -r 3 $ENDPOINT
+
+    server_stop
+
+    echo "------------------------------------------------"
+    echo " session resumption with explicit VOMS parsing"
+    echo "------------------------------------------------"
+
+    PORT=8122
+    ENDPOINT="https://localhost:$PORT/cgsi-gsoap-test"
+
+    server_start -r 3 -s -c -p $PORT -o
+
+    unset X509_USER_CERT
+    unset X509_USER_KEY
+
+    export X509_USER_PROXY=$TEST_CERT_DIR/home/voms-acme.pem
+    test_success "2 of 3 connections resumed their TLS session" cgsi-gsoap-client -r 3 $ENDPOINT
+
+    server_stop
+}
+
 function test_stress {
     echo "---------------------------------------"
     echo " stress test with explicit VOMS parsing"
@@ -193,6 +338,11 @@ test_old_behaviour
 test_new_behaviour
 test_plain_proxy
 test_delegation
+test_large_payload
+test_accept_step
+test_handshake_pool
+test_load
+test_session_resume
 #test_stress
 
 test_summary